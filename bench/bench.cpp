@@ -0,0 +1,392 @@
+/**
+ * @file
+ * @brief  Stack micro-benchmark
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * It measures push/pop throughput and latency percentiles for a range of stack sizes:
+ *   stack_t by default,
+ *   sstack_t with --segmented,
+ *   push_fast()/pop_fast() with --fast.
+ * Protection and log flags are set at compile time, BENCH_VARIANT names the build (see makefile).
+ *
+ * Output is CSV, one line per size and operation:
+ * variant,verify,hash,size,op,mops,p50_ns,p99_ns,p999_ns,max_ns
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include "../src/include/stack.h"
+#include "../src/include/sstack.h"
+#include "../src/include/log.h"
+
+#ifndef BENCH_VARIANT
+#define BENCH_VARIANT "default"
+#endif /* BENCH_VARIANT */
+
+static const size_t MIN_SIZE     = 1000;
+static const size_t MAX_SIZE     = 100000000;
+static const size_t LOG_MAX_SIZE = 1000000;   /**< Trace log of larger runs is too large */
+static const size_t MIN_OPS      = 10000000;  /**< Operations per size and operation    */
+static const size_t MAX_SAMPLES  = 1000000;   /**< Latency samples per size and operation */
+
+typedef std::chrono::steady_clock bench_clock;
+
+static volatile item_t SINK = 0; /**< Keeps popped items alive */
+
+static const char *const VERIFY_NAMES[] = {"none", "struct", "sampled", "dirty", "full"};
+static const char *const HASH_NAMES[]   = {"murmur", "multilane", "crc32c"};
+
+/**
+ * @brief Benchmark options
+ */
+struct bench_opts_t {
+        size_t min_size = MIN_SIZE;
+        size_t max_size = MAX_SIZE;
+        int    verify   = VERIFY_STRUCT;
+        int    hash     = HASH_MURMUR;
+        bool   segmented = false; /**< Benchmark sstack_t */
+        bool   fast      = false; /**< Benchmark fast path  */
+};
+
+/**
+ * @brief Stack used by the fast path
+ */
+struct fast_stack_t {
+        stack_t stk;
+};
+
+/**
+ * @brief Operation result
+ */
+struct bench_result_t {
+        double mops   = 0; /**< Millions of operations per second */
+        double p50    = 0;
+        double p99    = 0;
+        double p999   = 0;
+        double max    = 0;
+};
+
+static inline double elapsed_ns(bench_clock::time_point start, bench_clock::time_point end)
+{
+        return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
+
+static int parse_opts(bench_opts_t *const opts, int argc, char *argv[])
+{
+        for (int i = 1; i < argc; i++) {
+                if (!strcmp(argv[i], "--min-size") && i + 1 < argc) {
+                        opts->min_size = strtoull(argv[++i], nullptr, 10);
+                } else if (!strcmp(argv[i], "--max-size") && i + 1 < argc) {
+                        opts->max_size = strtoull(argv[++i], nullptr, 10);
+                } else if (!strcmp(argv[i], "--verify") && i + 1 < argc) {
+                        const char *name = argv[++i];
+
+                        opts->verify = -1;
+                        for (int lvl = VERIFY_NONE; lvl <= VERIFY_FULL; lvl++)
+                                if (!strcmp(name, VERIFY_NAMES[lvl]))
+                                        opts->verify = lvl;
+
+                        if (opts->verify < 0) {
+                                fprintf(stderr, "Unknown verification level: %s\n", name);
+                                return 1;
+                        }
+                } else if (!strcmp(argv[i], "--hash") && i + 1 < argc) {
+                        const char *name = argv[++i];
+
+                        opts->hash = -1;
+                        for (int kind = HASH_MURMUR; kind <= HASH_CRC32C; kind++)
+                                if (!strcmp(name, HASH_NAMES[kind]))
+                                        opts->hash = kind;
+
+                        if (opts->hash < 0) {
+                                fprintf(stderr, "Unknown hash kernel: %s\n", name);
+                                return 1;
+                        }
+                } else if (!strcmp(argv[i], "--segmented")) {
+                        opts->segmented = true;
+                } else if (!strcmp(argv[i], "--fast")) {
+                        opts->fast = true;
+                } else {
+                        fprintf(stderr, "Usage: %s [--min-size N] [--max-size N] "
+                                        "[--verify none|struct|sampled|dirty|full] "
+                                        "[--hash murmur|multilane|crc32c] [--segmented] [--fast]\n", argv[0]);
+                        return 1;
+                }
+        }
+
+        if (opts->min_size == 0 || opts->min_size > opts->max_size) {
+                fprintf(stderr, "Invalid size range\n");
+                return 1;
+        }
+
+        return 0;
+}
+
+static void percentiles(std::vector<float> *const samples, bench_result_t *const res)
+{
+        if (samples->empty())
+                return;
+
+        std::sort(samples->begin(), samples->end());
+        size_t n = samples->size();
+
+        res->p50  = (*samples)[n / 2];
+        res->p99  = (*samples)[n * 99  / 100];
+        res->p999 = (*samples)[n * 999 / 1000];
+        res->max  = (*samples)[n - 1];
+}
+
+static int make_stack(stack_t *const stk, const bench_opts_t *const opts)
+{
+        int err = 0;
+
+        stack_params_t params = {};
+        params.hash_kind = opts->hash;
+
+        construct_stack(stk, &params, &err);
+        if (!err)
+                set_verify_policy(stk, opts->verify, VERIFY_PERIOD, &err);
+
+#ifdef STACK_STATS
+        if (!err)
+                enable_stack_stats(stk, &err);
+#endif /* STACK_STATS */
+
+        return err;
+}
+
+/**
+ * @brief Fast path needs unpoisoned stack
+ */
+static int make_stack(fast_stack_t *const stk, const bench_opts_t *const opts)
+{
+        int err = 0;
+
+        stack_params_t params = {};
+        params.hash_kind = opts->hash;
+        params.poison    = POISON_NONE;
+
+        construct_stack(&stk->stk, &params, &err);
+        if (!err)
+                set_verify_policy(&stk->stk, opts->verify, VERIFY_PERIOD, &err);
+
+        return err;
+}
+
+/**
+ * @brief Segmented stack has its own fixed verification and hash kernel
+ */
+static int make_stack(sstack_t *const stk, const bench_opts_t *const /* opts */)
+{
+        int err = 0;
+        construct_sstack(stk, nullptr, &err);
+
+        return err;
+}
+
+static inline void bench_push(stack_t *const stk, const item_t item, int *const error)
+{
+        push_stack(stk, item, error);
+}
+
+static inline void bench_push(fast_stack_t *const stk, const item_t item, int *const error)
+{
+        push_fast(&stk->stk, item, error);
+}
+
+static inline void bench_push(sstack_t *const stk, const item_t item, int *const error)
+{
+        push_sstack(stk, item, error);
+}
+
+static inline item_t bench_pop(stack_t *const stk, int *const error)
+{
+        return pop_stack(stk, error);
+}
+
+static inline item_t bench_pop(fast_stack_t *const stk, int *const error)
+{
+        return pop_fast(&stk->stk, error);
+}
+
+static inline item_t bench_pop(sstack_t *const stk, int *const error)
+{
+        return pop_sstack(stk, error);
+}
+
+static inline void bench_destruct(stack_t *const stk)
+{
+        destruct_stack(stk);
+}
+
+static inline void bench_destruct(fast_stack_t *const stk)
+{
+        destruct_stack(&stk->stk);
+}
+
+static inline void bench_destruct(sstack_t *const stk)
+{
+        destruct_sstack(stk);
+}
+
+/**
+ * @brief Measures throughput
+ *
+ * Stack grows from empty to size items and shrinks back reps times.
+ */
+template <typename Stack>
+static int run_throughput(const bench_opts_t *const opts, const size_t size, const size_t reps,
+                          bench_result_t *const push, bench_result_t *const pop)
+{
+        double   push_ns = 0;
+        double   pop_ns  = 0;
+        uint64_t sum     = 0; /* Unsigned, so it wraps instead of overflowing */
+        int      err     = 0;
+
+        for (size_t r = 0; r < reps && !err; r++) {
+                Stack stk = {};
+                err = make_stack(&stk, opts);
+
+                bench_clock::time_point start = bench_clock::now();
+                for (size_t i = 0; i < size && !err; i++)
+                        bench_push(&stk, (item_t)i, &err);
+
+                bench_clock::time_point mid = bench_clock::now();
+                for (size_t i = 0; i < size && !err; i++)
+                        sum += (uint64_t)bench_pop(&stk, &err);
+
+                bench_clock::time_point end = bench_clock::now();
+
+                push_ns += elapsed_ns(start, mid);
+                pop_ns  += elapsed_ns(mid, end);
+
+                bench_destruct(&stk);
+        }
+
+        SINK = (item_t)sum;
+
+        push->mops = (double)(size * reps) / push_ns * 1e3;
+        pop->mops  = (double)(size * reps) / pop_ns  * 1e3;
+
+        return err;
+}
+
+/**
+ * @brief Measures latency
+ *
+ * Every stride-th operation is timed separately.
+ */
+template <typename Stack>
+static int run_latency(const bench_opts_t *const opts, const size_t size,
+                       bench_result_t *const push, bench_result_t *const pop)
+{
+        const size_t stride = size > MAX_SAMPLES ? size / MAX_SAMPLES : 1;
+        int err = 0;
+
+        std::vector<float> push_samples;
+        std::vector<float> pop_samples;
+        push_samples.reserve(size / stride + 1);
+        pop_samples.reserve(size / stride + 1);
+
+        Stack stk = {};
+        err = make_stack(&stk, opts);
+
+        for (size_t i = 0; i < size && !err; i++) {
+                if (i % stride) {
+                        bench_push(&stk, (item_t)i, &err);
+                        continue;
+                }
+
+                bench_clock::time_point start = bench_clock::now();
+                bench_push(&stk, (item_t)i, &err);
+                push_samples.push_back((float)elapsed_ns(start, bench_clock::now()));
+        }
+
+        for (size_t i = 0; i < size && !err; i++) {
+                if (i % stride) {
+                        bench_pop(&stk, &err);
+                        continue;
+                }
+
+                bench_clock::time_point start = bench_clock::now();
+                bench_pop(&stk, &err);
+                pop_samples.push_back((float)elapsed_ns(start, bench_clock::now()));
+        }
+
+        bench_destruct(&stk);
+
+        percentiles(&push_samples, push);
+        percentiles(&pop_samples,  pop);
+
+        return err;
+}
+
+static void print_result(const bench_opts_t *const opts, const size_t size,
+                         const char *const op, const bench_result_t *const res)
+{
+        printf("%s,%s,%s,%zu,%s,%.2f,%.0f,%.0f,%.0f,%.0f\n", BENCH_VARIANT, 
+               VERIFY_NAMES[opts->verify], HASH_NAMES[opts->hash],
+               size, op, res->mops, res->p50, res->p99, res->p999, res->max);
+        fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+        bench_opts_t opts = {};
+        if (parse_opts(&opts, argc, argv))
+                return EXIT_FAILURE;
+
+        size_t max_size = opts.max_size;
+
+#if !defined(NOLOG) && LOG_LEVEL == LOG_TRACE
+        if (max_size > LOG_MAX_SIZE)
+                max_size = LOG_MAX_SIZE;
+#endif
+
+        for (size_t size = opts.min_size; size <= max_size; size *= 10) {
+                bench_result_t push = {};
+                bench_result_t pop  = {};
+
+                size_t reps = MIN_OPS / size;
+                if (reps == 0)
+                        reps = 1;
+
+                int err = 0;
+                if (opts.segmented) {
+                        err = run_throughput<sstack_t>(&opts, size, reps, &push, &pop);
+                        if (!err)
+                                err = run_latency<sstack_t>(&opts, size, &push, &pop);
+                } else if (opts.fast) {
+                        err = run_throughput<fast_stack_t>(&opts, size, reps, &push, &pop);
+                        if (!err)
+                                err = run_latency<fast_stack_t>(&opts, size, &push, &pop);
+                } else {
+                        err = run_throughput<stack_t>(&opts, size, reps, &push, &pop);
+                        if (!err)
+                                err = run_latency<stack_t>(&opts, size, &push, &pop);
+                }
+
+                if (err) {
+                        fprintf(stderr, "%s: stack error %x at size %zu\n", BENCH_VARIANT, (unsigned)err, size);
+                        return EXIT_FAILURE;
+                }
+
+                const char *prefix = opts.segmented ? "seg_" : opts.fast ? "fast_" : "";
+                char push_op[16] = {};
+                char pop_op[16]  = {};
+                snprintf(push_op, sizeof(push_op), "%spush", prefix);
+                snprintf(pop_op,  sizeof(pop_op),  "%spop",  prefix);
+
+                print_result(&opts, size, push_op, &push);
+                print_result(&opts, size, pop_op,  &pop);
+        }
+
+        return EXIT_SUCCESS;
+}
+
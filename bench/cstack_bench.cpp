@@ -0,0 +1,187 @@
+/**
+ * @file
+ * @brief  Concurrent stack benchmark
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * It measures push/pop throughput of cstack_t, of sharded pool spool_t 
+ * and of stack_t guarded by a mutex for 1 to 64 threads. 
+ * Every thread pushes and pops items in turns.
+ *
+ * Output is CSV, one line per implementation and threads number:
+ * impl,threads,mops
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include "../src/include/cstack.h"
+#include "../src/include/spool.h"
+
+static const size_t MAX_THREADS = 64;
+static const size_t OPS         = 4000000; /**< Push/pop pairs per run */
+
+typedef std::chrono::steady_clock bench_clock;
+
+static volatile item_t SINK = 0; /**< Keeps popped items alive */
+
+/**
+ * @brief stack_t guarded by a mutex
+ */
+struct locked_stack_t {
+        std::mutex lock;
+        stack_t    stk = {};
+};
+
+static void cstack_worker(cstack_t *const stk, const size_t /* id */, const size_t ops, 
+                          int *const error)
+{
+        item_t sum = 0;
+
+        for (size_t i = 0; i < ops && !*error; i++) {
+                push_cstack(stk, (item_t)i, error);
+
+                int err = 0;
+                sum += pop_cstack(stk, &err);
+                if (err && err != STK_EMPTY_POP)
+                        *error = err;
+        }
+
+        SINK = sum;
+}
+
+static void locked_worker(locked_stack_t *const lstk, const size_t /* id */, const size_t ops,
+                          int *const error)
+{
+        item_t sum = 0;
+
+        for (size_t i = 0; i < ops && !*error; i++) {
+                {
+                        std::lock_guard<std::mutex> guard(lstk->lock);
+                        push_stack(&lstk->stk, (item_t)i, error);
+                }
+
+                int err = 0;
+                {
+                        std::lock_guard<std::mutex> guard(lstk->lock);
+                        sum += pop_stack(&lstk->stk, &err);
+                }
+                if (err && err != STK_EMPTY_POP)
+                        *error = err;
+        }
+
+        SINK = sum;
+}
+
+static void spool_worker(spool_t *const pool, const size_t id, const size_t ops, int *const error)
+{
+        item_t sum = 0;
+
+        for (size_t i = 0; i < ops && !*error; i++) {
+                push_spool(pool, id, (item_t)i, error);
+
+                int err = 0;
+                sum += pop_spool(pool, id, &err);
+                if (err && err != STK_EMPTY_POP)
+                        *error = err;
+        }
+
+        SINK = sum;
+}
+
+/**
+ * @brief Runs workers and measures throughput
+ *
+ * @return Millions of operations per second or negative value in case of an error.
+ */
+template <typename Stack, typename Worker>
+static double run(Stack *const stk, Worker worker, const size_t n_threads)
+{
+        const size_t ops = OPS / n_threads;
+
+        std::vector<std::thread> threads;
+        std::vector<int> errors(n_threads, 0);
+
+        bench_clock::time_point start = bench_clock::now();
+
+        for (size_t i = 0; i < n_threads; i++)
+                threads.emplace_back(worker, stk, i, ops, &errors[i]);
+
+        for (size_t i = 0; i < n_threads; i++)
+                threads[i].join();
+
+        bench_clock::time_point end = bench_clock::now();
+
+        for (size_t i = 0; i < n_threads; i++) {
+                if (errors[i]) {
+                        fprintf(stderr, "Stack error %x with %zu threads\n", (unsigned)errors[i], n_threads);
+                        return -1;
+                }
+        }
+
+        double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        return (double)(2 * ops * n_threads) / ns * 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+        size_t max_threads = MAX_THREADS;
+
+        if (argc == 3 && !strcmp(argv[1], "--max-threads")) {
+                max_threads = strtoull(argv[2], nullptr, 10);
+        } else if (argc != 1) {
+                fprintf(stderr, "Usage: %s [--max-threads N]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        printf("impl,threads,mops\n");
+
+        for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+                cstack_t cstk = {};
+                construct_cstack(&cstk);
+
+                double mops = run(&cstk, cstack_worker, n_threads);
+                destruct_cstack(&cstk);
+
+                if (mops < 0)
+                        return EXIT_FAILURE;
+
+                printf("cstack,%zu,%.2f\n", n_threads, mops);
+
+                locked_stack_t lstk;
+                construct_stack(&lstk.stk);
+
+                mops = run(&lstk, locked_worker, n_threads);
+                destruct_stack(&lstk.stk);
+
+                if (mops < 0)
+                        return EXIT_FAILURE;
+
+                printf("mutex,%zu,%.2f\n", n_threads, mops);
+
+                spool_t pool = {};
+                int err = 0;
+
+                construct_spool(&pool, n_threads, &err);
+                if (err) {
+                        fprintf(stderr, "Can't create pool: %x\n", (unsigned)err);
+                        return EXIT_FAILURE;
+                }
+
+                mops = run(&pool, spool_worker, n_threads);
+                destruct_spool(&pool);
+
+                if (mops < 0)
+                        return EXIT_FAILURE;
+
+                printf("spool,%zu,%.2f\n", n_threads, mops);
+                fflush(stdout);
+        }
+
+        return EXIT_SUCCESS;
+}
+
@@ -0,0 +1,472 @@
+/**
+ * @file
+ * @brief  Bytecode VM workload
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * It runs random RPN programs on a small bytecode evaluator whose operand
+ * stack is stack_t. Operation mix and depth distribution are set by options,
+ * so the access pattern is close to an expression evaluating VM.
+ * Protection and log flags are set at compile time, BENCH_VARIANT names the build (see makefile).
+ *
+ * Every result is checked by the same evaluator on a plain array.
+ *
+ * Output is CSV, one line per depth:
+ * variant,verify,path,dist,depth,programs,ops,mops,checksum
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+#include <random>
+#include "../src/include/stack.h"
+#include "../src/include/log.h"
+
+#ifndef BENCH_VARIANT
+#define BENCH_VARIANT "default"
+#endif /* BENCH_VARIANT */
+
+static const size_t VM_OPS       = 20000000;  /**< Operations per depth          */
+static const size_t VM_LENGTH    = 512;       /**< Operations per program        */
+static const size_t VM_MAX_DEPTH = 1 << 20;
+static const size_t LOG_MAX_OPS  = 1000000;   /**< Trace log of larger runs is too large */
+
+static const size_t VM_DEPTHS[]  = {8, 64, 1024, 65536};
+
+typedef std::chrono::steady_clock bench_clock;
+
+static volatile uint64_t SINK = 0; /**< Keeps results alive */
+
+static const char *const VERIFY_NAMES[] = {"none", "struct", "sampled", "dirty", "full"};
+static const char *const DIST_NAMES[]   = {"fixed", "uniform", "geometric"};
+
+/**
+ * @brief VM opcodes
+ *
+ * PUSH is followed by its item. HALT pops the rest of the stack to the result.
+ */
+enum vm_op_t {
+        OP_PUSH = 0,
+        OP_ADD  = 1,
+        OP_SUB  = 2,
+        OP_MUL  = 3,
+        OP_XOR  = 4,
+        OP_NEG  = 5,
+        OP_DUP  = 6,
+        OP_SWAP = 7,
+        OP_OVER = 8,
+        OP_DROP = 9,
+        OP_HALT = 10,
+};
+
+/**
+ * @brief Depth distributions
+ *
+ * Every program gets its own depth limit: the given one (fixed),
+ * uniform from 2 to the given one or geometric with mean of a quarter of it.
+ */
+enum vm_dist_t {
+        DIST_FIXED     = 0,
+        DIST_UNIFORM   = 1,
+        DIST_GEOMETRIC = 2,
+};
+
+/**
+ * @brief Workload options
+ *
+ * Mix is weights of pushes, arithmetic (binary and unary) and
+ * stack shuffles (dup, swap, over, drop).
+ */
+struct vm_opts_t {
+        size_t   ops      = VM_OPS;
+        size_t   length   = VM_LENGTH;
+        size_t   depth    = 0;            /**< Depth limit (0 - VM_DEPTHS sweep) */
+        int      dist     = DIST_UNIFORM;
+        unsigned mix[3]   = {40, 40, 20};
+        int      verify   = VERIFY_STRUCT;
+        bool     fast     = false;        /**< Use push_fast()/pop_fast()        */
+        unsigned seed     = 1;
+};
+
+/**
+ * @brief Compiled programs
+ */
+struct vm_code_t {
+        std::vector<uint8_t> code;
+        size_t programs = 0;
+        size_t ops      = 0; /**< Stack operations (pushes and pops) */
+};
+
+/**
+ * @brief Plain array operand stack
+ *
+ * It is the reference for results.
+ */
+struct vm_array_t {
+        std::vector<item_t> items;
+};
+
+static inline double elapsed_ns(bench_clock::time_point start, bench_clock::time_point end)
+{
+        return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
+
+static int parse_opts(vm_opts_t *const opts, int argc, char *argv[])
+{
+        for (int i = 1; i < argc; i++) {
+                if (!strcmp(argv[i], "--ops") && i + 1 < argc) {
+                        opts->ops = strtoull(argv[++i], nullptr, 10);
+                } else if (!strcmp(argv[i], "--length") && i + 1 < argc) {
+                        opts->length = strtoull(argv[++i], nullptr, 10);
+                } else if (!strcmp(argv[i], "--depth") && i + 1 < argc) {
+                        opts->depth = strtoull(argv[++i], nullptr, 10);
+                } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+                        opts->seed = (unsigned)strtoul(argv[++i], nullptr, 10);
+                } else if (!strcmp(argv[i], "--mix") && i + 1 < argc) {
+                        if (sscanf(argv[++i], "%u,%u,%u", &opts->mix[0], &opts->mix[1], &opts->mix[2]) != 3 ||
+                            opts->mix[0] == 0 || opts->mix[0] + opts->mix[1] + opts->mix[2] == opts->mix[0]) {
+                                fprintf(stderr, "Mix is PUSH,ARITH,SHUFFLE weights, push and another one must be set\n");
+                                return 1;
+                        }
+                } else if (!strcmp(argv[i], "--dist") && i + 1 < argc) {
+                        const char *name = argv[++i];
+
+                        opts->dist = -1;
+                        for (int dist = DIST_FIXED; dist <= DIST_GEOMETRIC; dist++)
+                                if (!strcmp(name, DIST_NAMES[dist]))
+                                        opts->dist = dist;
+
+                        if (opts->dist < 0) {
+                                fprintf(stderr, "Unknown depth distribution: %s\n", name);
+                                return 1;
+                        }
+                } else if (!strcmp(argv[i], "--verify") && i + 1 < argc) {
+                        const char *name = argv[++i];
+
+                        opts->verify = -1;
+                        for (int lvl = VERIFY_NONE; lvl <= VERIFY_FULL; lvl++)
+                                if (!strcmp(name, VERIFY_NAMES[lvl]))
+                                        opts->verify = lvl;
+
+                        if (opts->verify < 0) {
+                                fprintf(stderr, "Unknown verification level: %s\n", name);
+                                return 1;
+                        }
+                } else if (!strcmp(argv[i], "--fast")) {
+                        opts->fast = true;
+                } else {
+                        fprintf(stderr, "Usage: %s [--ops N] [--length N] [--depth N] "
+                                        "[--dist fixed|uniform|geometric] [--mix PUSH,ARITH,SHUFFLE] "
+                                        "[--verify none|struct|sampled|dirty|full] [--fast] [--seed N]\n", argv[0]);
+                        return 1;
+                }
+        }
+
+        if (opts->ops == 0 || opts->length < 2 || opts->depth == 1 || opts->depth > VM_MAX_DEPTH) {
+                fprintf(stderr, "Invalid workload size\n");
+                return 1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Draws depth limit of a program
+ */
+static size_t program_depth(const vm_opts_t *const opts, const size_t depth, std::mt19937 *const rng)
+{
+        switch (opts->dist) {
+        case DIST_FIXED:
+                return depth;
+        case DIST_GEOMETRIC: {
+                std::geometric_distribution<size_t> geom(depth > 4 ? 4.0 / (double)depth : 1.0);
+                size_t limit = 2 + geom(*rng);
+                return limit < depth ? limit : depth;
+        }
+        case DIST_UNIFORM:
+        default:
+                return std::uniform_int_distribution<size_t>(2, depth)(*rng);
+        }
+}
+
+static inline void emit_push(vm_code_t *const vm, const item_t item)
+{
+        uint8_t bytes[sizeof(item_t)] = {};
+        memcpy(bytes, &item, sizeof(item_t));
+
+        vm->code.push_back(OP_PUSH);
+        vm->code.insert(vm->code.end(), bytes, bytes + sizeof(item_t));
+        vm->ops++;
+}
+
+/**
+ * @brief Generates programs
+ *
+ * Program is a random walk of the stack depth from 0 to its limit and back:
+ * operations are drawn by the mix, pushes are not drawn at the limit and
+ * pops are not drawn below their arity. HALT empties the stack.
+ */
+static void compile(const vm_opts_t *const opts, const size_t depth, vm_code_t *const vm)
+{
+        std::mt19937 rng(opts->seed);
+        const unsigned total = opts->mix[0] + opts->mix[1] + opts->mix[2];
+
+        vm->code.clear();
+        vm->programs = 0;
+        vm->ops      = 0;
+
+        while (vm->ops < opts->ops) {
+                const size_t limit = program_depth(opts, depth, &rng);
+                size_t size = 0;
+
+                for (size_t n = 0; n < opts->length; n++) {
+                        unsigned pick = std::uniform_int_distribution<unsigned>(0, total - 1)(rng);
+
+                        if (size >= limit)
+                                pick = opts->mix[0] + (pick % (total - opts->mix[0]));
+                        if (size < 2)
+                                pick = 0;
+
+                        if (pick < opts->mix[0]) {
+                                emit_push(vm, (item_t)(rng() & 0xFFFF));
+                                size++;
+                        } else if (pick < opts->mix[0] + opts->mix[1]) {
+                                /* Binary ops pop 2 and push 1, NEG pops 1 and pushes 1 */
+                                uint8_t op = (uint8_t)(OP_ADD + rng() % (OP_NEG - OP_ADD + 1));
+                                vm->code.push_back(op);
+                                vm->ops += op == OP_NEG ? 2 : 3;
+                                size    -= op == OP_NEG ? 0 : 1;
+                        } else {
+                                uint8_t op = (uint8_t)(OP_DUP + rng() % (OP_DROP - OP_DUP + 1));
+                                if (size >= limit && (op == OP_DUP || op == OP_OVER))
+                                        op = OP_DROP;
+
+                                vm->code.push_back(op);
+                                switch (op) {
+                                case OP_DUP:  vm->ops += 3; size++; break;
+                                case OP_SWAP: vm->ops += 4;         break;
+                                case OP_OVER: vm->ops += 5; size++; break;
+                                case OP_DROP:
+                                default:      vm->ops += 1; size--; break;
+                                }
+                        }
+                }
+
+                vm->code.push_back(OP_HALT);
+                vm->ops += size;
+                vm->programs++;
+        }
+}
+
+static inline void vm_push(stack_t *const stk, const item_t item, int *const error, const bool fast)
+{
+        if (fast)
+                push_fast(stk, item, error);
+        else
+                push_stack(stk, item, error);
+}
+
+static inline item_t vm_pop(stack_t *const stk, int *const error, const bool fast)
+{
+        return fast ? pop_fast(stk, error) : pop_stack(stk, error);
+}
+
+static inline size_t vm_size(const stack_t *const stk)
+{
+        return stk->size;
+}
+
+static inline void vm_push(vm_array_t *const stk, const item_t item, int *const /* error */, const bool /* fast */)
+{
+        stk->items.push_back(item);
+}
+
+static inline item_t vm_pop(vm_array_t *const stk, int *const /* error */, const bool /* fast */)
+{
+        item_t item = stk->items.back();
+        stk->items.pop_back();
+        return item;
+}
+
+static inline size_t vm_size(const vm_array_t *const stk)
+{
+        return stk->items.size();
+}
+
+/**
+ * @brief Wrapping arithmetic, signed overflow is undefined
+ */
+static inline item_t wrap(const uint32_t value)
+{
+        return (item_t)value;
+}
+
+/**
+ * @brief Runs programs
+ *
+ * Fast is a template parameter, so the dispatch loop has no extra branch.
+ *
+ * @return Checksum of program results
+ */
+template <bool Fast, typename Stack>
+static uint64_t run(const vm_code_t *const vm, Stack *const stk, int *const error)
+{
+        const uint8_t *pc  = vm->code.data();
+        const uint8_t *end = pc + vm->code.size();
+        uint64_t checksum  = 0;
+        int err            = 0;
+
+        while (pc < end && !err) {
+                item_t a = 0;
+                item_t b = 0;
+
+                switch (*pc++) {
+                case OP_PUSH:
+                        memcpy(&a, pc, sizeof(item_t));
+                        pc += sizeof(item_t);
+                        vm_push(stk, a, &err, Fast);
+                        break;
+                case OP_ADD:
+                        b = vm_pop(stk, &err, Fast);
+                        a = vm_pop(stk, &err, Fast);
+                        vm_push(stk, wrap((uint32_t)a + (uint32_t)b), &err, Fast);
+                        break;
+                case OP_SUB:
+                        b = vm_pop(stk, &err, Fast);
+                        a = vm_pop(stk, &err, Fast);
+                        vm_push(stk, wrap((uint32_t)a - (uint32_t)b), &err, Fast);
+                        break;
+                case OP_MUL:
+                        b = vm_pop(stk, &err, Fast);
+                        a = vm_pop(stk, &err, Fast);
+                        vm_push(stk, wrap((uint32_t)a * (uint32_t)b), &err, Fast);
+                        break;
+                case OP_XOR:
+                        b = vm_pop(stk, &err, Fast);
+                        a = vm_pop(stk, &err, Fast);
+                        vm_push(stk, a ^ b, &err, Fast);
+                        break;
+                case OP_NEG:
+                        a = vm_pop(stk, &err, Fast);
+                        vm_push(stk, wrap(0u - (uint32_t)a), &err, Fast);
+                        break;
+                case OP_DUP:
+                        a = vm_pop(stk, &err, Fast);
+                        vm_push(stk, a, &err, Fast);
+                        vm_push(stk, a, &err, Fast);
+                        break;
+                case OP_SWAP:
+                        b = vm_pop(stk, &err, Fast);
+                        a = vm_pop(stk, &err, Fast);
+                        vm_push(stk, b, &err, Fast);
+                        vm_push(stk, a, &err, Fast);
+                        break;
+                case OP_OVER:
+                        b = vm_pop(stk, &err, Fast);
+                        a = vm_pop(stk, &err, Fast);
+                        vm_push(stk, a, &err, Fast);
+                        vm_push(stk, b, &err, Fast);
+                        vm_push(stk, a, &err, Fast);
+                        break;
+                case OP_DROP:
+                        vm_pop(stk, &err, Fast);
+                        break;
+                case OP_HALT:
+                default:
+                        while (vm_size(stk) && !err)
+                                checksum = checksum * 31 + (uint32_t)vm_pop(stk, &err, Fast);
+                        break;
+                }
+        }
+
+        if (err)
+                *error = err;
+
+        return checksum;
+}
+
+static int make_stack(stack_t *const stk, const vm_opts_t *const opts)
+{
+        int err = 0;
+
+        stack_params_t params = {};
+        if (opts->fast)
+                params.poison = POISON_NONE;
+
+        construct_stack(stk, &params, &err);
+        if (!err)
+                set_verify_policy(stk, opts->verify, VERIFY_PERIOD, &err);
+
+#ifdef STACK_STATS
+        if (!err)
+                enable_stack_stats(stk, &err);
+#endif /* STACK_STATS */
+
+        return err;
+}
+
+static int run_depth(const vm_opts_t *const opts, const size_t depth, vm_code_t *const vm)
+{
+        compile(opts, depth, vm);
+
+        vm_array_t array = {};
+        int err = 0;
+        uint64_t expected = run<false>(vm, &array, &err);
+
+        stack_t stk = {};
+        err = make_stack(&stk, opts);
+        if (err)
+                return err;
+
+        bench_clock::time_point start = bench_clock::now();
+        uint64_t checksum = opts->fast ? run<true>(vm, &stk, &err) : run<false>(vm, &stk, &err);
+        double ns = elapsed_ns(start, bench_clock::now());
+
+        destruct_stack(&stk);
+        SINK = checksum;
+
+        if (err)
+                return err;
+
+        if (checksum != expected) {
+                fprintf(stderr, "%s: wrong result at depth %zu\n", BENCH_VARIANT, depth);
+                return STK_INVALID;
+        }
+
+        printf("%s,%s,%s,%s,%zu,%zu,%zu,%.2f,%016llx\n", BENCH_VARIANT, VERIFY_NAMES[opts->verify],
+               opts->fast ? "fast" : "slow", DIST_NAMES[opts->dist], depth, vm->programs, vm->ops,
+               (double)vm->ops / ns * 1e3, (unsigned long long)checksum);
+        fflush(stdout);
+
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        vm_opts_t opts = {};
+        if (parse_opts(&opts, argc, argv))
+                return EXIT_FAILURE;
+
+#if !defined(NOLOG) && LOG_LEVEL == LOG_TRACE
+        if (opts.ops > LOG_MAX_OPS)
+                opts.ops = LOG_MAX_OPS;
+#endif
+
+        vm_code_t vm = {};
+
+        const size_t n_depths = opts.depth ? 1 : sizeof(VM_DEPTHS) / sizeof(VM_DEPTHS[0]);
+        for (size_t i = 0; i < n_depths; i++) {
+                const size_t depth = opts.depth ? opts.depth : VM_DEPTHS[i];
+
+                int err = run_depth(&opts, depth, &vm);
+                if (err) {
+                        fprintf(stderr, "%s: stack error %x at depth %zu\n", BENCH_VARIANT, (unsigned)err, depth);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,850 @@
+/**
+ * @file
+ * @brief  Stack allocators
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <new>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "include/alloc.h"
+
+static const size_t POOL_CLASSES = 12; /**< log2(POOL_MAX_BLOCK / POOL_MIN_BLOCK) + 1 */
+
+static_assert((POOL_MIN_BLOCK << (POOL_CLASSES - 1)) == POOL_MAX_BLOCK,
+              "Pool size classes don't match POOL_MAX_BLOCK");
+
+/**
+ * @brief Free block
+ *
+ * Free blocks form a list through their first bytes.
+ */
+struct pool_block_t {
+        pool_block_t *next;
+};
+
+/**
+ * @brief Thread-local pool
+ */
+struct pool_t {
+        pool_block_t *free_list[POOL_CLASSES] = {};
+        size_t        n_free[POOL_CLASSES]    = {};
+
+        pool_stats_t  stats = {};
+
+        pool_t() = default;
+        pool_t(const pool_t &) = delete;
+        pool_t &operator=(const pool_t &) = delete;
+
+        ~pool_t() { pool_release(); }
+};
+
+static thread_local pool_t POOL;
+
+/**
+ * @brief File mapping
+ *
+ * Mapping covers the header and the block.
+ */
+struct map_file_t {
+        stack_alloc_t alloc    = {};
+        int           fd       = -1;
+        char         *map      = nullptr;
+        size_t        map_size = 0;
+        bool          used     = false; /**< Block is allocated */
+};
+
+static void *libc_alloc  (void *ctx, size_t size);
+static void *libc_realloc(void *ctx, void *ptr, size_t old_size, size_t size);
+static void  libc_free   (void *ctx, void *ptr, size_t size);
+
+static void *pool_alloc  (void *ctx, size_t size);
+static void *pool_realloc(void *ctx, void *ptr, size_t old_size, size_t size);
+static void  pool_free   (void *ctx, void *ptr, size_t size);
+
+/**
+ * @brief Huge page allocator context
+ */
+struct huge_ctx_t {
+        stack_alloc_t alloc   = {};
+        int           node    = -1;    /**< NUMA node (-1 - any)    */
+        bool          hugetlb = false; /**< Try MAP_HUGETLB first   */
+};
+
+static void *huge_alloc  (void *ctx, size_t size);
+static void *huge_realloc(void *ctx, void *ptr, size_t old_size, size_t size);
+static void  huge_free   (void *ctx, void *ptr, size_t size);
+static inline size_t huge_length(const size_t size);
+static int   bind_node   (void *const ptr, const size_t length, const int node);
+
+/**
+ * @brief Guarded block record
+ *
+ * Records are read by the fault handler without locks: length is set after
+ * the record is taken and cleared before it is released, zero length is skipped.
+ */
+struct guard_block_t {
+        std::atomic<char *>       map    {nullptr}; /**< Mapping with guard pages */
+        std::atomic<size_t>       length {0};       /**< Mapping length           */
+        std::atomic<const void *> owner  {nullptr};
+};
+
+static std::atomic<guard_block_t *> GUARD_BLOCKS {nullptr}; /**< GUARD_MAX_BLOCKS records */
+
+static std::atomic<int> GUARD_FD {-1};    /**< Fault report file descriptor */
+static struct sigaction OLD_SEGV = {};    /**< Previous SIGSEGV action      */
+
+static void *guard_alloc  (void *ctx, size_t size);
+static void *guard_realloc(void *ctx, void *ptr, size_t old_size, size_t size);
+static void  guard_free   (void *ctx, void *ptr, size_t size);
+static inline size_t guard_page();
+static inline size_t guard_data(const size_t size);
+static inline size_t guard_size(const size_t size);
+static guard_block_t *guard_blocks();
+static guard_block_t *guard_block(const char *const map);
+static void guard_handler(int sig, siginfo_t *info, void * /* context */);
+static size_t format_guard(char *const buf, const void *const addr, const void *const owner);
+
+static void *map_alloc  (void *ctx, size_t size);
+static void *map_realloc(void *ctx, void *ptr, size_t old_size, size_t size);
+static void  map_free   (void *ctx, void *ptr, size_t size);
+static int   remap_file (map_file_t *const file, const size_t size);
+
+const stack_alloc_t LIBC_ALLOC = {libc_alloc, libc_realloc, libc_free, nullptr};
+const stack_alloc_t POOL_ALLOC = {pool_alloc, pool_realloc, pool_free, nullptr};
+const stack_alloc_t GUARD_ALLOC = {guard_alloc, guard_realloc, guard_free, nullptr, &LIBC_ALLOC};
+
+static void *libc_alloc(void * /* ctx */, size_t size)
+{
+        return malloc(size);
+}
+
+static void *libc_realloc(void * /* ctx */, void *ptr, size_t /* old_size */, size_t size)
+{
+        return realloc(ptr, size);
+}
+
+static void libc_free(void * /* ctx */, void *ptr, size_t /* size */)
+{
+        free(ptr);
+}
+
+/**
+ * @brief Gets size class of the block
+ *
+ * @param size Block size
+ *
+ * @return Size class or POOL_CLASSES if block is too large.
+ */
+static inline size_t size_class(const size_t size)
+{
+        if (size > POOL_MAX_BLOCK)
+                return POOL_CLASSES;
+
+        size_t cls = 0;
+        while ((POOL_MIN_BLOCK << cls) < size)
+                cls++;
+
+        return cls;
+}
+
+static void *pool_alloc(void * /* ctx */, size_t size)
+{
+        size_t cls = size_class(size);
+        if (cls == POOL_CLASSES)
+                return malloc(size);
+
+        pool_block_t *block = POOL.free_list[cls];
+        if (block) {
+                POOL.free_list[cls] = block->next;
+                POOL.n_free[cls]--;
+                POOL.stats.cached--;
+                POOL.stats.hits++;
+                return block;
+        }
+
+        POOL.stats.misses++;
+        return malloc(POOL_MIN_BLOCK << cls);
+}
+
+static void pool_free(void * /* ctx */, void *ptr, size_t size)
+{
+        if (!ptr)
+                return;
+
+        size_t cls = size_class(size);
+        if (cls == POOL_CLASSES || POOL.n_free[cls] >= POOL_MAX_BLOCKS) {
+                free(ptr);
+                return;
+        }
+
+        pool_block_t *block = (pool_block_t *)ptr;
+        block->next = POOL.free_list[cls];
+
+        POOL.free_list[cls] = block;
+        POOL.n_free[cls]++;
+        POOL.stats.cached++;
+}
+
+static void *pool_realloc(void *ctx, void *ptr, size_t old_size, size_t size)
+{
+        if (!ptr)
+                return pool_alloc(ctx, size);
+
+        size_t old_cls = size_class(old_size);
+        size_t new_cls = size_class(size);
+
+        if (old_cls == new_cls && new_cls < POOL_CLASSES)
+                return ptr;
+
+        if (old_cls == POOL_CLASSES && new_cls == POOL_CLASSES)
+                return realloc(ptr, size);
+
+        void *block = pool_alloc(ctx, size);
+        if (!block)
+                return nullptr;
+
+        memcpy(block, ptr, old_size < size ? old_size : size);
+        pool_free(ctx, ptr, old_size);
+
+        return block;
+}
+
+pool_stats_t pool_stats()
+{
+        return POOL.stats;
+}
+
+void pool_release()
+{
+        for (size_t cls = 0; cls < POOL_CLASSES; cls++) {
+                while (POOL.free_list[cls]) {
+                        pool_block_t *next = POOL.free_list[cls]->next;
+                        free(POOL.free_list[cls]);
+                        POOL.free_list[cls] = next;
+                }
+
+                POOL.n_free[cls] = 0;
+        }
+
+        POOL.stats.cached = 0;
+}
+
+stack_alloc_t *open_map_alloc(const char *const path, const bool create)
+{
+        assert(path);
+
+        map_file_t *file = new (std::nothrow) map_file_t;
+        if (!file)
+                return nullptr;
+
+        file->alloc = {map_alloc, map_realloc, map_free, file, &LIBC_ALLOC};
+
+        struct stat st = {};
+
+        file->fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+        if (file->fd < 0)
+                goto fail;
+
+        if (fstat(file->fd, &st))
+                goto fail;
+
+        file->map_size = (size_t)st.st_size;
+        if (create) {
+                if (ftruncate(file->fd, (off_t)MAP_HEADER_SIZE))
+                        goto fail;
+
+                file->map_size = MAP_HEADER_SIZE;
+        } else if (file->map_size < MAP_HEADER_SIZE) {
+                errno = EINVAL;
+                goto fail;
+        }
+
+        file->map = (char *)mmap(nullptr, file->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                 file->fd, 0);
+        if (file->map == MAP_FAILED) {
+                file->map = nullptr;
+                goto fail;
+        }
+
+        return &file->alloc;
+
+fail:
+        int err = errno;
+        close_map_alloc(&file->alloc);
+        errno = err;
+
+        return nullptr;
+}
+
+void close_map_alloc(stack_alloc_t *const alloc)
+{
+        assert(alloc);
+        map_file_t *file = (map_file_t *)alloc->ctx;
+
+        if (file->map)
+                munmap(file->map, file->map_size);
+
+        if (file->fd >= 0)
+                close(file->fd);
+
+        delete file;
+}
+
+stack_alloc_t *open_huge_alloc(const int node, const bool hugetlb)
+{
+        if (node >= HUGE_MAX_NODES) {
+                errno = EINVAL;
+                return nullptr;
+        }
+
+        huge_ctx_t *huge = new (std::nothrow) huge_ctx_t;
+        if (!huge)
+                return nullptr;
+
+        huge->alloc   = {huge_alloc, huge_realloc, huge_free, huge, &LIBC_ALLOC};
+        huge->node    = node;
+        huge->hugetlb = hugetlb;
+
+        /* Node is checked at once, so blocks can be bound to it later */
+        if (node >= 0) {
+                const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+                void *probe = mmap(nullptr, page, PROT_READ | PROT_WRITE, 
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (probe == MAP_FAILED) {
+                        delete huge;
+                        return nullptr;
+                }
+
+                int failed = bind_node(probe, page, node);
+                int err    = errno;
+                munmap(probe, page);
+
+                if (failed) {
+                        delete huge;
+                        errno = err;
+                        return nullptr;
+                }
+        }
+
+        return &huge->alloc;
+}
+
+void close_huge_alloc(stack_alloc_t *const alloc)
+{
+        assert(alloc);
+        assert(alloc->alloc == huge_alloc);
+
+        delete (huge_ctx_t *)alloc->ctx;
+}
+
+/**
+ * @brief Gets mapping length of a block
+ *
+ * Blocks are rounded up to HUGE_PAGE whatever pages they are backed by,
+ * so the length is known without block headers.
+ */
+static inline size_t huge_length(const size_t size)
+{
+        return (size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+}
+
+/**
+ * @brief Binds memory to NUMA node
+ *
+ * It is mbind() system call, so libnuma is not needed.
+ *
+ * @return 0 or -1 (errno is set).
+ */
+static int bind_node(void *const ptr, const size_t length, const int node)
+{
+        assert(node >= 0 && node < HUGE_MAX_NODES);
+
+        unsigned long mask[HUGE_MAX_NODES / (8 * sizeof(unsigned long))] = {};
+        mask[(size_t)node / (8 * sizeof(unsigned long))] = 1UL << ((size_t)node % (8 * sizeof(unsigned long)));
+
+        return (int)syscall(SYS_mbind, ptr, length, MPOL_BIND, mask, HUGE_MAX_NODES + 1, 0);
+}
+
+static void *huge_alloc(void *ctx, size_t size)
+{
+        huge_ctx_t *huge = (huge_ctx_t *)ctx;
+        const size_t length = huge_length(size);
+
+        void *ptr = MAP_FAILED;
+        if (huge->hugetlb) {
+                ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, 
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        }
+
+        /* Transparent huge pages are used if huge pages are not reserved */
+        if (ptr == MAP_FAILED) {
+                ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, 
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (ptr == MAP_FAILED)
+                        return nullptr;
+
+                madvise(ptr, length, MADV_HUGEPAGE);
+        }
+
+        if (huge->node >= 0 && bind_node(ptr, length, huge->node)) {
+                int err = errno;
+                munmap(ptr, length);
+                errno = err;
+                return nullptr;
+        }
+
+        return ptr;
+}
+
+static void *huge_realloc(void *ctx, void *ptr, size_t old_size, size_t size)
+{
+        huge_ctx_t *huge = (huge_ctx_t *)ctx;
+
+        if (!ptr)
+                return huge_alloc(ctx, size);
+
+        const size_t old_length = huge_length(old_size);
+        const size_t length     = huge_length(size);
+
+        if (length == old_length)
+                return ptr;
+
+        void *moved = mremap(ptr, old_length, length, MREMAP_MAYMOVE);
+        if (moved != MAP_FAILED) {
+                /* Added pages get the policy of the mapping, bind is a safety net */
+                if (length > old_length && huge->node >= 0)
+                        bind_node(moved, length, huge->node);
+
+                return moved;
+        }
+
+        /* Old kernels can't remap huge pages, then tail is unmapped or block is copied */
+        if (length < old_length)
+                return munmap((char *)ptr + length, old_length - length) ? nullptr : ptr;
+
+        moved = huge_alloc(ctx, size);
+        if (!moved)
+                return nullptr;
+
+        memcpy(moved, ptr, old_size);
+        munmap(ptr, old_length);
+
+        return moved;
+}
+
+static void huge_free(void * /* ctx */, void *ptr, size_t size)
+{
+        if (ptr)
+                munmap(ptr, huge_length(size));
+}
+
+static inline size_t guard_page()
+{
+        static const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        return page;
+}
+
+/**
+ * @brief Gets length of the accessible part of a guarded mapping
+ */
+static inline size_t guard_data(const size_t size)
+{
+        const size_t page = guard_page();
+        return (size + page - 1) / page * page;
+}
+
+/**
+ * @brief Gets aligned size of a guarded block
+ */
+static inline size_t guard_size(const size_t size)
+{
+        const size_t align = alignof(max_align_t);
+        return (size + align - 1) / align * align;
+}
+
+/**
+ * @brief Gets guarded block records
+ *
+ * Records are mapped by the first call. Fault handler reads them
+ * by GUARD_BLOCKS, it is nullptr until then.
+ *
+ * @return Records or nullptr if they can't be mapped.
+ */
+static guard_block_t *guard_blocks()
+{
+        guard_block_t *blocks = GUARD_BLOCKS.load(std::memory_order_acquire);
+        if (blocks)
+                return blocks;
+
+        const size_t length = GUARD_MAX_BLOCKS * sizeof(guard_block_t);
+
+        void *map = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+                return nullptr;
+
+        guard_block_t *created = (guard_block_t *)map;
+        for (size_t i = 0; i < GUARD_MAX_BLOCKS; i++)
+                new (created + i) guard_block_t;
+
+        if (!GUARD_BLOCKS.compare_exchange_strong(blocks, created, std::memory_order_acq_rel)) {
+                munmap(map, length);
+                return blocks;
+        }
+
+        return created;
+}
+
+/**
+ * @brief Finds guarded block record by its mapping
+ *
+ * @param map Mapping (nullptr - free record)
+ *
+ * @return Record or nullptr if it is not found.
+ */
+static guard_block_t *guard_block(const char *const map)
+{
+        guard_block_t *blocks = GUARD_BLOCKS.load(std::memory_order_acquire);
+        if (!blocks)
+                return nullptr;
+
+        for (size_t i = 0; i < GUARD_MAX_BLOCKS; i++)
+                if (blocks[i].map.load(std::memory_order_acquire) == map)
+                        return &blocks[i];
+
+        return nullptr;
+}
+
+static void *guard_alloc(void * /* ctx */, size_t size)
+{
+        const size_t page   = guard_page();
+        const size_t data   = guard_data(guard_size(size));
+        const size_t length = data + 2 * page;
+
+        char *map = (char *)mmap(nullptr, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+                return nullptr;
+
+        if (mprotect(map + page, data, PROT_READ | PROT_WRITE)) {
+                int err = errno;
+                munmap(map, length);
+                errno = err;
+                return nullptr;
+        }
+
+        /* Block is still guarded if there is no free record */
+        guard_block_t *blocks = guard_blocks();
+        for (size_t i = 0; blocks && i < GUARD_MAX_BLOCKS; i++) {
+                char *none = nullptr;
+                if (blocks[i].map.compare_exchange_strong(none, map, std::memory_order_acq_rel)) {
+                        blocks[i].owner.store(nullptr, std::memory_order_relaxed);
+                        blocks[i].length.store(length, std::memory_order_release);
+                        break;
+                }
+        }
+
+        return map + page + data - guard_size(size);
+}
+
+static void *guard_realloc(void *ctx, void *ptr, size_t old_size, size_t size)
+{
+        if (!ptr)
+                return guard_alloc(ctx, size);
+
+        if (guard_size(size) == guard_size(old_size))
+                return ptr;
+
+        void *moved = guard_alloc(ctx, size);
+        if (!moved)
+                return nullptr;
+
+        memcpy(moved, ptr, old_size < size ? old_size : size);
+        guard_free(ctx, ptr, old_size);
+
+        return moved;
+}
+
+static void guard_free(void * /* ctx */, void *ptr, size_t size)
+{
+        if (!ptr)
+                return;
+
+        const size_t page = guard_page();
+        const size_t data = guard_data(guard_size(size));
+        char *map = (char *)ptr + guard_size(size) - data - page;
+
+        guard_block_t *block = guard_block(map);
+        if (block) {
+                block->length.store(0, std::memory_order_release);
+                block->map.store(nullptr, std::memory_order_release);
+        }
+
+        munmap(map, data + 2 * page);
+}
+
+int set_guard_owner(const stack_alloc_t *const alloc, const void *const block, 
+                    const void *const owner)
+{
+        if (!alloc || alloc->alloc != guard_alloc || !block)
+                return -1;
+
+        const char *const ptr = (const char *)block;
+
+        guard_block_t *blocks = GUARD_BLOCKS.load(std::memory_order_acquire);
+        for (size_t i = 0; blocks && i < GUARD_MAX_BLOCKS; i++) {
+                const char *map = blocks[i].map.load(std::memory_order_acquire);
+                size_t length   = blocks[i].length.load(std::memory_order_acquire);
+
+                if (map && ptr > map && ptr < map + length) {
+                        blocks[i].owner.store(owner, std::memory_order_release);
+                        return 0;
+                }
+        }
+
+        return -1;
+}
+
+bool guard_fault(const void *const addr, const void **const owner)
+{
+        assert(owner);
+
+        const size_t page = guard_page();
+        const char *const ptr = (const char *)addr;
+
+        guard_block_t *blocks = GUARD_BLOCKS.load(std::memory_order_acquire);
+        for (size_t i = 0; blocks && i < GUARD_MAX_BLOCKS; i++) {
+                const char *map = blocks[i].map.load(std::memory_order_acquire);
+                size_t length   = blocks[i].length.load(std::memory_order_acquire);
+
+                if (!map || !length || ptr < map || ptr >= map + length)
+                        continue;
+
+                if (ptr >= map + page && ptr < map + length - page)
+                        return false;
+
+                *owner = blocks[i].owner.load(std::memory_order_acquire);
+                return true;
+        }
+
+        return false;
+}
+
+int set_guard_handler(const int fd)
+{
+        if (fd < 0) {
+                errno = EBADF;
+                return -1;
+        }
+
+        struct sigaction act = {};
+        act.sa_sigaction = guard_handler;
+        act.sa_flags     = SA_SIGINFO;
+        sigemptyset(&act.sa_mask);
+
+        /* Page size is cached before the handler needs it */
+        guard_page();
+
+        GUARD_FD.store(fd, std::memory_order_release);
+        return sigaction(SIGSEGV, &act, &OLD_SEGV);
+}
+
+/**
+ * @brief SIGSEGV handler
+ *
+ * It makes async-signal-safe calls only: the report is formatted
+ * on the stack and written by write(2). Owner stack is not touched,
+ * it may be held by another thread or corrupted.
+ */
+static void guard_handler(int sig, siginfo_t *info, void * /* context */)
+{
+        const void *owner = nullptr;
+        const int fd = GUARD_FD.load(std::memory_order_acquire);
+        const int err = errno;
+
+        if (fd >= 0 && guard_fault(info->si_addr, &owner)) {
+                char buf[128] = {};
+                size_t len = format_guard(buf, info->si_addr, owner);
+
+                for (size_t done = 0; done < len; ) {
+                        ssize_t n = write(fd, buf + done, len - done);
+                        if (n < 0 && errno == EINTR)
+                                continue;
+                        if (n <= 0)
+                                break;
+
+                        done += (size_t)n;
+                }
+        }
+
+        /* Faulting instruction is restarted and faults again with the previous action */
+        sigaction(sig, &OLD_SEGV, nullptr);
+        errno = err;
+}
+
+/**
+ * @brief Appends hex value to the report
+ */
+static inline size_t format_hex(char *const buf, size_t value)
+{
+        char digits[2 * sizeof(size_t)] = {};
+        size_t n = 0;
+
+        do {
+                digits[n++] = "0123456789abcdef"[value & 0xF];
+                value >>= 4;
+        } while (value);
+
+        buf[0] = '0';
+        buf[1] = 'x';
+        for (size_t i = 0; i < n; i++)
+                buf[2 + i] = digits[n - 1 - i];
+
+        return 2 + n;
+}
+
+static inline size_t format_str(char *const buf, const char *const str)
+{
+        size_t n = strlen(str);
+        memcpy(buf, str, n);
+        return n;
+}
+
+/**
+ * @brief Formats guard page fault report
+ *
+ * Buffer must hold 128 bytes.
+ *
+ * @return Report length
+ */
+static size_t format_guard(char *const buf, const void *const addr, const void *const owner)
+{
+        size_t len = 0;
+
+        len += format_str(buf + len, "Stack guard page is hit at ");
+        len += format_hex(buf + len, (size_t)addr);
+
+        if (owner) {
+                len += format_str(buf + len, ", owner stack ");
+                len += format_hex(buf + len, (size_t)owner);
+        } else {
+                len += format_str(buf + len, ", owner is not set");
+        }
+
+        len += format_str(buf + len, "\n");
+        return len;
+}
+
+void *map_header(const stack_alloc_t *const alloc)
+{
+        if (!alloc || alloc->alloc != map_alloc)
+                return nullptr;
+
+        return ((map_file_t *)alloc->ctx)->map;
+}
+
+size_t map_block_size(const stack_alloc_t *const alloc)
+{
+        assert(map_header(alloc));
+        return ((map_file_t *)alloc->ctx)->map_size - MAP_HEADER_SIZE;
+}
+
+int sync_map(const stack_alloc_t *const alloc)
+{
+        assert(map_header(alloc));
+        map_file_t *file = (map_file_t *)alloc->ctx;
+
+        return msync(file->map, file->map_size, MS_SYNC);
+}
+
+/**
+ * @brief Resizes file and its mapping
+ *
+ * @param file File
+ * @param size Block size
+ *
+ * In case of an error, file is not changed.
+ *
+ * @return 0 or -1 (errno is set).
+ */
+static int remap_file(map_file_t *const file, const size_t size)
+{
+        assert(file);
+
+        const size_t map_size = MAP_HEADER_SIZE + size;
+        if (map_size == file->map_size)
+                return 0;
+
+        if (map_size > file->map_size && ftruncate(file->fd, (off_t)map_size))
+                return -1;
+
+        void *map = mremap(file->map, file->map_size, map_size, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED) {
+                int err = errno;
+                if (map_size > file->map_size)
+                        ftruncate(file->fd, (off_t)file->map_size);
+
+                errno = err;
+                return -1;
+        }
+
+        /* Mapping is already shrunk, so the file is truncated anyway */
+        if (map_size < file->map_size)
+                ftruncate(file->fd, (off_t)map_size);
+
+        file->map      = (char *)map;
+        file->map_size = map_size;
+
+        return 0;
+}
+
+static void *map_alloc(void *ctx, size_t size)
+{
+        map_file_t *file = (map_file_t *)ctx;
+
+        if (file->used) {
+                errno = EBUSY;
+                return nullptr;
+        }
+
+        if (remap_file(file, size))
+                return nullptr;
+
+        file->used = true;
+        return file->map + MAP_HEADER_SIZE;
+}
+
+static void *map_realloc(void *ctx, void *ptr, size_t /* old_size */, size_t size)
+{
+        map_file_t *file = (map_file_t *)ctx;
+
+        if (!ptr)
+                return map_alloc(ctx, size);
+
+        assert(ptr == file->map + MAP_HEADER_SIZE);
+
+        if (remap_file(file, size))
+                return nullptr;
+
+        return file->map + MAP_HEADER_SIZE;
+}
+
+static void map_free(void *ctx, void *ptr, size_t /* size */)
+{
+        map_file_t *file = (map_file_t *)ctx;
+        assert(ptr == file->map + MAP_HEADER_SIZE);
+        (void)ptr;
+
+        close_map_alloc(&file->alloc);
+}
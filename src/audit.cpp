@@ -0,0 +1,392 @@
+/**
+ * @file
+ * @brief  Background stack auditor
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <new>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <system_error>
+#include "include/audit.h"
+#include "include/log.h"
+#include "include/config.h"
+
+#ifdef UNPROTECT
+#undef HASH_PROTECT
+#undef CANARY_PROTECT
+#endif /* UNPROTECT */
+
+/**
+ * @brief Auditor
+ *
+ * Lock order is auditor lock, then stack entry lock. Foreground threads
+ * take the auditor lock only to register and unregister stacks.
+ */
+struct auditor_t {
+        std::thread            *thread    = nullptr;
+        std::mutex              lock;
+        std::condition_variable wake;                /**< Auditor waits for the period */
+
+        audit_entry_t         **entries   = nullptr;
+        size_t                  n_entries = 0;
+        size_t                  cap       = 0;
+
+        size_t                  period_ms = 0;
+        audit_callback_t        callback  = nullptr;
+        void                   *ctx       = nullptr;
+        bool                    stop      = false;
+};
+
+#ifdef STACK_AUDIT
+static void run_auditor(auditor_t *const auditor);
+static void audit_entry(auditor_t *const auditor, audit_entry_t *const entry);
+static void report_entry(auditor_t *const auditor, audit_entry_t *const entry, const int vrf);
+static char *dump_report(stack_t *const stk);
+
+static int add_entry(auditor_t *const auditor, audit_entry_t *const entry);
+static void remove_entry(auditor_t *const auditor, audit_entry_t *const entry);
+#endif /* STACK_AUDIT */
+
+static inline void set_error(int *const error, int value);
+
+auditor_t *open_auditor(const size_t period_ms, audit_callback_t callback, void *const ctx,
+                        int *const error)
+{
+#ifdef STACK_AUDIT
+        if (period_ms == 0) {
+                log_err("Invalid audit period: %zu\n", period_ms);
+                set_error(error, STK_INVALID);
+                return nullptr;
+        }
+
+        auditor_t *auditor = new (std::nothrow) auditor_t;
+        if (!auditor) {
+                log_err("Can't allocate auditor\n");
+                set_error(error, STK_BAD_ALLOC);
+                return nullptr;
+        }
+
+        auditor->period_ms = period_ms;
+        auditor->callback  = callback;
+        auditor->ctx       = ctx;
+
+        try {
+                auditor->thread = new (std::nothrow) std::thread(run_auditor, auditor);
+        } catch (const std::system_error &) {
+                auditor->thread = nullptr;
+        }
+
+        if (!auditor->thread) {
+                log_err("Can't start auditor thread\n");
+                set_error(error, STK_BAD_ALLOC);
+                delete auditor;
+                return nullptr;
+        }
+
+        return auditor;
+#else
+        (void)period_ms;
+        (void)callback;
+        (void)ctx;
+
+        log_err("Stack is compiled without STACK_AUDIT\n");
+        set_error(error, STK_INVALID);
+        return nullptr;
+#endif /* STACK_AUDIT */
+}
+
+void close_auditor(auditor_t *const auditor)
+{
+        if (!auditor)
+                return;
+
+        {
+                std::lock_guard<std::mutex> guard(auditor->lock);
+                auditor->stop = true;
+        }
+        auditor->wake.notify_all();
+
+        auditor->thread->join();
+        delete auditor->thread;
+
+        if (auditor->n_entries)
+                log_err("Auditor is closed with %zu stacks registered\n", auditor->n_entries);
+
+        for (size_t i = 0; i < auditor->n_entries; i++)
+                auditor->entries[i]->auditor = nullptr;
+
+        free(auditor->entries);
+        delete auditor;
+}
+
+void audit_stack(auditor_t *const auditor, stack_t *const stk, int *const error)
+{
+        assert(auditor);
+        assert(stk);
+
+        int err = 0;
+
+#ifdef STACK_AUDIT
+        audit_entry_t *entry = nullptr;
+
+        if (stk->audit) {
+                log_err("Stack is audited already\n");
+                err = STK_INVALID;
+                goto finally;
+        }
+
+        err = verify_stack_full(stk);
+        if (err) {
+                log_err("Can't audit invalid stack\n");
+                goto finally;
+        }
+
+        entry = new (std::nothrow) audit_entry_t;
+        if (!entry) {
+                log_err("Can't allocate audit entry\n");
+                err = STK_BAD_ALLOC;
+                goto finally;
+        }
+
+        entry->stk           = stk;
+        entry->auditor       = auditor;
+        entry->verify        = stk->verify;
+        entry->verify_period = stk->verify_period;
+
+        /* Entry is set before the auditor sees it, so every operation holds the stack */
+        stk->audit = entry;
+
+        set_verify_policy(stk, VERIFY_STRUCT, stk->verify_period, &err);
+        if (err) {
+                stk->audit = nullptr;
+                delete entry;
+                goto finally;
+        }
+
+        err = add_entry(auditor, entry);
+        if (err) {
+                stk->audit = nullptr;
+                set_verify_policy(stk, entry->verify, entry->verify_period);
+                delete entry;
+                goto finally;
+        }
+#else
+        (void)auditor;
+        (void)stk;
+
+        log_err("Stack is compiled without STACK_AUDIT\n");
+        err = STK_INVALID;
+        goto finally;
+#endif /* STACK_AUDIT */
+
+finally:
+        if (err)
+                set_error(error, err);
+}
+
+void unaudit_stack(stack_t *const stk)
+{
+        assert(stk);
+
+#ifdef STACK_AUDIT
+        audit_entry_t *entry = stk->audit;
+        if (!entry)
+                return;
+
+        if (entry->auditor)
+                remove_entry(entry->auditor, entry);
+
+        /* Auditor can't hold the stack anymore */
+        stk->audit = nullptr;
+        set_verify_policy(stk, entry->verify, entry->verify_period);
+
+        delete entry;
+#else
+        (void)stk;
+#endif /* STACK_AUDIT */
+}
+
+#ifdef STACK_AUDIT
+/**
+ * @brief Auditor thread loop
+ *
+ * The auditor lock is released between stacks, so stacks can be
+ * registered during a pass.
+ */
+static void run_auditor(auditor_t *const auditor)
+{
+        assert(auditor);
+
+        std::unique_lock<std::mutex> guard(auditor->lock);
+        const std::chrono::milliseconds period(auditor->period_ms);
+
+        while (!auditor->stop) {
+                auditor->wake.wait_for(guard, period, [auditor] { return auditor->stop; });
+
+                for (size_t i = 0; i < auditor->n_entries && !auditor->stop; i++) {
+                        audit_entry(auditor, auditor->entries[i]);
+
+                        guard.unlock();
+                        std::this_thread::yield();
+                        guard.lock();
+                }
+        }
+}
+
+/**
+ * @brief Verifies the whole stack by slices
+ *
+ * The stack is held for one slice at a time. New failures are reported
+ * once, failure mask is cleared after a clean pass.
+ */
+static void audit_entry(auditor_t *const auditor, audit_entry_t *const entry)
+{
+        assert(auditor);
+        assert(entry);
+
+        int vrf = 0;
+
+        do {
+                audit_lock(entry);
+
+                vrf = verify_stack_slice(entry->stk, &entry->chunk, AUDIT_SLICE);
+                if (vrf & ~entry->failed)
+                        report_entry(auditor, entry, vrf);
+
+                audit_unlock(entry);
+        } while (!vrf && entry->chunk);
+
+        if (vrf) {
+                entry->failed |= vrf;
+                entry->chunk   = 0;
+        } else {
+                entry->failed  = 0;
+        }
+}
+
+/**
+ * @brief Reports stack failure
+ *
+ * Both auditor lock and the stack are held.
+ */
+static void report_entry(auditor_t *const auditor, audit_entry_t *const entry, const int vrf)
+{
+        assert(auditor);
+        assert(entry);
+
+        char *report = dump_report(entry->stk);
+
+        if (auditor->callback) {
+                auditor->callback(entry->stk, vrf, report ? report : "{}", auditor->ctx);
+        } else {
+                log_err("Audit of stack %p failed: %d\n", (void *)entry->stk, vrf);
+                if (report)
+                        log_buf("%s\n", report);
+                log_flush();
+        }
+
+        free(report);
+}
+
+/**
+ * @brief Dumps stack to JSON string
+ *
+ * @return Report (it must be free'd) or nullptr in case of an error
+ */
+static char *dump_report(stack_t *const stk)
+{
+        assert(stk);
+
+        char *report = nullptr;
+        off_t size   = 0;
+        int err      = 0;
+
+        int fd = memfd_create("stack-audit", MFD_CLOEXEC);
+        if (fd < 0) {
+                log_err("Can't create audit report: %s\n", strerror(errno));
+                return nullptr;
+        }
+
+        dump_stack_json(stk, fd, AUDIT_WINDOW, &err);
+        if (err)
+                goto finally;
+
+        size = lseek(fd, 0, SEEK_END);
+        if (size < 0) {
+                log_err("Can't read audit report: %s\n", strerror(errno));
+                goto finally;
+        }
+
+        report = (char *)calloc((size_t)size + 1, sizeof(char));
+        if (!report) {
+                log_err("Can't allocate audit report: %s\n", strerror(errno));
+                goto finally;
+        }
+
+        if (pread(fd, report, (size_t)size, 0) != size) {
+                log_err("Can't read audit report: %s\n", strerror(errno));
+                free(report);
+                report = nullptr;
+        }
+
+finally:
+        close(fd);
+        return report;
+}
+
+static int add_entry(auditor_t *const auditor, audit_entry_t *const entry)
+{
+        assert(auditor);
+        assert(entry);
+
+        std::lock_guard<std::mutex> guard(auditor->lock);
+
+        if (auditor->n_entries == auditor->cap) {
+                size_t cap = auditor->cap ? 2 * auditor->cap : 8;
+
+                audit_entry_t **entries = (audit_entry_t **)realloc(auditor->entries,
+                                                                    cap * sizeof(audit_entry_t *));
+                if (!entries) {
+                        log_err("Can't allocate audit entries: %s\n", strerror(errno));
+                        return STK_BAD_ALLOC;
+                }
+
+                auditor->entries = entries;
+                auditor->cap     = cap;
+        }
+
+        auditor->entries[auditor->n_entries++] = entry;
+        return 0;
+}
+
+static void remove_entry(auditor_t *const auditor, audit_entry_t *const entry)
+{
+        assert(auditor);
+        assert(entry);
+
+        std::lock_guard<std::mutex> guard(auditor->lock);
+
+        for (size_t i = 0; i < auditor->n_entries; i++) {
+                if (auditor->entries[i] == entry) {
+                        auditor->entries[i] = auditor->entries[--auditor->n_entries];
+                        return;
+                }
+        }
+}
+
+#endif /* STACK_AUDIT */
+
+static inline void set_error(int *const error, int value)
+{
+        if (error)
+                *error = value;
+}
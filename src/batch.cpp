@@ -0,0 +1,488 @@
+/**
+ * @file
+ * @brief  Batch operations on many stacks
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <system_error>
+#include <mutex>
+#include <condition_variable>
+#include "include/batch.h"
+#include "include/log.h"
+#include "include/config.h"
+
+#ifdef UNPROTECT
+#undef HASH_PROTECT
+#undef CANARY_PROTECT
+#endif /* UNPROTECT */
+
+static const size_t RADIX_BITS = 8;
+static const size_t RADIX      = 1 << RADIX_BITS;
+
+/**
+ * @brief Operation reference sorted by stack
+ *
+ * Operation is copied, so groups are read sequentially.
+ */
+struct batch_ref_t {
+        stack_t *stk   = nullptr;
+        size_t   index = 0;          /**< Operation index in batch */
+        int      kind  = BATCH_PUSH;
+        item_t   item  = 0;
+        int      error = 0;          /**< Error found by planning */
+};
+
+/**
+ * @brief Batch plan
+ *
+ * Group g is refs [groups[g], groups[g + 1]). Every group has its own
+ * part of scratch memory: pushed items at scratch + groups[g],
+ * popped ones at scratch + n + groups[g], so groups are independent.
+ */
+struct batch_plan_t {
+        batch_op_t  *ops      = nullptr;
+        size_t       n        = 0;
+
+        batch_ref_t *refs     = nullptr;
+        size_t      *groups   = nullptr;
+        size_t       n_groups = 0;
+        item_t      *scratch  = nullptr;
+
+        std::atomic<size_t> next {0};         /**< Next chunk of groups */
+};
+
+struct batch_pool_t {
+        std::thread           **workers   = nullptr;
+        size_t                  n_workers = 0;
+
+        std::mutex              lock      {};
+        std::condition_variable wake      {}; /**< Workers wait for a job        */
+        std::condition_variable done      {}; /**< Caller waits for the workers  */
+
+        batch_plan_t           *plan      = nullptr;
+        uint64_t                job       = 0; /**< Job number                    */
+        size_t                  running   = 0; /**< Workers still doing the job   */
+        bool                    stop      = false;
+};
+
+static int open_plan(batch_plan_t *const plan, batch_op_t *const ops, const size_t n);
+static void close_plan(batch_plan_t *const plan);
+static void sort_refs(batch_ref_t *refs, batch_ref_t *tmp, const size_t n);
+
+static void apply_group(batch_plan_t *const plan, const size_t group);
+static void apply_groups(batch_plan_t *const plan, const size_t from, const size_t to);
+static void apply_chunks(batch_plan_t *const plan);
+static void run_worker(batch_pool_t *const pool);
+
+static int first_error(const batch_op_t *const ops, const size_t n);
+static inline void set_error(int *const error, int value);
+
+void apply_batch(batch_op_t *const ops, const size_t n, int *const error)
+{
+        assert(ops || n == 0);
+
+        batch_plan_t plan;
+        int err = open_plan(&plan, ops, n);
+        if (err) {
+                set_error(error, err);
+                return;
+        }
+
+        apply_groups(&plan, 0, plan.n_groups);
+        close_plan(&plan);
+
+        err = first_error(ops, n);
+        if (err)
+                set_error(error, err);
+}
+
+batch_pool_t *open_batch_pool(const size_t n_threads, int *const error)
+{
+        size_t n_workers = n_threads ? n_threads : std::thread::hardware_concurrency();
+        if (n_workers)
+                n_workers--;
+
+        batch_pool_t *pool = new (std::nothrow) batch_pool_t;
+        if (!pool) {
+                log_err("Can't allocate batch pool\n");
+                set_error(error, STK_BAD_ALLOC);
+                return nullptr;
+        }
+
+        pool->workers = (std::thread **)calloc(n_workers ? n_workers : 1, sizeof(std::thread *));
+        if (!pool->workers) {
+                log_err("Can't allocate batch pool workers\n");
+                set_error(error, STK_BAD_ALLOC);
+                delete pool;
+                return nullptr;
+        }
+
+        for (size_t i = 0; i < n_workers; i++) {
+                std::thread *worker = nullptr;
+                try {
+                        worker = new (std::nothrow) std::thread(run_worker, pool);
+                } catch (const std::system_error &) {
+                        worker = nullptr;
+                }
+
+                if (!worker) {
+                        log_err("Can't start batch pool worker\n");
+                        set_error(error, STK_BAD_ALLOC);
+                        close_batch_pool(pool);
+                        return nullptr;
+                }
+
+                pool->workers[i] = worker;
+                pool->n_workers++;
+        }
+
+        return pool;
+}
+
+void close_batch_pool(batch_pool_t *const pool)
+{
+        if (!pool)
+                return;
+
+        {
+                std::lock_guard<std::mutex> guard(pool->lock);
+                pool->stop = true;
+        }
+        pool->wake.notify_all();
+
+        for (size_t i = 0; i < pool->n_workers; i++) {
+                pool->workers[i]->join();
+                delete pool->workers[i];
+        }
+
+        free(pool->workers);
+        delete pool;
+}
+
+void apply_batch_parallel(batch_pool_t *const pool, batch_op_t *const ops, const size_t n,
+                          int *const error)
+{
+        assert(pool);
+        assert(ops || n == 0);
+
+        batch_plan_t plan;
+        int err = open_plan(&plan, ops, n);
+        if (err) {
+                set_error(error, err);
+                return;
+        }
+
+        /* Waking the workers costs more than a chunk */
+        if (pool->n_workers == 0 || plan.n_groups <= BATCH_CHUNK) {
+                apply_groups(&plan, 0, plan.n_groups);
+        } else {
+                {
+                        std::lock_guard<std::mutex> guard(pool->lock);
+                        pool->plan    = &plan;
+                        pool->running = pool->n_workers;
+                        pool->job++;
+                }
+                pool->wake.notify_all();
+
+                apply_chunks(&plan);
+
+                std::unique_lock<std::mutex> guard(pool->lock);
+                while (pool->running)
+                        pool->done.wait(guard);
+
+                pool->plan = nullptr;
+        }
+
+        close_plan(&plan);
+
+        err = first_error(ops, n);
+        if (err)
+                set_error(error, err);
+}
+
+/**
+ * @brief Groups batch operations by stack
+ *
+ * Operations are sorted by stack address keeping their order,
+ * so stacks are visited in memory order.
+ *
+ * @return 0 or STK_BAD_ALLOC
+ */
+static int open_plan(batch_plan_t *const plan, batch_op_t *const ops, const size_t n)
+{
+        assert(plan);
+
+        plan->ops = ops;
+        plan->n   = n;
+
+        if (n == 0)
+                return 0;
+
+        batch_ref_t *tmp = (batch_ref_t *)calloc(n, sizeof(batch_ref_t));
+
+        plan->refs    = (batch_ref_t *)calloc(n, sizeof(batch_ref_t));
+        plan->groups  = (size_t *)     calloc(n + 1, sizeof(size_t));
+        plan->scratch = (item_t *)     calloc(2 * n, sizeof(item_t));
+
+        if (!tmp || !plan->refs || !plan->groups || !plan->scratch) {
+                log_err("Can't allocate batch plan of %zu operations\n", n);
+                free(tmp);
+                close_plan(plan);
+
+                for (size_t i = 0; i < n; i++)
+                        ops[i].error = STK_BAD_ALLOC;
+
+                return STK_BAD_ALLOC;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+                assert(ops[i].stk);
+
+                plan->refs[i].stk   = ops[i].stk;
+                plan->refs[i].index = i;
+                plan->refs[i].kind  = ops[i].kind;
+                plan->refs[i].item  = ops[i].item;
+        }
+
+        sort_refs(plan->refs, tmp, n);
+        free(tmp);
+
+        for (size_t i = 0; i < n; i++) {
+                if (i == 0 || plan->refs[i].stk != plan->refs[i - 1].stk)
+                        plan->groups[plan->n_groups++] = i;
+        }
+        plan->groups[plan->n_groups] = n;
+
+        return 0;
+}
+
+static void close_plan(batch_plan_t *const plan)
+{
+        assert(plan);
+
+        free(plan->refs);
+        free(plan->groups);
+        free(plan->scratch);
+
+        plan->refs     = nullptr;
+        plan->groups   = nullptr;
+        plan->scratch  = nullptr;
+        plan->n_groups = 0;
+}
+
+/**
+ * @brief Sorts references by stack address
+ *
+ * It is LSD radix sort, so it is stable. Only bits that differ
+ * between stack addresses are sorted, it is 2-3 passes for usual arrays of stacks.
+ */
+static void sort_refs(batch_ref_t *refs, batch_ref_t *tmp, const size_t n)
+{
+        assert(refs);
+        assert(tmp);
+
+        uintptr_t low  = UINTPTR_MAX;
+        uintptr_t high = 0;
+
+        for (size_t i = 0; i < n; i++) {
+                uintptr_t key = (uintptr_t)refs[i].stk;
+                if (key < low)
+                        low = key;
+                if (key > high)
+                        high = key;
+        }
+
+        const size_t shift = __builtin_ctzll(alignof(stack_t));
+        const uintptr_t span = (high - low) >> shift;
+
+        size_t count[RADIX] = {};
+        batch_ref_t *src = refs;
+        batch_ref_t *dst = tmp;
+
+        for (size_t bit = 0; bit < sizeof(uintptr_t) * 8 && (span >> bit); bit += RADIX_BITS) {
+                memset(count, 0, sizeof(count));
+
+                for (size_t i = 0; i < n; i++)
+                        count[(((uintptr_t)src[i].stk - low) >> shift >> bit) & (RADIX - 1)]++;
+
+                size_t offset = 0;
+                for (size_t digit = 0; digit < RADIX; digit++) {
+                        size_t digits = count[digit];
+                        count[digit] = offset;
+                        offset += digits;
+                }
+
+                for (size_t i = 0; i < n; i++)
+                        dst[count[(((uintptr_t)src[i].stk - low) >> shift >> bit) & (RADIX - 1)]++] = src[i];
+
+                batch_ref_t *swap = src;
+                src = dst;
+                dst = swap;
+        }
+
+        if (src != refs)
+                memcpy(refs, src, n * sizeof(batch_ref_t));
+}
+
+/**
+ * @brief Applies operations on one stack
+ *
+ * Pushed items are kept in scratch memory, a pop takes the last of them.
+ * If there are none, it pops the stack. So the group is reduced to popping
+ * n_popped items and pushing the rest of scratch ones, it is one update_stack() call.
+ */
+static void apply_group(batch_plan_t *const plan, const size_t group)
+{
+        assert(plan);
+        assert(group < plan->n_groups);
+
+        const size_t from = plan->groups[group];
+        const size_t to   = plan->groups[group + 1];
+
+        stack_t *stk    = plan->refs[from].stk;
+        item_t *pushed  = plan->scratch + from;
+        item_t *popped  = plan->scratch + plan->n + from;
+        size_t n_pushed = 0;
+        size_t n_popped = 0;
+        int err = 0;
+
+        /* Size of an invalid stack doesn't matter, update_stack() fails anyway */
+        const size_t size = stk->size;
+
+        for (size_t i = from; i < to; i++) {
+                batch_ref_t *ref = plan->refs + i;
+
+                if (ref->kind == BATCH_PUSH)
+                        pushed[n_pushed++] = ref->item;
+                else if (ref->kind != BATCH_POP)
+                        ref->error = STK_INVALID;
+                else if (n_pushed)
+                        ref->item = pushed[--n_pushed];
+                else if (n_popped < size)
+                        n_popped++;
+                else
+                        ref->error = STK_EMPTY_POP;
+        }
+
+        update_stack(stk, popped, n_popped, pushed, n_pushed, &err);
+
+        /* Popped items are in stack order, the first pop takes the former top */
+        size_t n_matched = 0;
+        size_t n_taken   = 0;
+
+        for (size_t i = from; i < to; i++) {
+                batch_ref_t *ref = plan->refs + i;
+                batch_op_t  *op  = plan->ops + ref->index;
+
+                if (ref->error) {
+                        op->error = ref->error;
+                        continue;
+                }
+
+                op->error = err;
+                if (err)
+                        continue;
+
+                if (ref->kind == BATCH_PUSH)
+                        n_matched++;
+                else if (n_matched)
+                        op->item = ref->item, n_matched--;
+                else
+                        op->item = popped[n_popped - ++n_taken];
+        }
+}
+
+/**
+ * @brief Applies groups [from, to)
+ *
+ * Header of a group stack is prefetched BATCH_PREFETCH groups ahead
+ * and its top items half way.
+ */
+static void apply_groups(batch_plan_t *const plan, const size_t from, const size_t to)
+{
+        assert(plan);
+
+        for (size_t group = from; group < to && group < from + BATCH_PREFETCH; group++)
+                __builtin_prefetch(plan->refs[plan->groups[group]].stk, 1);
+
+        for (size_t group = from; group < to; group++) {
+                if (group + BATCH_PREFETCH < to)
+                        __builtin_prefetch(plan->refs[plan->groups[group + BATCH_PREFETCH]].stk, 1);
+
+                if (group + BATCH_PREFETCH / 2 < to) {
+                        const stack_t *next = plan->refs[plan->groups[group + BATCH_PREFETCH / 2]].stk;
+                        __builtin_prefetch(next->items + next->size, 1);
+                }
+
+                apply_group(plan, group);
+        }
+}
+
+/**
+ * @brief Applies chunks of groups until there are none
+ */
+static void apply_chunks(batch_plan_t *const plan)
+{
+        assert(plan);
+
+        for (;;) {
+                size_t from = plan->next.fetch_add(BATCH_CHUNK, std::memory_order_relaxed);
+                if (from >= plan->n_groups)
+                        return;
+
+                size_t to = from + BATCH_CHUNK < plan->n_groups ? from + BATCH_CHUNK : plan->n_groups;
+                apply_groups(plan, from, to);
+        }
+}
+
+static void run_worker(batch_pool_t *const pool)
+{
+        assert(pool);
+        uint64_t job = 0;
+
+        for (;;) {
+                batch_plan_t *plan = nullptr;
+
+                {
+                        std::unique_lock<std::mutex> guard(pool->lock);
+                        while (!pool->stop && pool->job == job)
+                                pool->wake.wait(guard);
+
+                        if (pool->stop)
+                                return;
+
+                        job  = pool->job;
+                        plan = pool->plan;
+                }
+
+                apply_chunks(plan);
+
+                std::lock_guard<std::mutex> guard(pool->lock);
+                if (--pool->running == 0)
+                        pool->done.notify_one();
+        }
+}
+
+static int first_error(const batch_op_t *const ops, const size_t n)
+{
+        for (size_t i = 0; i < n; i++) {
+                if (ops[i].error)
+                        return ops[i].error;
+        }
+
+        return 0;
+}
+
+static inline void set_error(int *const error, int value)
+{
+        if (error)
+                *error = value;
+}
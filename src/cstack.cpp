@@ -0,0 +1,562 @@
+/**
+ * @file
+ * @brief  Concurrent stack
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "include/cstack.h"
+#include "include/log.h"
+#include "include/config.h"
+
+#ifdef UNPROTECT
+#undef HASH_PROTECT
+#undef CANARY_PROTECT
+#endif /* UNPROTECT */
+
+static const uint64_t ELIM_TAKEN = UINT64_MAX;      /**< Offered node is taken by popper */
+static const uint32_t MAX_NODES  = (uint32_t)(CBLOCK_NODES * ((1ul << CBLOCKS) - 1)); /**< Nodes of all blocks */
+
+static_assert(CBLOCK_NODES * ((1ul << CBLOCKS) - 1) < UINT32_MAX, "Node references are 32-bit");
+
+static inline item_t get_poison(const int byte);
+static item_t POISON = get_poison(FILL_BYTE);
+
+static inline uint32_t ref_of(const uint64_t head);
+static inline uint64_t tagged(const uint64_t old, const uint32_t ref);
+static inline void cpu_relax();
+static inline uint32_t random_slot();
+
+static inline size_t block_of(const uint32_t index);
+static inline size_t block_nodes(const size_t block);
+static inline size_t block_size(const size_t block);
+static inline cnode_t *get_node(cstack_t *const stk, const uint32_t ref);
+static cnode_t *alloc_block(cstack_t *const stk, const size_t block);
+
+static int take_node(cstack_t *const stk, uint32_t *const ref);
+static void put_node(cstack_t *const stk, const uint32_t ref);
+static bool try_push(cstack_t *const stk, std::atomic<uint64_t> *const head, const uint32_t ref);
+static bool try_pop(cstack_t *const stk, std::atomic<uint64_t> *const head, uint32_t *const ref);
+static bool eliminate_push(cstack_t *const stk, const uint32_t ref);
+static uint32_t eliminate_pop(cstack_t *const stk);
+
+static int verify_cstruct(cstack_t *const stk);
+static inline void set_error(int *const error, int value);
+
+#ifdef CANARY_PROTECT
+static inline canary_t *left_canary(cnode_t *const nodes);
+static inline canary_t *right_canary(cnode_t *const nodes, const size_t block);
+#endif /* CANARY_PROTECT */
+
+#define log_cdump(_stk)                  \
+        do {                             \
+                log_err("Stack dump\n"); \
+                dump_cstack(_stk);       \
+        } while (0)
+
+cstack_t *const construct_cstack(cstack_t *const stk)
+{
+        assert(stk);
+
+        stk->head.store(0);
+        stk->free_head.store(0);
+        stk->n_nodes.store(0);
+        stk->size.store(0);
+
+        for (size_t i = 0; i < CBLOCKS; i++)
+                stk->blocks[i].store(nullptr);
+
+        for (size_t i = 0; i < ELIM_SLOTS; i++)
+                stk->elimination[i].store(0);
+
+#ifdef CANARY_PROTECT
+        stk->left_canary  = CANARY;
+        stk->right_canary = CANARY;
+#endif /* CANARY_PROTECT */
+
+        return stk;
+}
+
+cstack_t *const destruct_cstack(cstack_t *const stk)
+{
+        assert(stk);
+
+        for (size_t i = 0; i < CBLOCKS; i++) {
+                cnode_t *nodes = stk->blocks[i].load();
+                if (!nodes)
+                        continue;
+
+#ifdef CANARY_PROTECT
+                free(left_canary(nodes));
+#else
+                free(nodes);
+#endif /* CANARY_PROTECT */
+
+                stk->blocks[i].store(nullptr);
+        }
+
+        stk->head.store(0);
+        stk->free_head.store(0);
+        stk->n_nodes.store(0);
+        stk->size.store(0);
+
+#ifdef CANARY_PROTECT
+        stk->left_canary  = 0;
+        stk->right_canary = 0;
+#endif /* CANARY_PROTECT */
+
+        return stk;
+}
+
+void push_cstack(cstack_t *const stk, const item_t item, int *const error)
+{
+        assert(stk);
+        int err = 0;
+        uint32_t ref = 0;
+
+#ifndef UNPROTECT
+        err = verify_cstruct(stk);
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't push to invalid stack\n");
+                goto finally;
+        }
+
+        err = take_node(stk, &ref);
+        if (err) {
+                log_err("Can't allocate stack node\n");
+                goto finally;
+        }
+
+        get_node(stk, ref)->item = item;
+
+        for (;;) {
+                if (try_push(stk, &stk->head, ref)) {
+                        stk->size.fetch_add(1, std::memory_order_relaxed);
+                        break;
+                }
+
+                if (eliminate_push(stk, ref))
+                        break;
+        }
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_cdump(stk);
+        }
+}
+
+item_t pop_cstack(cstack_t *const stk, int *const error)
+{
+        assert(stk);
+        int err = 0;
+        uint32_t ref = 0;
+        item_t item = POISON;
+
+#ifndef UNPROTECT
+        err = verify_cstruct(stk);
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't pop item from invalid stack\n");
+                goto finally;
+        }
+
+        for (;;) {
+                if (try_pop(stk, &stk->head, &ref)) {
+                        if (ref)
+                                stk->size.fetch_sub(1, std::memory_order_relaxed);
+                        break;
+                }
+
+                ref = eliminate_pop(stk);
+                if (ref)
+                        break;
+        }
+
+        if (!ref) {
+                err = STK_EMPTY_POP;
+                goto finally;
+        }
+
+        item = get_node(stk, ref)->item;
+        put_node(stk, ref);
+
+finally:
+        if (err == STK_EMPTY_POP) {
+                set_error(error, err);
+        } else if (err) {
+                set_error(error, err);
+                log_cdump(stk);
+        }
+
+        return item;
+}
+
+int verify_cstack(cstack_t *const stk)
+{
+        assert(stk);
+        int vrf = verify_cstruct(stk);
+
+        if (ref_of(stk->head.load()) > stk->n_nodes.load())
+                vrf |= INVALID_ITEMS;
+
+#ifdef CANARY_PROTECT
+        for (size_t i = 0; i < CBLOCKS; i++) {
+                cnode_t *nodes = stk->blocks[i].load(std::memory_order_acquire);
+                if (!nodes)
+                        continue;
+
+                canary_t cnry = CANARY ^ (canary_t)nodes;
+
+                if (*left_canary(nodes) != cnry)
+                        vrf |= INVALID_DATA_LCNRY;
+
+                if (*right_canary(nodes, i) != cnry)
+                        vrf |= INVALID_DATA_RCNRY;
+        }
+#endif /* CANARY_PROTECT */
+
+        return vrf;
+}
+
+/**
+ * @brief Verifies concurrent stack structure
+ *
+ * Only stack canaries are checked, so it is O(1).
+ */
+static int verify_cstruct(cstack_t *const stk)
+{
+        assert(stk);
+        int vrf = 0x00000000;
+
+#ifdef CANARY_PROTECT
+        if (stk->left_canary  != CANARY)
+                vrf |= INVALID_STK_LCNRY;
+
+        if (stk->right_canary != CANARY)
+                vrf |= INVALID_STK_RCNRY;
+#endif /* CANARY_PROTECT */
+
+        return vrf;
+}
+
+/**
+ * @brief Takes free node
+ *
+ * @param stk      Stack
+ * @param[out] ref Node reference
+ *
+ * Free list is tried first, then a new node is taken from blocks.
+ * Block is allocated by the first thread which needs it.
+ *
+ * @return 0, STK_OVERFLOW or STK_BAD_ALLOC.
+ */
+static int take_node(cstack_t *const stk, uint32_t *const ref)
+{
+        assert(stk);
+        assert(ref);
+
+        if (try_pop(stk, &stk->free_head, ref) && *ref)
+                return 0;
+
+        uint32_t index = stk->n_nodes.load(std::memory_order_relaxed);
+        do {
+                if (index >= MAX_NODES)
+                        return STK_OVERFLOW;
+        } while (!stk->n_nodes.compare_exchange_weak(index, index + 1, std::memory_order_relaxed));
+
+        size_t block = block_of(index);
+        if (!stk->blocks[block].load(std::memory_order_acquire) && !alloc_block(stk, block))
+                return STK_BAD_ALLOC;
+
+        *ref = index + 1;
+        return 0;
+}
+
+static void put_node(cstack_t *const stk, const uint32_t ref)
+{
+        assert(stk);
+
+        while (!try_push(stk, &stk->free_head, ref))
+                cpu_relax();
+}
+
+/**
+ * @brief Allocates block of nodes
+ *
+ * If other thread has allocated the block first, its block is used.
+ *
+ * @return Block nodes or nullptr in case of an error.
+ */
+static cnode_t *alloc_block(cstack_t *const stk, const size_t block)
+{
+        assert(stk);
+
+        char *raw = (char *)calloc(1, block_size(block));
+        if (!raw)
+                return nullptr;
+
+        cnode_t *nodes = (cnode_t *)raw;
+
+#ifdef CANARY_PROTECT
+        nodes = (cnode_t *)(raw + sizeof(canary_t));
+
+        *left_canary (nodes)        = CANARY ^ (canary_t)nodes;
+        *right_canary(nodes, block) = CANARY ^ (canary_t)nodes;
+#endif /* CANARY_PROTECT */
+
+        cnode_t *expected = nullptr;
+        if (stk->blocks[block].compare_exchange_strong(expected, nodes, std::memory_order_acq_rel))
+                return nodes;
+
+        free(raw);
+        return expected;
+}
+
+/**
+ * @brief Tries to push node to list once
+ *
+ * Release order publishes the node item.
+ */
+static bool try_push(cstack_t *const stk, std::atomic<uint64_t> *const head, const uint32_t ref)
+{
+        uint64_t old = head->load(std::memory_order_relaxed);
+        get_node(stk, ref)->next.store(ref_of(old), std::memory_order_relaxed);
+
+        return head->compare_exchange_weak(old, tagged(old, ref), std::memory_order_release,
+                                           std::memory_order_relaxed);
+}
+
+/**
+ * @brief Tries to pop node from list once
+ *
+ * @param stk      Stack
+ * @param head     List head
+ * @param[out] ref Node reference (0 if list is empty)
+ *
+ * Node can be popped and reused by other thread after its head is read,
+ * then its next is garbage but head tag is changed and CAS fails.
+ *
+ * @return false if head is contended.
+ */
+static bool try_pop(cstack_t *const stk, std::atomic<uint64_t> *const head, uint32_t *const ref)
+{
+        uint64_t old = head->load(std::memory_order_acquire);
+
+        *ref = ref_of(old);
+        if (!*ref)
+                return true;
+
+        uint32_t next = get_node(stk, *ref)->next.load(std::memory_order_relaxed);
+
+        return head->compare_exchange_weak(old, tagged(old, next), std::memory_order_acquire,
+                                           std::memory_order_relaxed);
+}
+
+/**
+ * @brief Offers node to poppers
+ *
+ * Pusher puts node reference to a random slot and waits for a while.
+ *
+ * @return true if node is taken by popper.
+ */
+static bool eliminate_push(cstack_t *const stk, const uint32_t ref)
+{
+        std::atomic<uint64_t> *slot = &stk->elimination[random_slot()];
+
+        uint64_t empty = 0;
+        if (!slot->compare_exchange_strong(empty, ref, std::memory_order_release,
+                                           std::memory_order_relaxed))
+                return false;
+
+        for (size_t i = 0; i < ELIM_SPINS; i++) {
+                if (slot->load(std::memory_order_acquire) == ELIM_TAKEN) {
+                        slot->store(0, std::memory_order_release);
+                        return true;
+                }
+
+                cpu_relax();
+        }
+
+        uint64_t offered = ref;
+        if (slot->compare_exchange_strong(offered, 0, std::memory_order_acq_rel))
+                return false;
+
+        slot->store(0, std::memory_order_release);
+        return true;
+}
+
+/**
+ * @brief Takes node offered by pusher
+ *
+ * @return Node reference or 0.
+ */
+static uint32_t eliminate_pop(cstack_t *const stk)
+{
+        std::atomic<uint64_t> *slot = &stk->elimination[random_slot()];
+
+        uint64_t offered = slot->load(std::memory_order_acquire);
+        if (offered == 0 || offered == ELIM_TAKEN)
+                return 0;
+
+        if (slot->compare_exchange_strong(offered, ELIM_TAKEN, std::memory_order_acq_rel))
+                return (uint32_t)offered;
+
+        return 0;
+}
+
+static inline uint32_t ref_of(const uint64_t head)
+{
+        return (uint32_t)head;
+}
+
+/**
+ * @brief Makes new list head
+ *
+ * Tag of the old head is incremented.
+ */
+static inline uint64_t tagged(const uint64_t old, const uint32_t ref)
+{
+        return ((old >> 32) + 1) << 32 | ref;
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * @brief Gets random elimination slot
+ *
+ * It is xorshift generator with a thread-local state.
+ */
+static inline uint32_t random_slot()
+{
+        static thread_local uint32_t state = 0;
+        if (!state)
+                state = (uint32_t)(size_t)&state | 1;
+
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+
+        return state % ELIM_SLOTS;
+}
+
+/**
+ * @brief Gets block of the node
+ *
+ * Block i holds CBLOCK_NODES * 2^i nodes starting
+ * from CBLOCK_NODES * (2^i - 1) index.
+ */
+static inline size_t block_of(const uint32_t index)
+{
+        size_t n = index / CBLOCK_NODES + 1;
+        size_t block = 0;
+
+        while (n >>= 1)
+                block++;
+
+        return block;
+}
+
+static inline size_t block_nodes(const size_t block)
+{
+        return CBLOCK_NODES << block;
+}
+
+static inline size_t block_size(const size_t block)
+{
+        size_t size = block_nodes(block) * sizeof(cnode_t);
+
+#ifdef CANARY_PROTECT
+        size += 2 * sizeof(canary_t);
+#endif /* CANARY_PROTECT */
+
+        return size;
+}
+
+static inline cnode_t *get_node(cstack_t *const stk, const uint32_t ref)
+{
+        assert(stk);
+        assert(ref);
+
+        uint32_t index = ref - 1;
+        size_t block   = block_of(index);
+
+        cnode_t *nodes = stk->blocks[block].load(std::memory_order_acquire);
+        assert(nodes);
+
+        return nodes + (index - (block_nodes(block) - CBLOCK_NODES));
+}
+
+#ifdef CANARY_PROTECT
+static inline canary_t *left_canary(cnode_t *const nodes)
+{
+        assert(nodes);
+        return (canary_t *)((char *)nodes - sizeof(canary_t));
+}
+
+static inline canary_t *right_canary(cnode_t *const nodes, const size_t block)
+{
+        assert(nodes);
+        return (canary_t *)(nodes + block_nodes(block));
+}
+#endif /* CANARY_PROTECT */
+
+static inline item_t get_poison(const int byte)
+{
+        item_t poison = 0;
+        memset(&poison, byte, sizeof(item_t));
+
+        return poison;
+}
+
+static inline void set_error(int *const error, int value)
+{
+        if (error)
+                *error = value;
+}
+
+void dump_cstack(cstack_t *const stk)
+{
+        assert(stk);
+        int vrf = verify_cstack(stk);
+        (void)vrf; /* Dump is empty with NOLOG */
+
+        log_buf("----------------------------------------------\n");
+        log_buf(" Concurrent stack: %s\n", vrf ? "error" : "ok");
+        log_buf(" Verification:  %x\n", (unsigned)vrf);
+        log_buf(" Size:     %15zu\n", stk->size.load());
+        log_buf(" Nodes:    %15u\n",  stk->n_nodes.load());
+        log_buf(" Top node: %15u\n",  ref_of(stk->head.load()));
+        log_buf("----------------------------------------------\n");
+
+#ifdef CANARY_PROTECT
+        log_buf(" Left  stack canary(hex) = %lx\n", stk->left_canary);
+        log_buf(" Right stack canary(hex) = %lx\n", stk->right_canary);
+        log_buf("----------------------------------------------\n");
+
+        for (size_t i = 0; i < CBLOCKS; i++) {
+                cnode_t *nodes = stk->blocks[i].load();
+                if (!nodes)
+                        continue;
+
+                log_buf(" Block %2zu: 0x%lx, %zu nodes, canaries %lx %lx\n", i, (size_t)nodes,
+                        block_nodes(i), *left_canary(nodes), *right_canary(nodes, i));
+        }
+        log_buf("----------------------------------------------\n");
+#endif /* CANARY_PROTECT */
+
+        log_buf("\n\n\n");
+        log_flush();
+}
+
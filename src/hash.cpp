@@ -1,5 +1,49 @@
+#include <stdint.h>
+#include <string.h>
 #include "include/hash.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HASH_X86_CRC
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HASH_ARM_CRC
+#endif
+
+static const uint32_t PRIME1 = 0x9E3779B1;
+static const uint32_t PRIME2 = 0x85EBCA77;
+static const uint32_t PRIME3 = 0xC2B2AE3D;
+static const uint32_t PRIME4 = 0x27D4EB2F;
+static const uint32_t PRIME5 = 0x165667B1;
+
+static const uint32_t CRC32C_POLY = 0x82F63B78; /**< Reflected Castagnoli polynomial */
+
+static inline uint32_t load32(const unsigned char *const data)
+{
+        uint32_t word = 0;
+        memcpy(&word, data, sizeof(word));
+        return word;
+}
+
+static inline uint32_t rotl32(const uint32_t x, const int r)
+{
+        return (x << r) | (x >> (32 - r));
+}
+
+/**
+ * @brief Murmur3 finalizer
+ */
+static inline uint32_t fmix32(uint32_t h)
+{
+        h ^= h >> 16;
+        h *= 0x85EBCA6B;
+        h ^= h >> 13;
+        h *= 0xC2B2AE35;
+        h ^= h >> 16;
+
+        return h;
+}
+
 unsigned int murmur_hash(const void *key, int len, unsigned int seed)
 {
         const unsigned int mp = 0x5bd1e995;
@@ -10,13 +54,13 @@ unsigned int murmur_hash(const void *key, int len, unsigned int seed)
         const unsigned char *data = (const unsigned char *)key;
 
         while (len >= 4) {
-                unsigned int k = *(unsigned int *)data;
+                unsigned int k = load32(data);
+
+                k *= mp;
+                k ^= k >> sft;
+                k *= mp;
 
-                k *= mp; 
-                k ^= k >> sft; 
-                k *= mp; 
-                
-                hash *= mp; 
+                hash *= mp;
                 hash ^= k;
 
                 data += 4;
@@ -24,11 +68,11 @@ unsigned int murmur_hash(const void *key, int len, unsigned int seed)
         }
 
         switch (len) {
-        case 3: 
+        case 3:
                 hash ^= data[2] << 16;
-        case 2: 
+        case 2:
                 hash ^= data[1] << 8;
-        case 1: 
+        case 1:
                 hash ^= data[0];
 
                 hash *= mp;
@@ -39,4 +83,415 @@ unsigned int murmur_hash(const void *key, int len, unsigned int seed)
         hash ^= hash >> 15;
 
         return hash;
-} 
+}
+
+/* Multi-lane kernel */
+
+/**
+ * @brief xxHash32-style block hash
+ *
+ * Four accumulators are independent, so multiplications are pipelined.
+ */
+static uint32_t lanes_hash(const unsigned char *data, size_t len, const uint32_t seed)
+{
+        const unsigned char *const end = data + len;
+        uint32_t hash = 0;
+
+        if (len >= 16) {
+                uint32_t v1 = seed + PRIME1 + PRIME2;
+                uint32_t v2 = seed + PRIME2;
+                uint32_t v3 = seed;
+                uint32_t v4 = seed - PRIME1;
+
+                do {
+                        v1 = rotl32(v1 + load32(data)      * PRIME2, 13) * PRIME1;
+                        v2 = rotl32(v2 + load32(data + 4)  * PRIME2, 13) * PRIME1;
+                        v3 = rotl32(v3 + load32(data + 8)  * PRIME2, 13) * PRIME1;
+                        v4 = rotl32(v4 + load32(data + 12) * PRIME2, 13) * PRIME1;
+
+                        data += 16;
+                } while (end - data >= 16);
+
+                hash = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+        } else {
+                hash = seed + PRIME5;
+        }
+
+        hash += (uint32_t)len;
+
+        for (; end - data >= 4; data += 4)
+                hash = rotl32(hash + load32(data) * PRIME3, 17) * PRIME4;
+
+        for (; data < end; data++)
+                hash = rotl32(hash + *data * PRIME5, 11) * PRIME1;
+
+        return fmix32(hash);
+}
+
+/**
+ * @brief Position key of a slot
+ */
+static inline uint32_t pos_key(const size_t index, const uint32_t seed)
+{
+        return (uint32_t)index * PRIME1 ^ (uint32_t)((uint64_t)index >> 32) ^ seed;
+}
+
+/**
+ * @brief Multi-lane slot hash
+ *
+ * It uses 32-bit operations only, so loops over slots are vectorized.
+ */
+__attribute__((always_inline))
+static inline uint32_t lane_slot(const unsigned char *data, int len, const uint32_t key)
+{
+        uint32_t hash = key ^ (uint32_t)len * PRIME5;
+
+        for (; len >= 4; len -= 4, data += 4) {
+                hash  = (hash ^ load32(data)) * PRIME2;
+                hash ^= hash >> 15;
+        }
+
+        if (len) {
+                uint32_t word = 0;
+                memcpy(&word, data, (size_t)len);
+
+                hash  = (hash ^ word) * PRIME2;
+                hash ^= hash >> 15;
+        }
+
+        return fmix32(hash);
+}
+
+typedef uint32_t lanes_t __attribute__((vector_size(32)));
+
+static const uint32_t LANES = sizeof(lanes_t) / sizeof(uint32_t);
+
+__attribute__((always_inline))
+static inline void fmix_lanes(lanes_t *const h)
+{
+        *h ^= *h >> 16;
+        *h *= 0x85EBCA6B;
+        *h ^= *h >> 13;
+        *h *= 0xC2B2AE35;
+        *h ^= *h >> 16;
+}
+
+__attribute__((always_inline))
+static inline uint32_t xor_lanes(const lanes_t *const h)
+{
+        uint32_t hash = 0;
+        for (uint32_t i = 0; i < LANES; i++)
+                hash ^= (*h)[i];
+
+        return hash;
+}
+
+/**
+ * @brief Multi-lane digest of fixed-size slots
+ *
+ * It hashes LANES slots at once with the same values as lane_slot().
+ * Slot indices must fit in 32 bits, then high part of position key is zero.
+ * It is compiled for AVX2 and baseline, the best one is chosen at load time.
+ */
+__attribute__((target_clones("avx2", "default")))
+static uint32_t lane_slots4(const unsigned char *const data, uint32_t from,
+                            const uint32_t to, const uint32_t seed)
+{
+        lanes_t acc = {};
+        lanes_t idx = {0, 1, 2, 3, 4, 5, 6, 7};
+        idx += from;
+
+        for (; to - from >= LANES; from += LANES, idx += LANES) {
+                lanes_t word;
+                memcpy(&word, data + (size_t)from * 4, sizeof(word));
+
+                lanes_t h = (idx * PRIME1 ^ seed ^ 4 * PRIME5 ^ word) * PRIME2;
+                h ^= h >> 15;
+
+                fmix_lanes(&h);
+                acc ^= h;
+        }
+
+        uint32_t hash = xor_lanes(&acc);
+
+        for (uint32_t i = from; i < to; i++)
+                hash ^= lane_slot(data + (size_t)i * 4, 4, i * PRIME1 ^ seed);
+
+        return hash;
+}
+
+__attribute__((target_clones("avx2", "default")))
+static uint32_t lane_slots8(const unsigned char *const data, uint32_t from,
+                            const uint32_t to, const uint32_t seed)
+{
+        const lanes_t even = {0, 2, 4, 6,  8, 10, 12, 14};
+        const lanes_t odd  = {1, 3, 5, 7,  9, 11, 13, 15};
+
+        lanes_t acc = {};
+        lanes_t idx = {0, 1, 2, 3, 4, 5, 6, 7};
+        idx += from;
+
+        for (; to - from >= LANES; from += LANES, idx += LANES) {
+                lanes_t lo, hi;
+                memcpy(&lo, data + (size_t)from * 8, sizeof(lo));
+                memcpy(&hi, data + (size_t)from * 8 + sizeof(lo), sizeof(hi));
+
+                lanes_t h = (idx * PRIME1 ^ seed ^ 8 * PRIME5 ^ __builtin_shuffle(lo, hi, even)) * PRIME2;
+                h ^= h >> 15;
+                h  = (h ^ __builtin_shuffle(lo, hi, odd)) * PRIME2;
+                h ^= h >> 15;
+
+                fmix_lanes(&h);
+                acc ^= h;
+        }
+
+        uint32_t hash = xor_lanes(&acc);
+
+        for (uint32_t i = from; i < to; i++)
+                hash ^= lane_slot(data + (size_t)i * 8, 8, i * PRIME1 ^ seed);
+
+        return hash;
+}
+
+static uint32_t lane_slots(const unsigned char *const data, const int len,
+                           const size_t from, const size_t to, const uint32_t seed)
+{
+        if (to <= UINT32_MAX && len == 4)
+                return lane_slots4(data, (uint32_t)from, (uint32_t)to, seed);
+        if (to <= UINT32_MAX && len == 8)
+                return lane_slots8(data, (uint32_t)from, (uint32_t)to, seed);
+
+        uint32_t hash = 0;
+        for (size_t i = from; i < to; i++)
+                hash ^= lane_slot(data + i * (size_t)len, len, pos_key(i, seed));
+
+        return hash;
+}
+
+/* CRC32C kernel */
+
+/**
+ * @brief Software CRC32C table
+ */
+struct crc_table_t {
+        uint32_t entry[256];
+
+        crc_table_t()
+        {
+                for (uint32_t i = 0; i < 256; i++) {
+                        uint32_t crc = i;
+                        for (int bit = 0; bit < 8; bit++)
+                                crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+
+                        entry[i] = crc;
+                }
+        }
+};
+
+static inline uint32_t crc32c_sw(const uint32_t *const table, uint32_t crc,
+                                 const unsigned char *data, size_t len)
+{
+        while (len--)
+                crc = (crc >> 8) ^ table[(crc ^ *data++) & 0xFF];
+
+        return crc;
+}
+
+#if defined(HASH_X86_CRC)
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw(uint32_t crc, const unsigned char *data, size_t len)
+{
+#ifdef __x86_64__
+        for (; len >= 8; len -= 8, data += 8) {
+                uint64_t word = 0;
+                memcpy(&word, data, sizeof(word));
+                crc = (uint32_t)_mm_crc32_u64(crc, word);
+        }
+#endif /* __x86_64__ */
+
+        for (; len >= 4; len -= 4, data += 4)
+                crc = _mm_crc32_u32(crc, load32(data));
+
+        for (; len; len--)
+                crc = _mm_crc32_u8(crc, *data++);
+
+        return crc;
+}
+#elif defined(HASH_ARM_CRC)
+static inline uint32_t crc32c_hw(uint32_t crc, const unsigned char *data, size_t len)
+{
+        for (; len >= 4; len -= 4, data += 4)
+                crc = __crc32cw(crc, load32(data));
+
+        for (; len; len--)
+                crc = __crc32cb(crc, *data++);
+
+        return crc;
+}
+#endif
+
+/**
+ * @brief Checks CRC32C instructions support
+ *
+ * It is checked once.
+ */
+static bool crc_hw_supported()
+{
+#if defined(HASH_X86_CRC)
+        static const bool supported = __builtin_cpu_supports("sse4.2");
+        return supported;
+#elif defined(HASH_ARM_CRC)
+        return true;
+#else
+        return false;
+#endif
+}
+
+static const uint32_t *crc_table()
+{
+        static const crc_table_t table;
+        return table.entry;
+}
+
+/**
+ * @brief CRC32C slot hash finalizer
+ *
+ * CRC is linear, so equal corruptions of two slots would cancel out
+ * in XOR digest. Multiplication makes slot hash non-linear.
+ */
+static inline uint32_t crc_mix(uint32_t crc)
+{
+        crc *= PRIME2;
+        crc ^= crc >> 15;
+
+        return crc;
+}
+
+static uint32_t crc_slots_sw(const unsigned char *const data, const int len,
+                             const size_t from, const size_t to, const uint32_t seed)
+{
+        const uint32_t *table = crc_table();
+        uint32_t hash = 0;
+
+        for (size_t i = from; i < to; i++)
+                hash ^= crc_mix(crc32c_sw(table, pos_key(i, seed), data + i * (size_t)len,
+                                          (size_t)len));
+
+        return hash;
+}
+
+#if defined(HASH_X86_CRC) || defined(HASH_ARM_CRC)
+#if defined(HASH_X86_CRC)
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t crc_slots_hw(const unsigned char *const data, const int len,
+                             const size_t from, const size_t to, const uint32_t seed)
+{
+        uint32_t hash = 0;
+
+        if (len == 4) {
+                for (size_t i = from; i < to; i++)
+                        hash ^= crc_mix(crc32c_hw(pos_key(i, seed), data + i * 4, 4));
+        } else if (len == 8) {
+                for (size_t i = from; i < to; i++)
+                        hash ^= crc_mix(crc32c_hw(pos_key(i, seed), data + i * 8, 8));
+        } else {
+                for (size_t i = from; i < to; i++)
+                        hash ^= crc_mix(crc32c_hw(pos_key(i, seed), data + i * (size_t)len,
+                                                  (size_t)len));
+        }
+
+        return hash;
+}
+#endif
+
+static uint32_t crc_slots(const unsigned char *const data, const int len,
+                          const size_t from, const size_t to, const uint32_t seed)
+{
+#if defined(HASH_X86_CRC) || defined(HASH_ARM_CRC)
+        if (crc_hw_supported())
+                return crc_slots_hw(data, len, from, to, seed);
+#endif
+
+        return crc_slots_sw(data, len, from, to, seed);
+}
+
+static uint32_t crc_slot(const unsigned char *const data, const int len, const uint32_t key)
+{
+#if defined(HASH_X86_CRC) || defined(HASH_ARM_CRC)
+        if (crc_hw_supported())
+                return crc_mix(crc32c_hw(key, data, (size_t)len));
+#endif
+
+        return crc_mix(crc32c_sw(crc_table(), key, data, (size_t)len));
+}
+
+static uint32_t crc_hash(const unsigned char *const data, const size_t len, const uint32_t seed)
+{
+        uint32_t crc = 0;
+
+#if defined(HASH_X86_CRC) || defined(HASH_ARM_CRC)
+        if (crc_hw_supported())
+                crc = crc32c_hw(seed, data, len);
+        else
+#endif
+                crc = crc32c_sw(crc_table(), seed, data, len);
+
+        return fmix32(crc ^ (uint32_t)len);
+}
+
+/* Interface */
+
+unsigned int block_hash(const void *key, int len, unsigned int seed, int kind)
+{
+        switch (kind) {
+        case HASH_MULTILANE:
+                return lanes_hash((const unsigned char *)key, (size_t)len, seed);
+        case HASH_CRC32C:
+                return crc_hash((const unsigned char *)key, (size_t)len, seed);
+        case HASH_MURMUR:
+        default:
+                return murmur_hash(key, len, seed);
+        }
+}
+
+unsigned int slot_hash(const void *item, int len, size_t index, unsigned int seed, int kind)
+{
+        switch (kind) {
+        case HASH_MULTILANE:
+                return lane_slot((const unsigned char *)item, len, pos_key(index, seed));
+        case HASH_CRC32C:
+                return crc_slot((const unsigned char *)item, len, pos_key(index, seed));
+        case HASH_MURMUR:
+        default:
+                break;
+        }
+
+        const unsigned int pos = (unsigned int)(index * 0x9E3779B97F4A7C15) ^
+                                 (unsigned int)(index >> 32);
+
+        return murmur_hash(item, len, seed ^ pos);
+}
+
+unsigned int slots_hash(const void *items, int len, size_t from, size_t to,
+                        unsigned int seed, int kind)
+{
+        const unsigned char *data = (const unsigned char *)items;
+        unsigned int hash = 0;
+
+        switch (kind) {
+        case HASH_MULTILANE:
+                return lane_slots(data, len, from, to, seed);
+        case HASH_CRC32C:
+                return crc_slots(data, len, from, to, seed);
+        case HASH_MURMUR:
+        default:
+                break;
+        }
+
+        for (size_t i = from; i < to; i++)
+                hash ^= slot_hash(data + i * (size_t)len, len, i, seed);
+
+        return hash;
+}
+
@@ -0,0 +1,210 @@
+/**
+ * @file
+ * @brief  Stack allocators
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * Stack buffers are allocated through stack_alloc_t interface.
+ * Sizes are passed to every call, so allocators don't need block headers.
+ */
+
+#ifndef ALLOC_H_
+#define ALLOC_H_
+
+#include <stddef.h>
+
+/**
+ * @brief Allocator interface
+ *
+ * alloc()   allocates size bytes,
+ * realloc() resizes block of old_size bytes to size bytes
+ *           (ptr can be nullptr, then it is the same as alloc()),
+ * free()    frees block of size bytes.
+ *
+ * All functions get ctx as the first argument.
+ * Blocks must be aligned at least to alignof(max_align_t).
+ * In case of an error nullptr is returned and old block is untouched.
+ *
+ * Stack metadata (chunk tree) is allocated by meta allocator if it is set.
+ */
+struct stack_alloc_t {
+        void *(*alloc)  (void *ctx, size_t size);
+        void *(*realloc)(void *ctx, void *ptr, size_t old_size, size_t size);
+        void  (*free)   (void *ctx, void *ptr, size_t size);
+
+        void *ctx;
+
+        const stack_alloc_t *meta = nullptr; /**< Metadata allocator (nullptr - the same one) */
+};
+
+const size_t POOL_MIN_BLOCK  = 32;        /**< Smallest pool size class         */
+const size_t POOL_MAX_BLOCK  = 64 * 1024; /**< Larger blocks bypass the pool    */
+const size_t POOL_MAX_BLOCKS = 64;        /**< Free blocks kept per size class  */
+
+const size_t MAP_HEADER_SIZE = 4096;      /**< File header before mapped block  */
+
+const size_t HUGE_PAGE       = 2 * 1024 * 1024; /**< Huge blocks are rounded up to it  */
+const int    HUGE_MAX_NODES  = 1024;            /**< NUMA nodes supported by mbind() */
+
+const size_t GUARD_MAX_BLOCKS = 4096;     /**< Guarded blocks faults are mapped for */
+
+/**
+ * @brief libc allocator
+ *
+ * It is ANSI malloc(), realloc() and free() wrapper.
+ * It is used if stack_params_t::alloc is nullptr.
+ */
+extern const stack_alloc_t LIBC_ALLOC;
+
+/**
+ * @brief Thread-local pool allocator
+ *
+ * Blocks are rounded up to power of 2 size classes from POOL_MIN_BLOCK
+ * to POOL_MAX_BLOCK bytes. Freed blocks are kept in the calling thread's
+ * free lists and reused without locking. Each thread has its own pool,
+ * which is released at thread exit.
+ *
+ * Block may be freed by any thread, then it goes to that thread's pool.
+ */
+extern const stack_alloc_t POOL_ALLOC;
+
+/**
+ * @brief Pool statistics of the calling thread
+ */
+struct pool_stats_t {
+        size_t hits   = 0; /**< Blocks reused from free lists */
+        size_t misses = 0; /**< Blocks allocated by malloc()  */
+        size_t cached = 0; /**< Blocks in free lists          */
+};
+
+/**
+ * @brief Gets pool statistics of the calling thread
+ */
+pool_stats_t pool_stats();
+
+/**
+ * @brief Returns all free blocks of the calling thread's pool to libc
+ */
+void pool_release();
+
+/**
+ * @brief Opens huge page allocator
+ *
+ * @param node    NUMA node to bind blocks to (-1 - no binding)
+ * @param hugetlb Try reserved huge pages (MAP_HUGETLB) first
+ *
+ * Every block is an anonymous mapping rounded up to HUGE_PAGE bytes.
+ * If reserved huge pages are not used or not available, transparent huge pages
+ * are requested by madvise(MADV_HUGEPAGE). Blocks are bound to the node by mbind().
+ * Blocks are resized by mremap(), pages are not copied unless kernel 
+ * can't remap huge pages. Metadata is allocated by LIBC_ALLOC.
+ *
+ * It is designed for very large stacks: small blocks still take HUGE_PAGE of address space.
+ * Allocator must outlive its blocks and is closed by close_huge_alloc().
+ *
+ * @return Allocator or nullptr in case of an error (errno is set).
+ */
+stack_alloc_t *open_huge_alloc(const int node = -1, const bool hugetlb = false);
+
+/**
+ * @brief Closes huge page allocator
+ */
+void close_huge_alloc(stack_alloc_t *const alloc);
+
+/**
+ * @brief Guard page allocator
+ *
+ * Every block is an anonymous mapping between two PROT_NONE guard pages.
+ * Block end is placed at the right guard page (rounded up to alignof(max_align_t)),
+ * so overflow faults at once, and underflow faults past the first page padding 
+ * (there is no padding if block size is a multiple of the page size).
+ * Blocks are not resized in place, realloc() copies them.
+ * Metadata is allocated by LIBC_ALLOC.
+ *
+ * Up to GUARD_MAX_BLOCKS blocks are registered (records are mapped by the first block),
+ * so guard_fault() finds the block of a fault. Other blocks are still guarded, but their faults are not mapped.
+ */
+extern const stack_alloc_t GUARD_ALLOC;
+
+/**
+ * @brief Sets owner of a guarded block
+ *
+ * @param alloc Block allocator
+ * @param block Block
+ * @param owner Block owner (stack)
+ *
+ * @return 0 or -1 if it is not a registered GUARD_ALLOC block.
+ */
+int set_guard_owner(const stack_alloc_t *const alloc, const void *const block, 
+                    const void *const owner);
+
+/**
+ * @brief Finds guard page containing address
+ *
+ * @param addr       Fault address
+ * @param[out] owner Owner of the guarded block (nullptr if it is not set)
+ *
+ * It is async-signal-safe, so it can be called by SIGSEGV handler.
+ *
+ * @return true if address is in a guard page of a registered block.
+ */
+bool guard_fault(const void *const addr, const void **const owner);
+
+/**
+ * @brief Installs SIGSEGV handler for guard pages
+ *
+ * @param fd Fault report file descriptor (opened before)
+ *
+ * Faults in guard pages of registered blocks are reported to fd by write(2)
+ * with the fault address and the block owner, the handler makes async-signal-safe
+ * calls only. Then previous action is restored and the faulting instruction
+ * is restarted, so the fault is handled as if the handler was not installed.
+ *
+ * @return 0 or -1 (errno is set).
+ */
+int set_guard_handler(const int fd);
+
+/**
+ * @brief Opens file mapping allocator
+ *
+ * @param path   File path
+ * @param create Create new (or truncate existing) file or open existing one
+ *
+ * Allocator holds a single block mapped from the file after MAP_HEADER_SIZE
+ * bytes of the file header. File is resized by ftruncate() and remapped
+ * by mremap() as the block is reallocated. The first alloc() on an existing
+ * file keeps its data. Metadata is allocated by LIBC_ALLOC.
+ *
+ * Allocator is closed when its block is freed, close_map_alloc() is
+ * needed only if the block has never been allocated.
+ *
+ * @return Allocator or nullptr in case of an error (errno is set).
+ */
+stack_alloc_t *open_map_alloc(const char *const path, const bool create);
+
+/**
+ * @brief Closes file mapping allocator
+ */
+void close_map_alloc(stack_alloc_t *const alloc);
+
+/**
+ * @brief Gets file header of mapping allocator
+ *
+ * @return MAP_HEADER_SIZE bytes of the header or nullptr if it is not a mapping allocator.
+ */
+void *map_header(const stack_alloc_t *const alloc);
+
+/**
+ * @brief Gets size of the block stored in the file
+ */
+size_t map_block_size(const stack_alloc_t *const alloc);
+
+/**
+ * @brief Flushes file header and block to disk
+ *
+ * @return 0 or -1 in case of an error (errno is set).
+ */
+int sync_map(const stack_alloc_t *const alloc);
+
+#endif /* ALLOC_H_ */
+
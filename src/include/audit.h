@@ -0,0 +1,174 @@
+/**
+ * @file
+ * @brief  Background stack auditor
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * Registered stacks are verified by the auditor thread every period, so
+ * the owner thread keeps O(1) structural checks only (VERIFY_STRUCT).
+ * Every stack operation holds the stack by its entry lock (if stack is
+ * compiled with STACK_AUDIT) and auditor verifies AUDIT_SLICE chunks at a time,
+ * so the owner waits for one slice at most.
+ *
+ * Failures are reported by the callback with the invariant_err_t mask
+ * and JSON dump of the stack (see dump_stack_json()).
+ */
+
+#ifndef AUDIT_H_
+#define AUDIT_H_
+
+#include <atomic>
+#include <thread>
+#include "stack.h"
+
+const size_t AUDIT_SLICE  = 4;   /**< Chunks verified with the stack held */
+const size_t AUDIT_SPINS  = 64;  /**< Lock spins before yield            */
+const size_t AUDIT_WINDOW = 16;  /**< Top items in the failure report    */
+
+struct auditor_t;
+
+/**
+ * @brief Auditor entry of a stack
+ *
+ * Lock is recursive, so stack functions can call each other.
+ */
+struct audit_entry_t {
+        std::atomic<const void *> owner {nullptr}; /**< Thread holding the stack */
+        size_t     depth         = 0;              /**< Owner's lock depth       */
+
+        stack_t   *stk           = nullptr;
+        auditor_t *auditor       = nullptr;
+        size_t     chunk         = 0;              /**< Next slice               */
+        int        failed        = 0;              /**< Reported failure         */
+
+        int        verify        = VERIFY_LEVEL;   /**< Owner's policy           */
+        size_t     verify_period = VERIFY_PERIOD;
+};
+
+/**
+ * @brief Audit failure callback
+ *
+ * @param stk    Failed stack
+ * @param vrf    Bit mask composed of invariant_err_t elemets
+ * @param report JSON dump of the stack
+ * @param ctx    Callback context
+ *
+ * It is called by the auditor thread once per new failure. Stack can't be
+ * unregistered during the call, callback must not register or unregister stacks.
+ */
+typedef void (*audit_callback_t)(stack_t *const stk, const int vrf, const char *const report,
+                                 void *const ctx);
+
+/**
+ * @brief Gets lock owner id of the calling thread
+ */
+inline const void *audit_self()
+{
+        static thread_local char self = 0;
+        return &self;
+}
+
+static inline void audit_lock(audit_entry_t *const entry)
+{
+        const void *self = audit_self();
+        if (entry->owner.load(std::memory_order_relaxed) == self) {
+                entry->depth++;
+                return;
+        }
+
+        const void *none = nullptr;
+        for (size_t spins = 1; !entry->owner.compare_exchange_weak(none, self, std::memory_order_acquire,
+                                                                   std::memory_order_relaxed); spins++) {
+                none = nullptr;
+                if (spins % AUDIT_SPINS == 0)
+                        std::this_thread::yield();
+        }
+
+        entry->depth = 1;
+}
+
+static inline void audit_unlock(audit_entry_t *const entry)
+{
+        if (--entry->depth == 0)
+                entry->owner.store(nullptr, std::memory_order_release);
+}
+
+#ifdef STACK_AUDIT
+/**
+ * @brief Holds stack until the end of scope
+ *
+ * It costs a null check if stack is not registered.
+ */
+struct audit_guard_t {
+        audit_entry_t *const entry;
+
+        explicit audit_guard_t(const stack_t *const stk) : entry(stk->audit)
+        {
+                if (entry)
+                        audit_lock(entry);
+        }
+
+        ~audit_guard_t()
+        {
+                if (entry)
+                        audit_unlock(entry);
+        }
+
+        audit_guard_t(const audit_guard_t &)            = delete;
+        audit_guard_t &operator=(const audit_guard_t &) = delete;
+};
+
+#define audit_scope(_stk) audit_guard_t _audit_guard(_stk)
+#else
+#define audit_scope(_stk) do {} while (0)
+#endif /* STACK_AUDIT */
+
+/**
+ * @brief Starts auditor thread
+ *
+ * @param period_ms  Audit period in milliseconds
+ * @param callback   Failure callback (nullptr - failures are logged)
+ * @param ctx        Callback context
+ * @param[out] error Error proceeded
+ *
+ * STK_INVALID is set if stack is compiled without STACK_AUDIT.
+ *
+ * @return Auditor or nullptr in case of an error
+ */
+auditor_t *open_auditor(const size_t period_ms, audit_callback_t callback = nullptr,
+                        void *const ctx = nullptr, int *const error = nullptr);
+
+/**
+ * @brief Stops auditor thread
+ *
+ * @param auditor Auditor to stop
+ *
+ * Stacks should be unregistered before. Otherwise they are not audited anymore,
+ * but their entries are kept until unaudit_stack() or destruct_stack().
+ */
+void close_auditor(auditor_t *const auditor);
+
+/**
+ * @brief Registers stack with auditor
+ *
+ * @param auditor    Auditor
+ * @param stk        Constructed stack
+ * @param[out] error Error proceeded
+ *
+ * Stack is fully verified and its policy is set to VERIFY_STRUCT.
+ * It must be called by the stack owner thread.
+ * In case of an error, nothing happens to the stack.
+ */
+void audit_stack(auditor_t *const auditor, stack_t *const stk, int *const error = nullptr);
+
+/**
+ * @brief Unregisters stack
+ *
+ * @param stk Stack
+ *
+ * Owner's verification policy is restored. It is called by destruct_stack() as well,
+ * it must not be called concurrently with close_auditor().
+ */
+void unaudit_stack(stack_t *const stk);
+
+#endif /* AUDIT_H_ */
@@ -0,0 +1,93 @@
+/**
+ * @file
+ * @brief  Batch operations on many stacks
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * Batch is an array of (stack, operation) pairs. Operations are grouped
+ * by stack keeping their order, so the result is the same as if they were
+ * applied one by one. Pops of items pushed by the same batch are matched
+ * with their pushes and don't reach the stack, the rest of a group is applied
+ * by one update_stack() call: every touched stack is verified and rehashed once.
+ *
+ * Stack headers are prefetched BATCH_PREFETCH groups ahead.
+ */
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "stack.h"
+
+const size_t BATCH_PREFETCH = 8;  /**< Groups prefetched ahead         */
+const size_t BATCH_CHUNK    = 64; /**< Groups taken by a thread at once */
+
+/**
+ * @brief Batch operation kinds
+ */
+enum batch_kind_t {
+        BATCH_PUSH = 0,
+        BATCH_POP  = 1,
+};
+
+/**
+ * @brief Batch operation
+ */
+struct batch_op_t {
+        stack_t *stk   = nullptr;    /**< Stack to update                   */
+        int      kind  = BATCH_PUSH; /**< Operation (batch_kind_t)          */
+        item_t   item  = 0;          /**< Item to push or 'popped' item     */
+        int      error = 0;          /**< Operation error (0 if it is done) */
+};
+
+/**
+ * @brief Batch thread pool
+ */
+struct batch_pool_t;
+
+/**
+ * @brief Applies batch of operations
+ *
+ * @param ops        Operations
+ * @param n          Number of operations
+ * @param[out] error Error of the first failed operation
+ *
+ * Every operation error is set to its error field. If a stack update fails,
+ * every operation on that stack fails and nothing happens to the stack.
+ * A pop from a stack that is empty at its turn fails with STK_EMPTY_POP alone.
+ */
+void apply_batch(batch_op_t *const ops, const size_t n, int *const error = nullptr);
+
+/**
+ * @brief Creates batch thread pool
+ *
+ * @param n_threads  Number of threads including the caller one (0 - number of CPUs)
+ * @param[out] error Error proceeded
+ *
+ * @return Pool or nullptr in case of an error
+ */
+batch_pool_t *open_batch_pool(const size_t n_threads = 0, int *const error = nullptr);
+
+/**
+ * @brief Stops and frees batch thread pool
+ *
+ * @param pool Pool to close
+ */
+void close_batch_pool(batch_pool_t *const pool);
+
+/**
+ * @brief Applies batch of operations in parallel
+ *
+ * @param pool       Thread pool
+ * @param ops        Operations
+ * @param n          Number of operations
+ * @param[out] error Error of the first failed operation
+ *
+ * The same as apply_batch(), but groups are spread across the pool threads
+ * and the caller thread by BATCH_CHUNK groups. Every stack is updated by one
+ * thread, so stacks must not be shared with threads outside the batch.
+ * Only one batch can be applied by a pool at a time.
+ */
+void apply_batch_parallel(batch_pool_t *const pool, batch_op_t *const ops, const size_t n,
+                          int *const error = nullptr);
+
+#endif /* BATCH_H_ */
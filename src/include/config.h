@@ -1,9 +1,51 @@
 #ifndef CONFIG_H_
 #define CONFIG_H_
 
+/* Define CUSTOM_CONFIG to set protection and log flags from the command line */
+#ifndef CUSTOM_CONFIG
 //#define UNPROTECT
 #define CANARY_PROTECT
 #define HASH_PROTECT
 //#define NOLOG
+//#define LOG_SYNC
+//#define STACK_STATS
+//#define SIDE_META
+//#define STACK_AUDIT
+#endif /* CUSTOM_CONFIG */
+
+/* Log records below this level are compiled out (see log.h) */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif /* LOG_LEVEL */
+
+/* Default verification policy of a new stack (see verify_level_t).
+ * Dirty chunks verification keeps push and pop independent of capacity with HASH_PROTECT,
+ * VERIFY_FULL rehashes the whole capacity on every operation. */
+#ifndef VERIFY_LEVEL
+#define VERIFY_LEVEL  VERIFY_DIRTY
+#endif /* VERIFY_LEVEL */
+#define VERIFY_PERIOD 64
+
+/* Default poison mode of a new stack (see poison_mode_t) */
+#ifdef UNPROTECT
+#define POISON_MODE POISON_NONE
+#else
+#define POISON_MODE POISON_EAGER
+#endif /* UNPROTECT */
+
+/* Items kept inside stack_t before spilling to allocator (see stack_params_t) */
+#ifndef INLINE_CAP
+#define INLINE_CAP 16
+#endif /* INLINE_CAP */
+
+/* Top slots shown by stack dumps, poison runs are collapsed (see dump_stack()) */
+#ifndef DUMP_WINDOW
+#define DUMP_WINDOW 64
+#endif /* DUMP_WINDOW */
+
+/* Default hash kernel of a new stack (see hash_kind_t) */
+#ifndef HASH_KIND
+#define HASH_KIND HASH_MURMUR
+#endif /* HASH_KIND */
 
 #endif /* CONFIG_H_ */
@@ -0,0 +1,126 @@
+/**
+ * @file
+ * @brief  Concurrent stack
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * It is a lock-free Treiber stack with an elimination array.
+ * It keeps stack_t error codes API, but any number of threads
+ * can push and pop at the same time.
+ *
+ * Nodes are allocated from blocks which are never freed until the stack
+ * is destroyed, so a node can be read after it is popped by other thread.
+ * Nodes are referenced by 32-bit indices, list heads are tagged with
+ * 32-bit counters against ABA problem.
+ */
+
+#ifndef CSTACK_H_
+#define CSTACK_H_
+
+#include <atomic>
+#include "stack.h"
+
+const size_t CBLOCK_NODES = 1024; /**< Nodes in the first block, next ones are twice larger */
+const size_t CBLOCKS      = 22;   /**< Max number of blocks                               */
+const size_t ELIM_SLOTS   = 16;   /**< Elimination array size                             */
+const size_t ELIM_SPINS   = 64;   /**< Spins of a pusher waiting for elimination          */
+
+/**
+ * @brief Concurrent stack node
+ */
+struct cnode_t {
+        item_t                item = 0;   /**< Node item                 */
+        std::atomic<uint32_t> next {0};   /**< Next node index + 1 or 0  */
+};
+
+/**
+ * @brief Concurrent stack structure
+ *
+ * Hash protection is not provided: shared digest would serialize
+ * all threads. Blocks of nodes are protected by canaries.
+ */
+struct cstack_t {
+
+#ifdef CANARY_PROTECT
+        canary_t left_canary = 0;                         /**< Canary protection from left */
+#endif /* CANARY_PROTECT */
+
+        alignas(CACHE_LINE) std::atomic<uint64_t> head {0};      /**< Tagged top node    */
+        alignas(CACHE_LINE) std::atomic<uint64_t> free_head {0}; /**< Tagged free node   */
+        alignas(CACHE_LINE) std::atomic<uint32_t> n_nodes {0};   /**< Nodes ever taken   */
+        std::atomic<size_t> size {0};                            /**< Approximate size   */
+
+        std::atomic<cnode_t *> blocks[CBLOCKS] = {};             /**< Node blocks        */
+
+        alignas(CACHE_LINE) std::atomic<uint64_t> elimination[ELIM_SLOTS] = {};
+
+#ifdef CANARY_PROTECT
+        canary_t right_canary = 0;                        /**< Canary protection from right */
+#endif /* CANARY_PROTECT */
+
+};
+
+/**
+ * @brief Concurrent stack constructor
+ *
+ * @param[out] stk Stack to create
+ *
+ * It is not thread-safe. Stack must be created before it is shared.
+ */
+cstack_t *const construct_cstack(cstack_t *const stk);
+
+/**
+ * @brief Concurrent stack destructor
+ *
+ * @param stk Stack to destroy
+ *
+ * It is not thread-safe. No other thread may use the stack.
+ */
+cstack_t *const destruct_cstack(cstack_t *const stk);
+
+/**
+ * @brief Pushes item to concurrent stack
+ *
+ * @param stk        Stack push to
+ * @param item       Item to push
+ * @param[out] error Error proceeded
+ *
+ * It is lock-free. If the stack head is contended, pusher offers
+ * the item to poppers through the elimination array.
+ * In case of an error, nothing happens to the stack.
+ */
+void push_cstack(cstack_t *const stk, const item_t item, int *const error = nullptr);
+
+/**
+ * @brief Pops item from concurrent stack
+ *
+ * @param stk        Stack pop from
+ * @param[out] error Error proceeded
+ *
+ * It is lock-free. STK_EMPTY_POP is returned if stack is empty
+ * at the moment of the call.
+ *
+ * @return 'Popped' item
+ */
+item_t pop_cstack(cstack_t *const stk, int *const error = nullptr);
+
+/**
+ * @brief Verifies concurrent stack
+ *
+ * @param stk Stack to verify
+ *
+ * It checks stack and blocks canaries. It can be called concurrently.
+ *
+ * @return bit mask composed of invariant_err_t elemets
+ */
+int verify_cstack(cstack_t *const stk);
+
+/**
+ * @brief Dumps concurrent stack
+ *
+ * @param stk Stack to dump
+ */
+void dump_cstack(cstack_t *const stk);
+
+#endif /* CSTACK_H_ */
+
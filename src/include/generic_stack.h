@@ -0,0 +1,970 @@
+/**
+ * @file
+ * @brief  Generic stack implementation
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * It is a header-only version of stack_t for any item type.
+ * Protection and logging are chosen at compile time by template parameters,
+ * so unprotected stack is a plain vector-like stack without any checks
+ * and stacks with different protection can be used in the same program.
+ */
+
+#ifndef GENERIC_STACK_H_
+#define GENERIC_STACK_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <new>
+#include <memory>
+#include <utility>
+#include <type_traits>
+#include "stack.h"
+#include "hash.h"
+#include "log.h"
+
+/**
+ * @brief Protection flags
+ *
+ * Flags are combined by '|', e.g. stack<int, PROTECT_CANARY | PROTECT_HASH>.
+ * Unused slots are filled with FILL_BYTE by stack_params_t::poison mode.
+ */
+enum protect_flag_t {
+        PROTECT_NONE   = 0,      /**< Plain vector-like stack without any checks     */
+        PROTECT_CANARY = 1 << 0, /**< Canary protection of stack and its data        */
+        PROTECT_HASH   = 1 << 1, /**< Hash protection (trivially copyable items only) */
+        PROTECT_FULL   = PROTECT_CANARY | PROTECT_HASH,
+};
+
+/**
+ * @brief Log policies
+ *
+ * Log policy doesn't depend on NOLOG, so stacks with and without
+ * logging can live in the same program. default_log follows NOLOG.
+ */
+struct with_log { static const bool enabled = true;  };
+struct no_log   { static const bool enabled = false; };
+
+#ifdef NOLOG
+typedef no_log   default_log;
+#else
+typedef with_log default_log;
+#endif /* NOLOG */
+
+/* Log macros of Log policy, they are undefined at the end of the file */
+#define stack_log_err(fmt, ...)                                                                 \
+        do {                                                                                    \
+                if (Log::enabled)                                                               \
+                        log_write(LOG_ERROR, __FILE__, __func__, __LINE__, fmt, ##__VA_ARGS__); \
+        } while (0)
+
+#define stack_log_buf(fmt, ...)                                                                 \
+        do {                                                                                    \
+                if (Log::enabled)                                                               \
+                        log_write_raw(LOG_ERROR, fmt, ##__VA_ARGS__);                           \
+        } while (0)
+
+/**
+ * @brief Allocator based on malloc()
+ *
+ * Unlike std::allocator it can reallocate memory in place.
+ * It returns nullptr if there is no memory instead of throwing.
+ */
+template <typename T>
+struct malloc_allocator {
+        typedef T value_type;
+
+        malloc_allocator() = default;
+
+        template <typename U>
+        malloc_allocator(const malloc_allocator<U> &) {}
+
+        T *allocate(size_t n)                        { return (T *)malloc(n * sizeof(T)); }
+        void deallocate(T *ptr, size_t)              { free(ptr); }
+        T *reallocate(T *ptr, size_t, size_t n)      { return (T *)realloc(ptr, n * sizeof(T)); }
+
+        template <typename U>
+        bool operator==(const malloc_allocator<U> &) const { return true;  }
+        template <typename U>
+        bool operator!=(const malloc_allocator<U> &) const { return false; }
+};
+
+/**
+ * @brief Checks if allocator can reallocate memory
+ */
+template <typename A, typename = void>
+struct has_reallocate : std::false_type {};
+
+template <typename A>
+struct has_reallocate<A, decltype((void)std::declval<A &>().reallocate(nullptr, 0, 0))>
+        : std::true_type {};
+
+/**
+ * @brief Stack hash fields
+ */
+template <bool Hash>
+struct generic_stack_hash {};
+
+template <>
+struct generic_stack_hash<true> {
+        hash_t data_hash      = 0;       /**< Items digest (XOR of slot hashes) */
+        hash_t hash           = 0;       /**< Hash protection */
+};
+
+/**
+ * @brief Verification policy and shrink state fields
+ *
+ * Unprotected stack has nothing to verify and is never shrunk by pops,
+ * so they are left out. Level is size_t, so hashed fields have no padding.
+ */
+template <bool Protect>
+struct generic_stack_verify {};
+
+template <>
+struct generic_stack_verify<true> {
+        size_t verify         = VERIFY_LEVEL;  /**< Verification level (verify_level_t) */
+        size_t verify_period  = VERIFY_PERIOD;
+        size_t ops            = 0;             /**< Operations since construction */
+        size_t low_pops       = 0;             /**< Pops below shrink threshold */
+};
+
+/**
+ * @brief Parameters of unprotected stack
+ *
+ * It keeps growth parameters and allocator only. Policies the unprotected
+ * stack doesn't have are constants, so their checks are compiled out.
+ */
+struct generic_plain_params {
+        size_t init_cap            = INIT_CAP;
+        size_t factor              = CAP_FACTOR;
+        size_t max_step            = 0;
+        const stack_alloc_t *alloc = nullptr;
+
+        static const int    shrink       = SHRINK_NEVER;
+        static const size_t shrink_delay = 0;
+        static const int    poison       = POISON_NONE;
+        static const int    hash_kind    = HASH_MURMUR;
+        static const bool   inline_items = false;
+
+        generic_plain_params() = default;
+        generic_plain_params(const stack_params_t &params)
+                : init_cap(params.init_cap), factor(params.factor),
+                  max_step(params.max_step), alloc(params.alloc) {}
+};
+
+/**
+ * @brief Items offset from the raw block start (room for the left canary)
+ */
+template <typename T, bool Canary>
+struct generic_items_offset
+        : std::integral_constant<size_t, (!Canary ? 0 :
+                                          alignof(T) > sizeof(canary_t) ? alignof(T) : sizeof(canary_t))> {};
+
+/**
+ * @brief Inline items block
+ *
+ * Unprotected stack keeps items on the heap only, so it has no inline block.
+ * It is a base of the stack, so the empty one takes no space.
+ */
+template <typename T, bool Canary, bool Inline>
+struct generic_stack_inline {
+        const char *inline_raw() const { return nullptr; }
+        char *inline_raw()             { return nullptr; }
+};
+
+template <typename T, bool Canary>
+struct generic_stack_inline<T, Canary, true> {
+        alignas(max_align_t) char inline_raw_[generic_items_offset<T, Canary>::value +
+                                              INLINE_CAP * sizeof(T) + 2 * sizeof(canary_t)];
+
+        const char *inline_raw() const { return inline_raw_; }
+        char *inline_raw()             { return inline_raw_; }
+};
+
+/**
+ * @brief Stack fields
+ *
+ * Fields are hashed as is, so they must not have padding.
+ * Like stack_t header, they cover verification policy and shrink state.
+ */
+template <typename T, bool Canary, bool Hash>
+struct generic_stack_fields : generic_stack_hash<Hash>, generic_stack_verify<Hash> {
+        T     *items          = nullptr; /**< Stack data     */
+        size_t capacity       = 0;       /**< Stack capacity */
+        size_t size           = 0;       /**< Stack size     */
+        size_t reserved       = 0;       /**< Reserved capacity */
+
+        generic_stack_hash<Hash>   &hashes() { return *this; }
+        generic_stack_verify<Hash> &policy() { return *this; }
+
+        const generic_stack_verify<Hash> &policy() const { return *this; }
+};
+
+template <typename T, bool Hash>
+struct generic_stack_fields<T, true, Hash> {
+        canary_t left_canary  = CANARY;  /**< Canary protection from left */
+
+        T     *items          = nullptr; /**< Stack data     */
+        size_t capacity       = 0;       /**< Stack capacity */
+        size_t size           = 0;       /**< Stack size     */
+        size_t reserved       = 0;       /**< Reserved capacity */
+
+        generic_stack_hash<Hash>   hash_fields   = {};
+        generic_stack_verify<true> policy_fields = {};
+
+        canary_t right_canary = CANARY;  /**< Canary protection from right */
+
+        generic_stack_hash<Hash>   &hashes() { return hash_fields; }
+        generic_stack_verify<true> &policy() { return policy_fields; }
+
+        const generic_stack_verify<true> &policy() const { return policy_fields; }
+};
+
+/**
+ * @brief Generic stack
+ *
+ * @tparam T       Item type
+ * @tparam Protect Protection flags (protect_flag_t)
+ * @tparam Log     Log policy
+ * @tparam Alloc   Allocator
+ *
+ * It keeps stack_t semantics: data canaries are placed around items,
+ * items digest covers the whole capacity and unused slots are poisoned
+ * by stack_params_t::poison mode. Up to INLINE_CAP items are kept inside
+ * the stack if stack_params_t::inline_items is set. stack_params_t::alloc
+ * is used instead of Alloc if it is set.
+ * Memory is reallocated in place if items are trivially copyable and
+ * allocator can do it. Otherwise items are moved to a new buffer.
+ *
+ * Unprotected stack is never shrunk by pops (there is no shrink bookkeeping),
+ * shrink policy is ignored and trim() returns unused memory. It keeps growth 
+ * parameters and allocator only (generic_plain_params): it has no inline block 
+ * and never poisons.
+ *
+ * Like stack_t it must not be copied.
+ */
+template <typename T, unsigned Protect = PROTECT_FULL, typename Log = default_log,
+          typename Alloc = malloc_allocator<T>>
+class stack : private std::allocator_traits<Alloc>::template rebind_alloc<char>,
+              private generic_stack_inline<T, (Protect & PROTECT_CANARY) != 0, Protect != PROTECT_NONE> {
+public:
+        static const bool CANARY_ON  = (Protect & PROTECT_CANARY) != 0;
+        static const bool HASH_ON    = (Protect & PROTECT_HASH)   != 0;
+        static const bool PROTECT_ON = CANARY_ON || HASH_ON;
+
+        static_assert((Protect & ~PROTECT_FULL) == 0, "Unknown protection flags");
+
+        static_assert(!HASH_ON || std::is_trivially_copyable<T>::value,
+                      "Hash protection requires trivially copyable items");
+        static_assert(alignof(T) <= alignof(max_align_t), "Over-aligned items are not supported");
+
+        /**
+         * @brief Stack constructor
+         *
+         * @param params     Stack parameters
+         * @param[out] error Error proceeded
+         *
+         * Memory is allocated on the first push.
+         * Default parameters are used if params are invalid.
+         */
+        explicit stack(const stack_params_t &params = stack_params_t(), int *const error = nullptr)
+                : byte_alloc(), fields_(), params_(params)
+        {
+                if (params.init_cap < 1 || params.factor < 2 || params.factor > MAX_FACTOR ||
+                    params.shrink < SHRINK_EAGER || params.shrink > SHRINK_NEVER ||
+                    params.poison < POISON_EAGER || params.poison > POISON_NONE ||
+                    params.hash_kind < HASH_MURMUR || params.hash_kind > HASH_CRC32C ||
+                    (params.alloc && (!params.alloc->alloc || !params.alloc->realloc ||
+                                      !params.alloc->free))) {
+                        stack_log_err("Invalid stack parameters: init_cap = %zu, factor = %zu, "
+                                      "shrink = %d, poison = %d, hash = %d\n", params.init_cap,
+                                      params.factor, params.shrink, params.poison, params.hash_kind);
+                        set_error(error, STK_INVALID);
+                        params_ = stack_params_t();
+                }
+
+
+                store_hash(hash_tag());
+        }
+
+        stack(const stack &)            = delete;
+        stack &operator=(const stack &) = delete;
+
+        /**
+         * @brief Stack destructor
+         *
+         * Items are destroyed from the top.
+         */
+        ~stack()
+        {
+                while (fields_.size)
+                        fields_.items[--fields_.size].~T();
+
+                if (fields_.items)
+                        free_raw(raw_items(fields_.items), raw_bytes(fields_.capacity));
+        }
+
+        /**
+         * @brief Pushes item to stack
+         *
+         * @param item       Item to push
+         * @param[out] error Error proceeded
+         *
+         * In case of an error, nothing happens to the stack.
+         */
+        void push(const T &item, int *const error = nullptr) { emplace(error, item); }
+        void push(T &&item, int *const error = nullptr)      { emplace(error, std::move(item)); }
+
+        /**
+         * @brief Constructs item on the top of stack
+         *
+         * @param[out] error Error proceeded
+         * @param args       Item constructor arguments
+         *
+         * In case of an error, nothing happens to the stack.
+         */
+        template <typename... Args>
+        void emplace(int *const error, Args &&... args)
+        {
+                int err = check();
+                if (err) {
+                        stack_log_err("Can't push to invalid stack\n");
+                        return fail(error, err);
+                }
+
+                if (fields_.size == fields_.capacity) {
+                        err = realloc_items(grown_capacity());
+                        if (err) {
+                                stack_log_err("Invalid stack expanding\n");
+                                return fail(error, err);
+                        }
+                }
+
+                size_t index = fields_.size;
+                hash_t old_slot = slot_digest(index);
+
+                new (fields_.items + index) T(std::forward<Args>(args)...);
+                digest_xor(old_slot ^ slot_digest(index), hash_tag());
+
+                fields_.size++;
+                count_op(protect_tag());
+
+                store_hash(hash_tag());
+
+                err = check();
+                if (err)
+                        return fail(error, err);
+        }
+
+        /**
+         * @brief Pops item from stack
+         *
+         * @param[out] error Error proceeded
+         *
+         * In case of an error, nothing happens to the stack.
+         *
+         * @return 'Popped' item or default-constructed one in case of an error
+         */
+        T pop(int *const error = nullptr)
+        {
+                int err = check();
+                if (err) {
+                        stack_log_err("Can't pop item from invalid stack\n");
+                        fail(error, err);
+                        return T();
+                }
+
+                if (fields_.size == 0) {
+                        stack_log_err("Can't pop from an empty stack\n");
+                        fail(error, STK_EMPTY_POP);
+                        return T();
+                }
+
+                T item(std::move(fields_.items[fields_.size - 1]));
+
+                size_t index = --fields_.size;
+                hash_t old_slot = slot_digest(index);
+
+                fields_.items[index].~T();
+                if (params_.poison != POISON_NONE)
+                        memset((void *)(fields_.items + index), FILL_BYTE, sizeof(T));
+
+                digest_xor(old_slot ^ slot_digest(index), hash_tag());
+                count_op(protect_tag());
+
+                shrink_popped(protect_tag());
+                store_hash(hash_tag());
+
+                err = check();
+                if (err)
+                        fail(error, err);
+
+                return item;
+        }
+
+        /**
+         * @brief Gets top item
+         *
+         * @param[out] error Error proceeded
+         *
+         * @return Pointer to the top item or nullptr in case of an error.
+         */
+        T *top(int *const error = nullptr)
+        {
+                int err = check();
+                if (!err && fields_.size == 0)
+                        err = STK_EMPTY_POP;
+
+                if (err) {
+                        fail(error, err);
+                        return nullptr;
+                }
+
+                return fields_.items + fields_.size - 1;
+        }
+
+        /**
+         * @brief Reserves stack memory
+         *
+         * @param capacity   Capacity to reserve
+         * @param[out] error Error proceeded
+         *
+         * Stack is never shrunk below reserved capacity.
+         */
+        void reserve(const size_t capacity, int *const error = nullptr)
+        {
+                int err = check();
+                if (!err && capacity > fields_.capacity)
+                        err = realloc_items(capacity);
+
+                if (err)
+                        return fail(error, err);
+
+                fields_.reserved = capacity;
+                store_hash(hash_tag());
+        }
+
+        /**
+         * @brief Returns unused stack memory
+         *
+         * @param[out] error Error proceeded
+         */
+        void trim(int *const error = nullptr)
+        {
+                int err = check();
+                if (err)
+                        return fail(error, err);
+
+                size_t capacity = shrunk_capacity(fields_.size);
+                if (capacity < fields_.capacity)
+                        err = realloc_items(capacity);
+
+                if (err)
+                        return fail(error, err);
+
+                reset_low_pops(protect_tag());
+                store_hash(hash_tag());
+        }
+
+        /**
+         * @brief Sets stack verification policy
+         *
+         * @param level      Verification level (verify_level_t)
+         * @param period     Full verification period for VERIFY_SAMPLED level
+         * @param[out] error Error proceeded
+         *
+         * There is no chunk tree, so VERIFY_DIRTY is the same as VERIFY_FULL.
+         * Unprotected stack is never verified, so policy is ignored.
+         */
+        void set_verify_policy(const int level, const size_t period = VERIFY_PERIOD,
+                               int *const error = nullptr)
+        {
+                if (level < VERIFY_NONE || level > VERIFY_FULL || period == 0)
+                        return fail(error, STK_INVALID);
+
+                int err = check();
+                if (err)
+                        return fail(error, err);
+
+                store_policy(level, period, protect_tag());
+                store_hash(hash_tag());
+        }
+
+        /**
+         * @brief Fully verifies stack
+         *
+         * @return bit mask composed of invariant_err_t elemets
+         */
+        int verify()
+        {
+                int vrf = verify_struct();
+
+                if (HASH_ON && !hash_ok(true, hash_tag()))
+                        vrf |= INVALID_HASH;
+
+                return vrf;
+        }
+
+        /**
+         * @brief Dumps stack header to the log
+         */
+        void dump()
+        {
+                int vrf = verify();
+
+                stack_log_buf("----------------------------------------------\n");
+                stack_log_buf(" Generic stack: %s\n", vrf ? "error" : "ok");
+                stack_log_buf(" Verification:  %x\n", (unsigned)vrf);
+                stack_log_buf(" Item size: %15zu\n", sizeof(T));
+                stack_log_buf(" Size:      %15zu\n", fields_.size);
+                stack_log_buf(" Capacity:  %15zu\n", fields_.capacity);
+                stack_log_buf(" Address start: %p\n", (void *)fields_.items);
+                stack_log_buf("----------------------------------------------\n\n\n");
+                if (Log::enabled)
+                        log_flush();
+        }
+
+        size_t size()     const { return fields_.size; }
+        size_t capacity() const { return fields_.capacity; }
+        bool   empty()    const { return fields_.size == 0; }
+
+private:
+        typedef typename std::allocator_traits<Alloc>::template rebind_alloc<char> byte_alloc;
+
+        typedef std::integral_constant<bool, PROTECT_ON> protect_tag;
+        typedef std::integral_constant<bool, HASH_ON>    hash_tag;
+        typedef std::integral_constant<bool, CANARY_ON>  canary_tag;
+        typedef typename has_reallocate<byte_alloc>::type realloc_tag;
+
+        static const size_t ITEMS_OFFSET = generic_items_offset<T, CANARY_ON>::value;
+        static const size_t CAP_LIMIT    = ~(SIZE_MAX >> 1) / sizeof(T);
+
+        typedef typename std::conditional<PROTECT_ON, stack_params_t, generic_plain_params>::type params_t;
+
+        generic_stack_fields<T, CANARY_ON, HASH_ON> fields_;
+        params_t params_;
+
+        static void set_error(int *const error, int value)
+        {
+                if (error)
+                        *error = value;
+        }
+
+        void fail(int *const error, int err)
+        {
+                set_error(error, err);
+                if (!Log::enabled)
+                        return;
+
+                stack_log_err("Stack dump\n");
+                dump();
+        }
+
+        static constexpr size_t items_bytes(const size_t capacity)
+        {
+                size_t bytes = capacity * sizeof(T);
+                if (CANARY_ON)
+                        bytes += (sizeof(canary_t) - bytes % sizeof(canary_t)) % sizeof(canary_t);
+
+                return bytes;
+        }
+
+        static constexpr size_t raw_bytes(const size_t capacity)
+        {
+                return ITEMS_OFFSET + items_bytes(capacity) + (CANARY_ON ? sizeof(canary_t) : 0);
+        }
+
+        static char *raw_items(T *const items)
+        {
+                return items ? (char *)items - ITEMS_OFFSET : nullptr;
+        }
+
+        static canary_t *left_canary(T *const items)
+        {
+                return (canary_t *)((char *)items - sizeof(canary_t));
+        }
+
+        static canary_t *right_canary(T *const items, const size_t capacity)
+        {
+                return (canary_t *)((char *)items + items_bytes(capacity));
+        }
+
+        /* Hash protection */
+
+        hash_t slot_digest(const size_t index) const
+        {
+                if (!HASH_ON)
+                        return 0;
+
+                return slot_hash(fields_.items + index, sizeof(T), index, SEED, params_.hash_kind);
+        }
+
+        hash_t slots_digest(T *const items, const size_t from, const size_t to) const
+        {
+                if (!HASH_ON)
+                        return 0;
+
+                return slots_hash(items, sizeof(T), from, to, SEED, params_.hash_kind);
+        }
+
+        void digest_xor(hash_t, std::false_type) {}
+        void digest_xor(hash_t delta, std::true_type)
+        {
+                fields_.hashes().data_hash ^= delta;
+        }
+
+        hash_t hash_header()
+        {
+                generic_stack_hash<HASH_ON> &hashes = fields_.hashes();
+
+                hash_t hash = hashes.hash;
+                hashes.hash = 0;
+
+                hash_t stk_hash = block_hash(&fields_, sizeof(fields_), SEED, params_.hash_kind);
+
+                hashes.hash = hash;
+                return stk_hash;
+        }
+
+        void store_hash(std::false_type) {}
+        void store_hash(std::true_type)
+        {
+                fields_.hashes().hash = hash_header();
+        }
+
+        bool hash_ok(bool, std::false_type) { return true; }
+        bool hash_ok(bool full, std::true_type)
+        {
+                generic_stack_hash<HASH_ON> &hashes = fields_.hashes();
+
+                if (!full)
+                        return hashes.hash == hash_header();
+
+                hash_t data_hash = hashes.data_hash;
+                hashes.data_hash = slots_digest(fields_.items, 0, fields_.capacity);
+
+                hash_t stk_hash = hash_header();
+
+                hashes.data_hash = data_hash;
+                return hashes.hash == stk_hash;
+        }
+
+        /* Canary protection */
+
+        void store_canaries(T *, const size_t, std::false_type) {}
+        void store_canaries(T *const items, const size_t capacity, std::true_type)
+        {
+                *left_canary (items)           = CANARY ^ (size_t)items;
+                *right_canary(items, capacity) = CANARY ^ (size_t)items;
+        }
+
+        int canaries_ok(std::false_type) { return 0; }
+        int canaries_ok(std::true_type)
+        {
+                int vrf = 0;
+
+                if (fields_.items) {
+                        const canary_t cnry = CANARY ^ (size_t)fields_.items;
+
+                        if (*left_canary(fields_.items) != cnry)
+                                vrf |= INVALID_DATA_LCNRY;
+                        if (*right_canary(fields_.items, fields_.capacity) != cnry)
+                                vrf |= INVALID_DATA_RCNRY;
+                }
+
+                if (fields_.left_canary  != CANARY)
+                        vrf |= INVALID_STK_LCNRY;
+                if (fields_.right_canary != CANARY)
+                        vrf |= INVALID_STK_RCNRY;
+
+                return vrf;
+        }
+
+        /* Verification */
+
+        int verify_struct()
+        {
+                int vrf = 0;
+
+                if (fields_.capacity > CAP_LIMIT)
+                        vrf |= INVALID_CAPACITY;
+                if (fields_.size > fields_.capacity)
+                        vrf |= INVALID_SIZE;
+                if (!fields_.items != !fields_.capacity)
+                        vrf |= INVALID_ITEMS;
+
+                vrf |= canaries_ok(canary_tag());
+
+                if (HASH_ON && !hash_ok(false, hash_tag()))
+                        vrf |= INVALID_HASH;
+
+                return vrf;
+        }
+
+        void store_policy(int, size_t, std::false_type) {}
+        void store_policy(const int level, const size_t period, std::true_type)
+        {
+                fields_.policy().verify        = (size_t)level;
+                fields_.policy().verify_period = period;
+        }
+
+        void count_op(std::false_type) {}
+        void count_op(std::true_type)
+        {
+                fields_.policy().ops++;
+        }
+
+        int check() { return check(protect_tag()); }
+
+        int check(std::false_type) { return 0; }
+        int check(std::true_type)
+        {
+                const generic_stack_verify<true> &policy = fields_.policy();
+
+                switch (policy.verify) {
+                case VERIFY_NONE:
+                        return 0;
+                case VERIFY_STRUCT:
+                        return verify_struct();
+                case VERIFY_SAMPLED:
+                        if (policy.verify_period && policy.ops % policy.verify_period)
+                                return verify_struct();
+                        return verify();
+                case VERIFY_DIRTY:
+                case VERIFY_FULL:
+                default:
+                        return verify();
+                }
+        }
+
+        /* Memory */
+
+        size_t min_capacity() const
+        {
+                return fields_.reserved > params_.init_cap ? fields_.reserved : params_.init_cap;
+        }
+
+        size_t grown_capacity() const
+        {
+                const size_t capacity = fields_.capacity;
+                if (capacity == 0)
+                        return params_.init_cap;
+
+                if (capacity > CAP_LIMIT / params_.factor)
+                        return CAP_LIMIT;
+
+                size_t step = capacity * (params_.factor - 1);
+                if (params_.max_step && step > params_.max_step)
+                        step = params_.max_step;
+
+                return capacity + step;
+        }
+
+        size_t shrunk_capacity(const size_t size) const
+        {
+                const size_t factor = params_.factor;
+
+                size_t cap = fields_.capacity;
+                while (cap / (factor * factor) + 1 >= size + 1 && cap > min_capacity()) {
+                        cap /= factor;
+                        if (cap < min_capacity())
+                                cap = min_capacity();
+                }
+
+                return cap;
+        }
+
+        size_t pop_capacity() const
+        {
+                switch (params_.shrink) {
+                case SHRINK_NEVER:
+                        return fields_.capacity;
+                case SHRINK_LAZY:
+                        if (fields_.policy().low_pops + 1 < params_.shrink_delay)
+                                return fields_.capacity;
+                        return shrunk_capacity(fields_.size);
+                case SHRINK_EAGER:
+                default:
+                        return shrunk_capacity(fields_.size);
+                }
+        }
+
+        void count_low_pops()
+        {
+                if (shrunk_capacity(fields_.size) < fields_.capacity)
+                        fields_.policy().low_pops++;
+                else
+                        fields_.policy().low_pops = 0;
+        }
+
+        void reset_low_pops(std::false_type) {}
+        void reset_low_pops(std::true_type)
+        {
+                fields_.policy().low_pops = 0;
+        }
+
+        /**
+         * @brief Shrinks stack after a pop
+         *
+         * Unprotected stack has no shrink bookkeeping.
+         */
+        void shrink_popped(std::false_type) {}
+        void shrink_popped(std::true_type)
+        {
+                size_t capacity = pop_capacity();
+                if (capacity < fields_.capacity && realloc_items(capacity))
+                        stack_log_err("Invalid stack shrinking\n");
+
+                count_low_pops();
+        }
+
+        bool fits_inline(const size_t capacity) const
+        {
+                return params_.inline_items && capacity <= INLINE_CAP;
+        }
+
+        bool is_inline() const
+        {
+                return fields_.items && raw_items(fields_.items) == this->inline_raw();
+        }
+
+        char *alloc_raw(const size_t bytes)
+        {
+                if (params_.alloc)
+                        return (char *)params_.alloc->alloc(params_.alloc->ctx, bytes);
+
+                return byte_alloc::allocate(bytes);
+        }
+
+        void free_raw(char *const raw, const size_t bytes)
+        {
+                if (raw == this->inline_raw())
+                        return;
+
+                if (params_.alloc)
+                        params_.alloc->free(params_.alloc->ctx, raw, bytes);
+                else
+                        byte_alloc::deallocate(raw, bytes);
+        }
+
+        char *reallocate_raw(char *const raw, const size_t old_bytes, const size_t bytes)
+        {
+                if (params_.alloc)
+                        return (char *)params_.alloc->realloc(params_.alloc->ctx, raw, old_bytes, bytes);
+
+                return reallocate_raw(raw, old_bytes, bytes, realloc_tag());
+        }
+
+        char *reallocate_raw(char *const raw, const size_t old_bytes, const size_t bytes, std::true_type)
+        {
+                return byte_alloc::reallocate(raw, old_bytes, bytes);
+        }
+
+        char *reallocate_raw(char *const raw, const size_t old_bytes, const size_t bytes, std::false_type)
+        {
+                char *moved = byte_alloc::allocate(bytes);
+                if (!moved)
+                        return nullptr;
+
+                memcpy(moved, raw, old_bytes < bytes ? old_bytes : bytes);
+                byte_alloc::deallocate(raw, old_bytes);
+
+                return moved;
+        }
+
+        /**
+         * @brief Resizes items buffer
+         *
+         * Heap buffer of trivially copyable items is reallocated in place
+         * (if allocator can do it). Otherwise items are moved to a new buffer:
+         * heap or the inline one.
+         */
+        T *resize_items(const size_t capacity)
+        {
+                const size_t old_cap   = fields_.capacity;
+                const bool   to_inline = fits_inline(capacity);
+
+                if (to_inline && is_inline())
+                        return fields_.items;
+
+                if (!to_inline && fields_.items && !is_inline() && std::is_trivially_copyable<T>::value) {
+                        char *raw = reallocate_raw(raw_items(fields_.items), raw_bytes(old_cap),
+                                                   raw_bytes(capacity));
+                        return raw ? (T *)(raw + ITEMS_OFFSET) : nullptr;
+                }
+
+                char *raw = to_inline ? this->inline_raw() : alloc_raw(raw_bytes(capacity));
+                if (!raw)
+                        return nullptr;
+
+                T *items = (T *)(raw + ITEMS_OFFSET);
+                if (!fields_.items)
+                        return items;
+
+                size_t kept = capacity < old_cap ? capacity : old_cap;
+
+                if (std::is_trivially_copyable<T>::value) {
+                        memcpy((void *)items, (void *)fields_.items, kept * sizeof(T));
+                } else {
+                        for (size_t i = 0; i < fields_.size; i++) {
+                                new (items + i) T(std::move(fields_.items[i]));
+                                fields_.items[i].~T();
+                        }
+
+                        if (params_.poison != POISON_NONE)
+                                memset((void *)(items + fields_.size), FILL_BYTE,
+                                       (kept - fields_.size) * sizeof(T));
+                }
+
+                free_raw(raw_items(fields_.items), raw_bytes(old_cap));
+                return items;
+        }
+
+        /**
+         * @brief Reallocates stack memory
+         *
+         * @param capacity Stack's new capacity
+         *
+         * Canaries are repositioned, added slots are poisoned (eager mode) and
+         * items digest is corrected. In case of an error, nothing
+         * happens to the stack.
+         *
+         * @return 0 or STK_BAD_ALLOC
+         */
+        int realloc_items(const size_t capacity)
+        {
+                assert(capacity >= fields_.size);
+                const size_t old_cap = fields_.capacity;
+
+                hash_t removed = 0;
+                if (capacity < old_cap)
+                        removed = slots_digest(fields_.items, capacity, old_cap);
+
+                T *items = resize_items(capacity);
+                if (!items)
+                        return STK_BAD_ALLOC;
+
+                if (params_.poison == POISON_EAGER && capacity > old_cap)
+                        memset((void *)(items + old_cap), FILL_BYTE, (capacity - old_cap) * sizeof(T));
+
+                store_canaries(items, capacity, canary_tag());
+
+                if (capacity > old_cap)
+                        digest_xor(slots_digest(items, old_cap, capacity), hash_tag());
+                else
+                        digest_xor(removed, hash_tag());
+
+                fields_.items    = items;
+                fields_.capacity = capacity;
+
+                return 0;
+        }
+};
+
+#undef stack_log_err
+#undef stack_log_buf
+
+#endif /* GENERIC_STACK_H_ */
+
@@ -8,6 +8,20 @@
 #ifndef HASH_H_
 #define HASH_H_
 
+#include <stddef.h>
+
+/**
+ * @brief Hash kernels
+ *
+ * Kernels give different values, so digest must be recalculated
+ * from scratch if kernel is changed.
+ */
+enum hash_kind_t {
+        HASH_MURMUR    = 0, /**< Murmur2, compatible with old digests          */
+        HASH_MULTILANE = 1, /**< 32-bit multiply-xorshift lanes (AVX2 clones)  */
+        HASH_CRC32C    = 2, /**< CRC32C (SSE4.2 or ARMv8 CRC) with final mixing */
+};
+
 /**
  * @brief Murmur2 algorithm hash function.
  *
@@ -29,5 +43,56 @@
  */
 unsigned int murmur_hash(const void *key, int length, unsigned int seed);
 
+/**
+ * @brief Hash of a memory block.
+ *
+ * @param key     Hash key pointer
+ * @param length  Key length
+ * @param seed    Random seed
+ * @param kind    Hash kernel (hash_kind_t)
+ *
+ * HASH_MURMUR is murmur_hash(). HASH_MULTILANE is xxHash-style: 16-byte
+ * stripes are processed by 4 independent accumulators.
+ * HASH_CRC32C uses CPU instructions if they are available
+ * (checked at runtime) and a table otherwise, values are the same.
+ */
+unsigned int block_hash(const void *key, int length, unsigned int seed, int kind = HASH_MURMUR);
+
+/**
+ * @brief Position-keyed hash of a single slot.
+ *
+ * @param item    Slot pointer
+ * @param length  Slot length
+ * @param index   Slot position in the buffer
+ * @param seed    Random seed
+ * @param kind    Hash kernel (hash_kind_t)
+ *
+ * By default it is murmur_hash() of slot bytes seeded with a mix of seed and position,
+ * so equal items at different positions give different values.
+ * Buffer digest is a XOR of all slot hashes. That is why it
+ * can be updated incrementally: to change one slot XOR out its old
+ * hash and XOR in the new one.
+ */
+unsigned int slot_hash(const void *item, int length, size_t index, unsigned int seed,
+                       int kind = HASH_MURMUR);
+
+/**
+ * @brief Digest of a slots range.
+ *
+ * @param items   Buffer pointer
+ * @param length  Slot length
+ * @param from    First slot
+ * @param to      Slot after the last one
+ * @param seed    Random seed
+ * @param kind    Hash kernel (hash_kind_t)
+ *
+ * Slots of 4 and 8 bytes are hashed by vectorized loops with
+ * HASH_MULTILANE kernel.
+ *
+ * @return XOR of slot_hash() values over [from, to) slots.
+ */
+unsigned int slots_hash(const void *items, int length, size_t from, size_t to, unsigned int seed,
+                        int kind = HASH_MURMUR);
+
 #endif /* HASH_H_ */
 
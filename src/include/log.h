@@ -1,128 +1,95 @@
 /**
- * @file 
+ * @file
  * @brief  Log
  * @author d3phys
  * @date   08.10.2021
+ *
+ * Records are formatted on the caller's thread into a lock-free
+ * ring buffer. Background writer drains it to the log file,
+ * so there are no syscalls on the hot path.
  */
 
 #ifndef LOG_H
 #define LOG_H
 
-#include <cstdlib>
 #include <stdio.h>
-#include <time.h>
-#include <assert.h>
 #include "config.h"
 
-static const char LOG_NAME[]= "log.html";
+/**
+ * @brief Log levels
+ *
+ * Records below LOG_LEVEL (see config.h) are compiled out.
+ * Records below log_set_level() threshold are filtered at runtime.
+ */
+#define LOG_TRACE 0 /**< Every $() statement  */
+#define LOG_INFO  1 /**< Diagnostic messages  */
+#define LOG_ERROR 2 /**< Errors and dumps     */
 
-static const char HEADER[] = "<!DOCTYPE html>                      \n"
-                                "<html>                            \n"
-                                   "<head>                         \n"
-                                      "<meta charset=\"utf-8\" />  \n"
-                                      "<title>Stack log</title>    \n"
-                                   "</head>                        \n"
-                                "<body>                            \n"
-                                        "<pre><font color=\"navy\">\n"
-                                                    "┈┏━╮╭━┓┈┈┈┈┈┈┈\n"
-                                                    "┈┃┏┗┛┓┃┈┈┈┈┈┈┈\n"
-                                                    "┈╰┓▋▋┏╯┈┈┈┈┈┈┈\n"
-                                                    "╭━┻╮╲┗━━━━╮╭╮┈\n"
-                                                    "┃▎▎┃╲╲╲╲╲╲┣━╯┈\n"
-                                                    "╰━┳┻▅╯╲╲╲╲┃┈┈┈\n"
-                                                    "┈┈╰━┳┓┏┳┓┏╯┈┈┈\n"
-                                                    "┈┈┈┈┗┻┛┗┻┛┈┈┈┈\n"
-                                                    "       </font>\n";  
-                                                    
-static inline FILE *create_log();
-static FILE  *LOG = create_log();
-static void close_log();
-inline FILE *const get_log();
+static const char LOG_NAME[]       = "log.html";
+static const size_t LOG_RECORD_SIZE = 256;   /**< Record is truncated to it */
+static const size_t LOG_RING_SIZE   = 4096;  /**< Ring records (power of 2)  */
 
 /**
- * @brief  Gets local time
- * @param  fmt  time format
+ * @brief Writes log record
  *
- * Function uses local static buffer with a constant length.
- * It is designed to be called multiple times.
+ * @param level Record level
+ * @param file  Source file
+ * @param func  Source function
+ * @param line  Source line
+ * @param fmt   printf() format
  *
- * @return Local time as a formatted string.
+ * It adds chocolate prefix with time and location.
+ * If ring buffer is full trace records are dropped,
+ * others wait for the writer.
  */
-static char *const local_time(const char *const fmt) 
-{
-        assert(fmt);
-
-        static const size_t buf_size = 0xFF;
-        static char str_tm[buf_size] = {0};
-
-        static time_t t = time(nullptr);
-        if (t == -1)
-                return nullptr;
-
-        static tm *lt = localtime(&t);
-        strftime(str_tm, buf_size, fmt, lt); 
+void log_write(int level, const char *file, const char *func, int line,
+               const char *fmt, ...) __attribute__((format(printf, 5, 6)));
 
-        return str_tm;
-}
-
-static inline FILE *create_log()
-{
-        LOG = fopen(LOG_NAME, "w");
-        if (LOG == nullptr) {
-                perror("Can't open log file");
-                LOG = stderr;
-        }
-
-        int err = atexit(close_log);
-        if (err)
-                perror("Log file will not be closed");
-
-        fprintf(LOG, HEADER);
-        fflush(LOG);
-        return LOG;
-}
+/**
+ * @brief Writes raw log record
+ *
+ * @param level Record level
+ * @param fmt   printf() format
+ *
+ * The same as log_write() but without prefix.
+ */
+void log_write_raw(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
 
-inline FILE *const get_log()
-{
-        return LOG;
-}
+/**
+ * @brief Waits until all records are written to the log file
+ *
+ * It does nothing with NOLOG, there is no log file.
+ */
+void log_flush();
 
-inline void log_flush()
-{
-        fflush(LOG);
-}
+/**
+ * @brief Sets runtime log level
+ *
+ * @param level Minimal level to write
+ */
+void log_set_level(int level);
 
-static void close_log()
-{
-        fprintf(stderr, "Close log\n");
-        int err = fclose(LOG);
-        if (err == EOF)
-                perror("Can't close log file");
-}
+#define $(code) log_trace("%s\n", #code); code
 
-#define $(code) log("%s\n", #code); code
+#if defined(NOLOG) || LOG_LEVEL > LOG_TRACE
+#define log_trace(fmt, ...) (void(0))
+#else
+#define log_trace(fmt, ...) log_write(LOG_TRACE, __FILE__, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#endif
 
-#ifdef NOLOG
-#define log_buf(fmt, ...) (void(0))
+#if defined(NOLOG) || LOG_LEVEL > LOG_INFO
+#define log(fmt, ...) (void(0))
 #else
-#define log_buf(fmt, ...)                               \
-        do {                                            \
-                fprintf(get_log(), fmt, ##__VA_ARGS__); \
-        } while (0)
-#endif /* NOLOG */
+#define log(fmt, ...) log_write(LOG_INFO, __FILE__, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#endif
 
 #ifdef NOLOG
-#define log(fmt, ...) (void(0))
+#define log_err(fmt, ...) (void(0))
+#define log_buf(fmt, ...) (void(0))
 #else
-#define log(fmt, ...)                                                                         \
-        do {                                                                                  \
-                fprintf(get_log(), "<font color=\"Chocolate\"> >> [%s] At %s %s(%d): </font>" \
-                        fmt, local_time("%x %H:%M:%S"),                                       \
-                        __FILE__, __func__, __LINE__, ##__VA_ARGS__);                         \
-                fflush(get_log());                                                            \
-        } while (0)
+#define log_err(fmt, ...) log_write(LOG_ERROR, __FILE__, __func__, __LINE__, fmt, ##__VA_ARGS__)
+#define log_buf(fmt, ...) log_write_raw(LOG_ERROR, fmt, ##__VA_ARGS__)
 #endif /* NOLOG */
 
 #endif /* LOG_H */
 
-
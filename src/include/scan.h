@@ -0,0 +1,42 @@
+/**
+ * @file
+ * @brief  Fill scanning
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * Ranges are compared with the fill byte by SSE2 or AVX2 (chosen at load time)
+ * or NEON vectors, SCAN_BLOCK bytes per branch, so a scan runs at memory bandwidth.
+ * Without vectors 8-byte words are compared.
+ */
+
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <stddef.h>
+
+const size_t SCAN_BLOCK = 128; /**< Bytes compared before a branch */
+
+/**
+ * @brief Gets length of the filled range prefix
+ *
+ * @param data Range start
+ * @param len  Range length in bytes
+ * @param byte Fill byte
+ *
+ * @return Number of leading bytes equal to byte (len if the whole range is filled)
+ */
+size_t fill_span(const void *const data, const size_t len, const int byte);
+
+/**
+ * @brief Checks that range is filled with the byte
+ *
+ * @param data Range start
+ * @param len  Range length in bytes
+ * @param byte Fill byte
+ */
+static inline bool is_filled(const void *const data, const size_t len, const int byte)
+{
+        return fill_span(data, len, byte) == len;
+}
+
+#endif /* SCAN_H_ */
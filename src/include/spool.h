@@ -0,0 +1,148 @@
+/**
+ * @file
+ * @brief  Sharded work pool
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * Pool is a set of shards, one per thread. Every shard is a Chase-Lev deque:
+ * owner thread pushes and pops items at the top without locking,
+ * other threads steal items from the bottom when their own shards are empty.
+ *
+ * Order is LIFO within a shard only. Every shard is verified separately.
+ */
+
+#ifndef SPOOL_H_
+#define SPOOL_H_
+
+#include <atomic>
+#include "stack.h"
+
+const size_t SHARD_INIT_CAP = 256; /**< Initial shard capacity, must be a power of 2 */
+
+/**
+ * @brief Shard buffer
+ *
+ * Buffers are replaced by twice larger ones as shard grows.
+ * Thieves can still read the old buffer, so it is freed with the pool only.
+ */
+struct shard_buf_t {
+        size_t                capacity = 0;       /**< Power of 2            */
+        std::atomic<item_t>  *items    = nullptr; /**< Circular buffer       */
+        shard_buf_t          *prev     = nullptr; /**< Previous (old) buffer */
+};
+
+/**
+ * @brief Pool shard
+ *
+ * Indices are not wrapped: items are [bottom, top) modulo capacity.
+ */
+struct alignas(CACHE_LINE) shard_t {
+
+#ifdef CANARY_PROTECT
+        canary_t left_canary = 0;                        /**< Canary protection from left */
+#endif /* CANARY_PROTECT */
+
+        std::atomic<int64_t>       bottom {0};                  /**< Stolen from here */
+        alignas(CACHE_LINE) std::atomic<int64_t> top {0};       /**< Owner's end      */
+        std::atomic<shard_buf_t *> buf {nullptr};
+
+#ifdef CANARY_PROTECT
+        canary_t right_canary = 0;                       /**< Canary protection from right */
+#endif /* CANARY_PROTECT */
+
+};
+
+/**
+ * @brief Sharded pool structure
+ */
+struct spool_t {
+
+#ifdef CANARY_PROTECT
+        canary_t left_canary = 0;           /**< Canary protection from left */
+#endif /* CANARY_PROTECT */
+
+        shard_t *shards   = nullptr;
+        size_t   n_shards = 0;
+
+#ifdef CANARY_PROTECT
+        canary_t right_canary = 0;          /**< Canary protection from right */
+#endif /* CANARY_PROTECT */
+
+};
+
+/**
+ * @brief Sharded pool constructor
+ *
+ * @param[out] pool  Pool to create
+ * @param n_shards   Number of shards (threads)
+ * @param[out] error Error proceeded
+ *
+ * It is not thread-safe. Pool must be created before it is shared.
+ */
+spool_t *const construct_spool(spool_t *const pool, const size_t n_shards, int *const error = nullptr);
+
+/**
+ * @brief Sharded pool destructor
+ *
+ * @param pool Pool to destroy
+ *
+ * It is not thread-safe. No other thread may use the pool.
+ */
+spool_t *const destruct_spool(spool_t *const pool);
+
+/**
+ * @brief Pushes item to shard
+ *
+ * @param pool       Pool push to
+ * @param shard      Shard of the calling thread
+ * @param item       Item to push
+ * @param[out] error Error proceeded
+ *
+ * Only the shard owner can push to it.
+ * In case of an error, nothing happens to the pool.
+ */
+void push_spool(spool_t *const pool, const size_t shard, const item_t item, int *const error = nullptr);
+
+/**
+ * @brief Pops item from shard
+ *
+ * @param pool       Pool pop from
+ * @param shard      Shard of the calling thread
+ * @param[out] error Error proceeded
+ *
+ * Top item of the shard is popped. If the shard is empty, the bottom item
+ * of other shard is stolen. STK_EMPTY_POP is set if all shards are empty.
+ *
+ * @return 'Popped' item
+ */
+item_t pop_spool(spool_t *const pool, const size_t shard, int *const error = nullptr);
+
+/**
+ * @brief Verifies shard
+ *
+ * @param pool  Pool
+ * @param shard Shard to verify
+ *
+ * It checks shard canaries, buffer canaries and shard size.
+ * It can be called concurrently.
+ *
+ * @return bit mask composed of invariant_err_t elemets
+ */
+int verify_shard(spool_t *const pool, const size_t shard);
+
+/**
+ * @brief Verifies pool and all its shards
+ *
+ * @return bit mask composed of invariant_err_t elemets
+ */
+int verify_spool(spool_t *const pool);
+
+/**
+ * @brief Dumps pool
+ *
+ * @param pool Pool to dump
+ */
+void dump_spool(spool_t *const pool);
+
+#endif /* SPOOL_H_ */
+
@@ -0,0 +1,156 @@
+/**
+ * @file
+ * @brief  Segmented stack
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * Items are kept in a linked list of fixed-size segments instead of one buffer.
+ * Stack grows by a new segment and items are never copied,
+ * so push and pop are O(1) in the worst case.
+ *
+ * The last emptied segment is cached, so push/pop at a segment
+ * boundary doesn't allocate and free memory in turns.
+ */
+
+#ifndef SSTACK_H_
+#define SSTACK_H_
+
+#include "stack.h"
+
+const size_t SEGMENT_SLOTS = CHUNK_SLOTS; /**< Items per segment */
+
+/**
+ * @brief Stack segment
+ *
+ * Canaries are keyed by segment address.
+ */
+struct segment_t {
+
+#ifdef CANARY_PROTECT
+        canary_t   left_canary  = 0;       /**< Canary protection from left */
+#endif /* CANARY_PROTECT */
+
+        segment_t *prev         = nullptr; /**< Segment below              */
+        size_t     index        = 0;       /**< Segment number from bottom */
+
+#ifdef HASH_PROTECT
+        hash_t     digest       = 0;       /**< XOR of slot hashes         */
+#endif /* HASH_PROTECT */
+
+        alignas(canary_t) item_t items[SEGMENT_SLOTS]; /**< Right canary follows items */
+
+#ifdef CANARY_PROTECT
+        canary_t   right_canary = 0;       /**< Canary protection from right */
+#endif /* CANARY_PROTECT */
+
+};
+
+/**
+ * @brief Segmented stack structure
+ */
+struct sstack_t {
+
+#ifdef CANARY_PROTECT
+        canary_t left_canary = 0;             /**< Canary protection from left */
+#endif /* CANARY_PROTECT */
+
+        segment_t *top        = nullptr;      /**< Segment with the top item  */
+        segment_t *spare      = nullptr;      /**< Cached empty segment       */
+        size_t     size       = 0;
+        size_t     n_segments = 0;            /**< Segments in use            */
+
+        const stack_alloc_t *alloc = nullptr; /**< Allocator (nullptr - libc) */
+
+#ifdef HASH_PROTECT
+        hash_t     hash       = 0;            /**< Hash protection */
+#endif /* HASH_PROTECT */
+
+#ifdef CANARY_PROTECT
+        canary_t right_canary = 0;            /**< Canary protection from right */
+#endif /* CANARY_PROTECT */
+
+};
+
+/**
+ * @brief Segmented stack constructor
+ *
+ * @param[out] stk   Stack to create
+ * @param alloc      Segments allocator (nullptr - libc)
+ * @param[out] error Error proceeded
+ *
+ * Nothing is allocated until the first push.
+ * In case of an error, nothing happens to the stack.
+ */
+sstack_t *const construct_sstack(sstack_t *const stk, const stack_alloc_t *const alloc = nullptr,
+                                 int *const error = nullptr);
+
+/**
+ * @brief Segmented stack destructor
+ *
+ * @param stk Stack to destroy
+ *
+ * All segments are freed, spare one as well.
+ */
+sstack_t *const destruct_sstack(sstack_t *const stk);
+
+/**
+ * @brief Pushes item to segmented stack
+ *
+ * @param stk        Stack push to
+ * @param item       Item to push
+ * @param[out] error Error proceeded
+ *
+ * New segment is taken if the top one is full.
+ * In case of an error, nothing happens to the stack.
+ */
+void push_sstack(sstack_t *const stk, const item_t item, int *const error = nullptr);
+
+/**
+ * @brief Pops item from segmented stack
+ *
+ * @param stk        Stack pop from
+ * @param[out] error Error proceeded
+ *
+ * Emptied segment becomes the spare one.
+ * In case of an error, nothing happens to the stack.
+ *
+ * @return 'Popped' item
+ */
+item_t pop_sstack(sstack_t *const stk, int *const error = nullptr);
+
+/**
+ * @brief Verifies segmented stack
+ *
+ * @param stk Stack to verify
+ *
+ * It checks stack canaries and hash, size and canaries of the top and spare segments.
+ * It is O(1), it is called by every operation.
+ *
+ * @return bit mask composed of invariant_err_t elemets
+ */
+int verify_sstack(sstack_t *const stk);
+
+/**
+ * @brief Fully verifies segmented stack
+ *
+ * @param stk Stack to verify
+ *
+ * Every segment canaries, position and digest are checked as well.
+ * It is O(size), it is designed to be called at checkpoints.
+ * Stack dump is logged in case of an error.
+ *
+ * @return bit mask composed of invariant_err_t elemets
+ */
+int verify_sstack_full(sstack_t *const stk);
+
+/**
+ * @brief Dumps segmented stack
+ *
+ * @param stk Stack to dump
+ *
+ * Only DUMP_WINDOW top items are printed.
+ */
+void dump_sstack(sstack_t *const stk);
+
+#endif /* SSTACK_H_ */
+
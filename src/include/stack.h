@@ -9,23 +9,163 @@
 #define STACK_H_
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include "config.h"
+#include "alloc.h"
+#include "hash.h"
+#include "stats.h"
 
 typedef int item_t; 
 
-#ifdef CANARY_PROTECT
+const size_t INIT_CAP     = 8;
+const size_t CAP_FACTOR   = 2;
+const size_t MAX_FACTOR   = 1 << 16; /**< Shrink threshold is factor^2, so it mustn't overflow */
+const size_t SHRINK_DELAY = 64;
+
+/**
+ * @brief Shrink policy
+ *
+ * Stack is below the shrink threshold if it is at most 1/factor^2 full.
+ */
+enum shrink_policy_t {
+        SHRINK_EAGER = 0, /**< Shrink by factor as soon as stack is below threshold */
+        SHRINK_LAZY  = 1, /**< Shrink at once after shrink_delay pops below threshold */
+        SHRINK_NEVER = 2, /**< Shrink on trim_stack() call only */
+};
+
 typedef uint64_t canary_t;
 const uint64_t CANARY = 0xCCCCCCCCCCCCCCCC;
-#endif /* CANARY_PROTECT */
 
-#ifdef HASH_PROTECT
 typedef uint32_t hash_t;
 const int SEED = 0xDED32BAD;
-#endif /* HASH_PROTECT */
+
+const int FILL_BYTE = 'u';
+
+const size_t CACHE_LINE = 64;
+
+const size_t CHUNK_SLOTS = 4096 / sizeof(item_t); /**< Slots per hash chunk */
+
+static_assert(INLINE_CAP >= 1 && INLINE_CAP <= CHUNK_SLOTS, "Inline items must fit one chunk");
+
+/**
+ * @brief Inline items block size
+ *
+ * It has the same layout as allocated blocks: items between data canaries.
+ */
+#ifdef CANARY_PROTECT
+const size_t INLINE_RAW = INLINE_CAP * sizeof(item_t) + sizeof(void *) - 
+                          INLINE_CAP * sizeof(item_t) % sizeof(void *) + 2 * sizeof(canary_t);
+#else
+const size_t INLINE_RAW = INLINE_CAP * sizeof(item_t);
+#endif /* CANARY_PROTECT */
+
+/**
+ * @brief Verification policy
+ *
+ * Structural verification checks size, capacity, canaries and 
+ * the hash of stack structure. It is O(1).
+ * Dirty chunks verification rehashes chunks changed since the last
+ * successful verification. It is O(CHUNK_SLOTS + log(capacity)) per operation.
+ * Full verification recalculates items digest as well. It is O(capacity).
+ */
+enum verify_level_t {
+        VERIFY_NONE    = 0, /**< No verification                              */
+        VERIFY_STRUCT  = 1, /**< Structural verification only                 */
+        VERIFY_SAMPLED = 2, /**< Full verification every verify_period ops    */
+        VERIFY_DIRTY   = 3, /**< Structural and dirty chunks verification     */
+        VERIFY_FULL    = 4, /**< Full verification on every operation         */
+};
+
+/**
+ * @brief Poison mode
+ *
+ * Unused slots are filled with poison to find stray reads and writes.
+ */
+enum poison_mode_t {
+        POISON_EAGER = 0, /**< Poison new memory and popped slots */
+        POISON_LAZY  = 1, /**< Poison popped slots only           */
+        POISON_NONE  = 2, /**< Never poison                       */
+};
+
+/**
+ * @brief Stack growth parameters
+ *
+ * Capacity is multiplied by factor on expansion 
+ * but it never grows more than max_step items at once.
+ */
+struct stack_params_t {
+        size_t init_cap       = INIT_CAP;   /**< Initial capacity           */
+        size_t factor         = CAP_FACTOR; /**< Growth factor (2 to MAX_FACTOR) */
+        size_t max_step       = 0;          /**< Max growth step (0 - none) */
+
+        int    shrink         = SHRINK_EAGER; /**< Shrink policy          */
+        size_t shrink_delay   = SHRINK_DELAY; /**< Pops before lazy shrink */
+
+        int    poison         = POISON_MODE;  /**< Poison mode             */
+        int    hash_kind      = HASH_KIND;    /**< Hash kernel (hash_kind_t) */
+
+        const stack_alloc_t *alloc = nullptr; /**< Allocator (nullptr - libc) */
+        bool   inline_items   = true; /**< Keep up to INLINE_CAP items inside stack_t */
+};
+
+const size_t INVALID_BITS = 9; /**< Number of invariant_err_t flags */
+
+/**
+ * @brief Stack operation counters
+ *
+ * Counters are collected if stack is compiled with STACK_STATS
+ * and stats are enabled by enable_stack_stats().
+ * Times are in nanoseconds (clock ticks inside the stack).
+ */
+struct stack_stats_t {
+        uint64_t pushes       = 0; /**< Pushed items             */
+        uint64_t pops         = 0; /**< Popped items             */
+        uint64_t empty_pops   = 0; /**< Pops from an empty stack */
+
+        uint64_t grows        = 0; /**< Expanding reallocations  */
+        uint64_t shrinks      = 0; /**< Shrinking reallocations  */
+        uint64_t bytes_copied = 0; /**< Bytes moved by reallocations */
+
+        uint64_t hash_time    = 0; /**< Time spent rehashing items  */
+        uint64_t verify_time  = 0; /**< Time spent verifying stack  */
+        uint64_t verify_fails[INVALID_BITS] = {}; /**< Failures by invariant_err_t bit */
+
+        size_t   peak_size     = 0;
+        size_t   peak_capacity = 0;
+
+        stats_hist_t push_time = {}; /**< push_stack() latency */
+        stats_hist_t pop_time  = {}; /**< pop_stack() latency  */
+};
+
+/**
+ * @brief Side protection record
+ *
+ * With SIDE_META hash protection fields are kept out of stack_t
+ * in a record from the meta allocator. They are covered by the stack hash as well.
+ */
+#if defined(HASH_PROTECT) && defined(SIDE_META)
+struct stack_prot_t {
+        hash_t *chunk_tree    = nullptr; /**< XOR tree of chunk digests */
+        size_t dirty_from     = 0;       /**< First unverified chunk    */
+        size_t dirty_to       = 0;       /**< Chunk after the last unverified one */
+
+        hash_t data_hash      = 0;       /**< Items digest (XOR of slot hashes) */
+        hash_t hash           = 0;       /**< Hash protection */
+};
+#endif /* HASH_PROTECT && SIDE_META */
+
+struct audit_entry_t;
 
 /**
  * @brief Stack structure
+ *
+ * Hot fields used by every operation come first and fit STACK_HOT_BYTES
+ * together with the left canary. Fast path bounds and pops counter follow them,
+ * fast path uses nothing else. Cold ones follow them.
+ *
+ * Small stacks keep items in inline_raw, so they need no allocation.
+ * Stack with inline items refers to itself and can't be copied by value.
  */
 struct stack_t {
 
@@ -34,19 +174,65 @@ struct stack_t {
 #endif /* CANARY_PROTECT */
 
         item_t *items         = nullptr; /**< Stack data     */
-        size_t capacity       = 0;       /**< Stack capacity */
         size_t size           = 0;       /**< Stack size     */
+        size_t capacity       = 0;       /**< Stack capacity */
 
-#ifdef HASH_PROTECT
+        /* Fast path fields */
+
+        size_t fast_lo        = 0;       /**< Smallest size of the fast path (see push_fast()) */
+        size_t fast_n         = 0;       /**< Sizes of the fast path (0 - it is disabled)     */
+        size_t low_pops       = 0;       /**< Pops below shrink threshold */
+
+        /* Cold fields */
+
+        size_t reserved       = 0;       /**< Reserved capacity */
+
+        stack_params_t params = {};      /**< Growth parameters */
+
+        int    verify         = VERIFY_LEVEL;  /**< Verification policy        */
+        size_t verify_period  = VERIFY_PERIOD; /**< Full verification period  */
+        size_t ops            = 0;             /**< Operations counter         */
+
+#if defined(HASH_PROTECT) && defined(SIDE_META)
+        stack_prot_t *prot    = nullptr; /**< Hash protection fields */
+#elif defined(HASH_PROTECT)
+        hash_t *chunk_tree    = nullptr; /**< XOR tree of chunk digests */
+        size_t dirty_from     = 0;       /**< First unverified chunk    */
+        size_t dirty_to       = 0;       /**< Chunk after the last unverified one */
+
+        hash_t data_hash      = 0;       /**< Items digest (XOR of slot hashes) */
         hash_t hash           = 0;       /**< Hash protection */
 #endif /* HASH_PROTECT */
 
+#ifdef STACK_STATS
+        stack_stats_t *stats  = nullptr; /**< Counters (nullptr - disabled) */
+#endif /* STACK_STATS */
+
+#ifdef HASH_PROTECT
+        hash_t inline_tree[2] = {};      /**< Chunk tree of inline items */
+#endif /* HASH_PROTECT */
+
+        alignas(canary_t) char inline_raw[INLINE_RAW] = {}; /**< Inline items block */
+
+#ifdef STACK_AUDIT
+        audit_entry_t *audit  = nullptr; /**< Auditor entry, it is not hashed (see audit.h) */
+#endif /* STACK_AUDIT */
+
 #ifdef CANARY_PROTECT
         canary_t right_canary = 0;       /**< Canary protection from right */
 #endif /* CANARY_PROTECT */
 
 };
 
+const size_t STACK_HOT_BYTES = CACHE_LINE / 2;
+
+static_assert(offsetof(stack_t, capacity) + sizeof(size_t) <= STACK_HOT_BYTES,
+              "Hot stack fields must fit half a cache line");
+static_assert(offsetof(stack_t, low_pops) + sizeof(size_t) <= CACHE_LINE,
+              "Fast path fields must fit a cache line");
+
+#define stack_likely(_x)   __builtin_expect(!!(_x), 1)
+
 /**
  * @brief Stack error codes 
  */
@@ -55,6 +241,7 @@ enum stack_error_t {
         STK_OVERFLOW  = 0x0000F112, 
         STK_INVALID   = 0xABADBABE,
         STK_EMPTY_POP = 0x00000E11,
+        STK_BAD_FILE  = 0x0BADF11E,
 };
 
 /**
@@ -69,12 +256,13 @@ enum invariant_err_t {
         INVALID_DATA_RCNRY = 1 << 5,
         INVALID_STK_LCNRY  = 1 << 6,
         INVALID_STK_RCNRY  = 1 << 7,
+        INVALID_POISON     = 1 << 8, /**< Unused slot isn't poisoned (verify_stack_deep()) */
 };
 
-#define log_dump(_stk)               \
-        do {                         \
-                log("Stack dump\n"); \
-                dump_stack(_stk);    \
+#define log_dump(_stk)                   \
+        do {                             \
+                log_err("Stack dump\n"); \
+                dump_stack(_stk);        \
         } while (0)
 
 /**
@@ -84,10 +272,47 @@ enum invariant_err_t {
  *
  * It prints stack dump to a log file. 
  * If log file is empty stderr stream is used.
+ * Dump is written at error level and flushed before return.
  * There are a lot of useful information inside.
+ *
+ * Only DUMP_WINDOW top items and unused slots are printed,
+ * runs of poison are collapsed into ranges stack[from..to] (both inclusive).
  */
 void dump_stack(stack_t *const stk);
 
+/**
+ * @brief Dumps stack as JSON
+ *
+ * @param stk        Stack to dump
+ * @param fd         File descriptor to write to
+ * @param window     Number of top items to dump
+ * @param[out] error Error proceeded
+ *
+ * Dump is one JSON object per line: structure fields, verification result,
+ * hashes and canaries, then "slots" from the window start up to capacity.
+ * A slot is [index, item] or {"poison": [from, to]} for a run of poison,
+ * from and to are inclusive like in dump_stack().
+ * At most 2 * window slots are written, "truncated" is set if there are more.
+ *
+ * Dump is formatted to a buffer and written at once.
+ * STK_BAD_FILE is set in case of a write error.
+ */
+void dump_stack_json(stack_t *const stk, const int fd, const size_t window = DUMP_WINDOW,
+                     int *const error = nullptr);
+
+/**
+ * @brief Installs SIGSEGV handler for guard pages
+ *
+ * @param fd         Fault report file descriptor (STDERR_FILENO, a pre-opened log file)
+ * @param[out] error Error proceeded
+ *
+ * Faults in guard pages of GUARD_ALLOC blocks are written to fd with the fault
+ * address and the owner stack address, then the fault goes to the previous action
+ * (see set_guard_handler()). Handler is async-signal-safe, so the stack is not dumped:
+ * dump it from the core file.
+ */
+void install_guard_handler(const int fd, int *const error = nullptr);
+
 /**
  * @brief Stack constructor
  *
@@ -100,6 +325,22 @@ void dump_stack(stack_t *const stk);
  */
 stack_t *const construct_stack(stack_t *const stk, int *const error = nullptr);
 
+/**
+ * @brief Stack constructor with growth parameters
+ *
+ * @param[out] stk      Stack to create
+ * @param      params   Growth parameters
+ * @param[out] error    Error proceeded
+ *
+ * The same as construct_stack(), but initial capacity and growth 
+ * are set by params. Set init_cap to the peak depth, 
+ * if it is known, to allocate memory only once.
+ * Stack of up to INLINE_CAP items is not allocated at all
+ * unless inline items are disabled by params.
+ */
+stack_t *const construct_stack(stack_t *const stk, const stack_params_t *const params, 
+                               int *const error = nullptr);
+
 /**
  * @brief Stack destructor 
  *
@@ -110,6 +351,81 @@ stack_t *const construct_stack(stack_t *const stk, int *const error = nullptr);
  */
 stack_t *const destruct_stack(stack_t *const stk);
 
+/**
+ * @brief Mapped stack constructor
+ *
+ * @param[out] stk   Stack to create
+ * @param path       File path (file is created or truncated)
+ * @param params     Growth parameters (allocator is ignored)
+ * @param[out] error Error proceeded
+ *
+ * Items are stored in memory mapped file (see open_map_alloc()).
+ * Stack structure, canaries and items digest are written to the file header
+ * by sync_stack(), on every file resize and by destruct_stack() that closes the mapping.
+ */
+stack_t *const construct_mapped_stack(stack_t *const stk, const char *const path,
+                                      const stack_params_t *const params, int *const error = nullptr);
+
+/**
+ * @brief Opens mapped stack
+ *
+ * @param[out] stk   Stack to open
+ * @param path       File written by sync_stack()
+ * @param[out] error Error proceeded
+ *
+ * Stack is restored from the header written by the last sync_stack() or destruct_stack()
+ * and verified fully. Changes made after the last header write (e.g. before a crash)
+ * fail the verification.
+ * Items are not copied, but with hash protection they are rehashed, so it is O(capacity).
+ * STK_BAD_FILE is set if file can't be opened, its header is invalid or the stack 
+ * doesn't match it.
+ */
+stack_t *const open_mapped_stack(stack_t *const stk, const char *const path, int *const error = nullptr);
+
+/**
+ * @brief Makes mapped stack checkpoint
+ *
+ * @param stk        Mapped stack
+ * @param[out] error Error proceeded
+ *
+ * Stack is verified according to its policy, then header is written
+ * and the file is flushed by msync().
+ */
+void sync_stack(stack_t *const stk, int *const error = nullptr);
+
+/**
+ * @brief Saves stack snapshot
+ *
+ * @param stk        Stack to save
+ * @param fd         File descriptor to write to
+ * @param[out] error Error proceeded
+ *
+ * Snapshot is a versioned header (capacity, size, item size, seed and murmur_hash()
+ * of the items) followed by raw items. It is written by writev() without copying items.
+ * STK_BAD_FILE is set in case of a write error.
+ */
+void save_stack(stack_t *const stk, const int fd, int *const error = nullptr);
+
+/**
+ * @brief Loads stack snapshot
+ *
+ * @param[out] stk   Stack to create
+ * @param fd         File descriptor to read from
+ * @param[out] error Error proceeded
+ *
+ * Stack is allocated once with the saved capacity and items are read 
+ * directly to its buffer. STK_BAD_FILE is set if snapshot is invalid.
+ */
+stack_t *const load_stack(stack_t *const stk, const int fd, int *const error = nullptr);
+
+/**
+ * @brief Loads stack snapshot with growth parameters
+ *
+ * The same as load_stack(), but params are used after the stack is loaded.
+ */
+stack_t *const load_stack(stack_t *const stk, const stack_params_t *const params, const int fd,
+                          int *const error = nullptr);
+
 /**
  * @brief Pushes item to stack 
  *
@@ -137,6 +453,207 @@ void push_stack(stack_t *const stk, const item_t item, int *const error = nullpt
  */
 item_t pop_stack(stack_t *const stack, int *const error = nullptr);
 
+/**
+ * @brief Pushes items to stack
+ *
+ * @param stk        Stack push to
+ * @param items      Items to push
+ * @param n          Number of items
+ * @param[out] error Error proceeded
+ *
+ * Items are pushed in array order, so items[n - 1] becomes the top.
+ * Stack is rescaled once, verified and rehashed once per call.
+ * In case of an error, nothing happens to the stack.
+ */
+void push_stack_n(stack_t *const stk, const item_t *const items, const size_t n, 
+                  int *const error = nullptr);
+
+/**
+ * @brief Pops items from stack
+ *
+ * @param stk        Stack pop from
+ * @param[out] items Popped items
+ * @param n          Number of items
+ * @param[out] error Error proceeded
+ *
+ * Items are copied in stack order, so items[n - 1] is the former top.
+ * Stack is rescaled once, verified and rehashed once per call.
+ * In case of an error, nothing happens to the stack.
+ */
+void pop_stack_n(stack_t *const stk, item_t *const items, const size_t n, 
+                 int *const error = nullptr);
+
+/**
+ * @brief Pops and pushes items at once
+ *
+ * @param stk        Stack to update
+ * @param[out] popped Popped items
+ * @param n_pop      Number of items to pop
+ * @param items      Items to push
+ * @param n_push     Number of items to push
+ * @param[out] error Error proceeded
+ *
+ * It is the same as pop_stack_n() followed by push_stack_n(), but popped slots
+ * are overwritten in place. Stack is rescaled once, verified and rehashed once per call.
+ * In case of an error, nothing happens to the stack.
+ */
+void update_stack(stack_t *const stk, item_t *const popped, const size_t n_pop,
+                  const item_t *const items, const size_t n_push, int *const error = nullptr);
+
+/**
+ * @brief Gets top items without copying
+ *
+ * @param stk        Stack
+ * @param n          Number of items
+ * @param[out] error Error proceeded
+ *
+ * Pointer is valid until the next stack modification.
+ *
+ * @return Pointer to n top items in stack order (the last one is the top)
+ *         or nullptr in case of an error.
+ */
+const item_t *peek_range(stack_t *const stk, const size_t n, int *const error = nullptr);
+
+/**
+ * @brief Gets top item
+ *
+ * @param stk        Stack
+ * @param[out] error Error proceeded
+ *
+ * It is peek_range() of one item.
+ *
+ * @return Top item or poison in case of an error
+ */
+item_t top_stack(stack_t *const stk, int *const error = nullptr);
+
+/**
+ * @brief Reserves stack memory
+ *
+ * @param stk        Stack
+ * @param capacity   Capacity to reserve
+ * @param[out] error Error proceeded
+ *
+ * Stack is expanded to capacity at once if it is smaller.
+ * Stack is never shrunk below reserved capacity 
+ * until shrink_to_fit_stack() is called.
+ * In case of an error, nothing happens to the stack.
+ */
+void reserve_stack(stack_t *const stk, const size_t capacity, int *const error = nullptr);
+
+/**
+ * @brief Returns unused stack memory
+ *
+ * @param stk        Stack
+ * @param[out] error Error proceeded
+ *
+ * Stack is shrunk in one step to the capacity it would have 
+ * with eager shrink policy. It is designed to be called off the 
+ * latency-critical path, e.g. by timer, with lazy or never shrink policy.
+ * In case of an error, nothing happens to the stack.
+ */
+void trim_stack(stack_t *const stk, int *const error = nullptr);
+
+/**
+ * @brief Shrinks stack capacity to its size
+ *
+ * @param stk        Stack
+ * @param[out] error Error proceeded
+ *
+ * It also cancels reserved capacity.
+ * In case of an error, nothing happens to the stack.
+ */
+void shrink_to_fit_stack(stack_t *const stk, int *const error = nullptr);
+
+/**
+ * @brief Sets stack verification policy
+ *
+ * @param stk        Stack
+ * @param level      Verification level (verify_level_t)
+ * @param period     Full verification period for VERIFY_SAMPLED level
+ * @param[out] error Error proceeded
+ *
+ * Policy can be set before construction as well. 
+ * Constructed stack is fully verified before the policy is changed.
+ * In case of an error, nothing happens to the stack.
+ */
+void set_verify_policy(stack_t *const stk, const int level, 
+                       const size_t period = VERIFY_PERIOD, int *const error = nullptr);
+
+/**
+ * @brief Enables stack stats
+ *
+ * @param stk        Stack
+ * @param[out] error Error proceeded
+ *
+ * Counters are allocated by calloc() and reset.
+ * It can be called before construction as well, stats are freed with the stack.
+ * STK_INVALID is set if stack is compiled without STACK_STATS.
+ * In case of an error, nothing happens to the stack.
+ */
+void enable_stack_stats(stack_t *const stk, int *const error = nullptr);
+
+/**
+ * @brief Gets stack stats
+ *
+ * @param stk        Stack
+ * @param[out] stats Stats copy with times in nanoseconds
+ * @param[out] error Error proceeded
+ *
+ * Use hist_percentile() to get latency percentiles.
+ * STK_INVALID is set if stats are not enabled.
+ */
+void stack_stats(const stack_t *const stk, stack_stats_t *const stats, int *const error = nullptr);
+
+/**
+ * @brief Resets stack stats
+ *
+ * @param stk Stack
+ *
+ * Peaks are set to the current size and capacity.
+ */
+void reset_stack_stats(stack_t *const stk);
+
+/**
+ * @brief Fully verifies stack regardless of its policy
+ *
+ * @param stk Stack to verify
+ *
+ * It is designed to be called at checkpoints.
+ * Stack dump is logged in case of an error.
+ *
+ * @return bit mask composed of invariant_err_t elemets
+ */
+int verify_stack_full(stack_t *const stk);
+
+/**
+ * @brief Fully verifies stack and its unused slots
+ *
+ * @param stk Stack to verify
+ *
+ * The same as verify_stack_full(), but in eager poison mode every slot above
+ * size is checked to hold FILL_BYTE, so stray writes into unused capacity are found.
+ * Slots are compared by vectors (see scan.h), it is cheap enough for periodic checks
+ * of large stacks. In other poison modes unused slots are not checked.
+ *
+ * @return bit mask composed of invariant_err_t elemets
+ */
+int verify_stack_deep(stack_t *const stk);
+
+/**
+ * @brief Verifies stack structure and a slice of its chunks
+ *
+ * @param stk        Stack to verify
+ * @param[in,out] chunk First chunk of the slice, it is set to the next slice
+ *                   (0 after the last one)
+ * @param n          Number of chunks in the slice
+ *
+ * Slices are verified with the stack held, so the whole stack is verified
+ * in short steps (see audit.h). Without hash protection there are no chunks.
+ *
+ * @return bit mask composed of invariant_err_t elemets
+ */
+int verify_stack_slice(stack_t *const stk, size_t *const chunk, const size_t n);
+
 /**
  * @brief Verifies stack
  *
@@ -161,6 +678,84 @@ static int verify_stack(stack_t *const stk);
  */
 static int verify_empty_stack(const stack_t *const stk);
 
+/**
+ * @brief Pushes item to stack by the fast path
+ *
+ * @param stk        Stack push to
+ * @param item       Item to push
+ * @param[out] error Error proceeded
+ *
+ * It is push_stack() inlined for the common case: if stack is not full and it
+ * is above its shrink threshold, item is stored after a single compare.
+ * Otherwise push_stack() is called, so the result is the same.
+ *
+ * Fast path is enabled for stacks that do nothing else on push and pop:
+ * without hash protection, verification (VERIFY_NONE, if stack is protected),
+ * poison (POISON_NONE), stats and auditor. Fast operations are not counted by ops,
+ * capacity and low_pops change the same way as by push_stack() and pop_stack().
+ *
+ * With HASH_PROTECT (the default config.h) fast path is compiled out,
+ * so push_fast() is just push_stack().
+ */
+static inline void push_fast(stack_t *const stk, const item_t item, int *const error = nullptr)
+{
+        const size_t size = stk->size;
+
+        if (stack_likely(size - stk->fast_lo < stk->fast_n)) {
+                stk->items[size] = item;
+                stk->size = size + 1;
+                return;
+        }
+
+        push_stack(stk, item, error);
+}
+
+/**
+ * @brief Pops item from stack by the fast path
+ *
+ * @param stk        Stack pop from
+ * @param[out] error Error proceeded
+ *
+ * It is pop_stack() inlined for the common case: if stack stays above its
+ * shrink threshold, item is loaded after a single compare. Such a pop resets
+ * low_pops like pop_stack() does.
+ * Otherwise pop_stack() is called (see push_fast()).
+ *
+ * @return 'Popped' item
+ */
+static inline item_t pop_fast(stack_t *const stk, int *const error = nullptr)
+{
+        const size_t size = stk->size;
+
+        if (stack_likely(size - 1 - stk->fast_lo < stk->fast_n)) {
+                stk->size     = size - 1;
+                stk->low_pops = 0;
+                return stk->items[size - 1];
+        }
+
+        return pop_stack(stk, error);
+}
+
+/**
+ * @brief Gets top item by the fast path
+ *
+ * @param stk        Stack
+ * @param[out] error Error proceeded
+ *
+ * Otherwise top_stack() is called (see push_fast()).
+ *
+ * @return Top item or poison in case of an error
+ */
+static inline item_t top_fast(stack_t *const stk, int *const error = nullptr)
+{
+        const size_t size = stk->size;
+
+        if (stack_likely(stk->fast_n && size))
+                return stk->items[size - 1];
+
+        return top_stack(stk, error);
+}
+
 #endif /* STACK_H_ */
 
 
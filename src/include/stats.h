@@ -0,0 +1,127 @@
+/**
+ * @file
+ * @brief  Stack instrumentation
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * Latencies are measured in clock ticks (TSC on x86) and recorded
+ * to HDR-style histograms: values are grouped by power of 2 and every
+ * group has 2^HIST_SUB_BITS linear buckets, so relative error is below 1/16.
+ * Ticks are converted to nanoseconds when stats are read only.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+const size_t HIST_SUB_BITS = 4;
+const size_t HIST_SUB      = 1 << HIST_SUB_BITS;                      /**< Buckets per power of 2 */
+const size_t HIST_BUCKETS  = (64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS; /**< Covers any uint64_t   */
+
+/**
+ * @brief Latency histogram
+ */
+struct stats_hist_t {
+        uint64_t count = 0;
+        uint64_t total = 0; /**< Sum of all values */
+        uint64_t max   = 0;
+
+        uint64_t buckets[HIST_BUCKETS] = {};
+};
+
+/**
+ * @brief Reads stats clock
+ *
+ * @return Ticks since an unspecified point
+ */
+static inline uint64_t stats_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        struct timespec ts = {};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Gets histogram bucket of value
+ */
+static inline size_t hist_bucket(const uint64_t value)
+{
+        if (value < HIST_SUB)
+                return (size_t)value;
+
+        size_t exp = 63 - (size_t)__builtin_clzll(value);
+        size_t sub = (value >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+
+        return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) | sub;
+}
+
+/**
+ * @brief Gets the lowest value of histogram bucket
+ */
+static inline uint64_t hist_value(const size_t bucket)
+{
+        if (bucket < HIST_SUB)
+                return bucket;
+
+        size_t exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+        return (HIST_SUB | (bucket & (HIST_SUB - 1))) << (exp - HIST_SUB_BITS);
+}
+
+/**
+ * @brief Records value to histogram
+ */
+static inline void hist_record(stats_hist_t *const hist, const uint64_t value)
+{
+        hist->count++;
+        hist->total += value;
+        if (value > hist->max)
+                hist->max = value;
+
+        hist->buckets[hist_bucket(value)]++;
+}
+
+/**
+ * @brief Gets histogram percentile
+ *
+ * @param hist Histogram
+ * @param q    Quantile from 0 to 1
+ *
+ * @return The lowest value of the bucket containing quantile (0 if histogram is empty)
+ */
+uint64_t hist_percentile(const stats_hist_t *const hist, const double q);
+
+/**
+ * @brief Converts ticks histogram to nanoseconds
+ *
+ * @param[out] dst Nanoseconds histogram
+ * @param src      Ticks histogram
+ * @param ns_per_tick Clock rate (see stats_ns_per_tick())
+ *
+ * Every bucket is moved to the bucket of its lowest value in nanoseconds.
+ */
+void hist_to_ns(stats_hist_t *const dst, const stats_hist_t *const src, const double ns_per_tick);
+
+/**
+ * @brief Gets stats clock rate
+ *
+ * TSC is calibrated against CLOCK_MONOTONIC since the program start,
+ * so the rate gets more accurate as the program runs.
+ *
+ * @return Nanoseconds per tick
+ */
+double stats_ns_per_tick();
+
+#endif /* STATS_H_ */
+
@@ -0,0 +1,460 @@
+/**
+ * @file
+ * @brief  Log backend
+ * @author d3phys
+ * @date   08.10.2021
+ */
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include "include/log.h"
+
+static const char HEADER[] = "<!DOCTYPE html>                      \n"
+                                "<html>                            \n"
+                                   "<head>                         \n"
+                                      "<meta charset=\"utf-8\" />  \n"
+                                      "<title>Stack log</title>    \n"
+                                   "</head>                        \n"
+                                "<body>                            \n"
+                                        "<pre><font color=\"navy\">\n"
+                                                    "┈┏━╮╭━┓┈┈┈┈┈┈┈\n"
+                                                    "┈┃┏┗┛┓┃┈┈┈┈┈┈┈\n"
+                                                    "┈╰┓▋▋┏╯┈┈┈┈┈┈┈\n"
+                                                    "╭━┻╮╲┗━━━━╮╭╮┈\n"
+                                                    "┃▎▎┃╲╲╲╲╲╲┣━╯┈\n"
+                                                    "╰━┳┻▅╯╲╲╲╲┃┈┈┈\n"
+                                                    "┈┈╰━┳┓┏┳┓┏╯┈┈┈\n"
+                                                    "┈┈┈┈┗┻┛┗┻┛┈┈┈┈\n"
+                                                    "       </font>\n";
+
+static const char PREFIX[] = "<font color=\"Chocolate\"> >> [%s.%09lu] At %s %s(%d): </font>";
+static const char TIME_FORMAT[] = "%d.%m.%Y %H:%M:%S";
+
+static const uint64_t NS_PER_SEC = 1000000000;
+
+static const std::chrono::milliseconds WRITER_PERIOD(10);
+
+/**
+ * @brief Ring buffer record
+ *
+ * Sequence number tells whose turn it is: record at position pos
+ * is free if seq == pos and it is ready to be written if seq == pos + 1.
+ *
+ * Prefix is formatted by the writer from the raw timestamp and location
+ * (file and func are string literals). Raw records have no location.
+ */
+struct log_record_t {
+        std::atomic<size_t> seq {0};
+
+        uint64_t    stamp = 0;       /**< Monotonic time (ns) */
+        const char *file  = nullptr;
+        const char *func  = nullptr;
+        int         line  = 0;
+
+        size_t len = 0;
+        char text[LOG_RECORD_SIZE] = {0};
+};
+
+/**
+ * @brief Formatted time cache
+ *
+ * Time is formatted by strftime() once per second.
+ */
+struct time_cache_t {
+        uint64_t sec = UINT64_MAX;
+        char     str[64] = {0};
+};
+
+/**
+ * @brief Log state
+ */
+struct log_t {
+        FILE         *file       = nullptr;
+        log_record_t *ring       = nullptr;
+
+        std::atomic<size_t> head {0};     /**< Next position to fill        */
+        size_t              tail  = 0;    /**< Next position to write       */
+        std::atomic<size_t> written {0};  /**< Positions written and flushed */
+        std::atomic<size_t> dropped {0};  /**< Dropped trace records         */
+
+        std::atomic<bool>   running {false};
+        std::atomic<bool>   flushing {false};
+
+        uint64_t            mono_base = 0; /**< Monotonic time at log creation (ns) */
+        uint64_t            real_base = 0; /**< Real time at log creation (ns)      */
+        time_cache_t        time      = {}; /**< Writer's time cache                */
+
+        std::mutex              lock    {};
+        std::condition_variable wake    {};
+        std::condition_variable flushed {};
+        std::thread            *writer  = nullptr;
+};
+
+static std::atomic<int> THRESHOLD {LOG_LEVEL};
+
+static log_t *get_log();
+static log_t *create_log();
+static void close_log();
+#if !defined(LOG_SYNC) && !defined(NOLOG)
+static void write_log(log_t *const lg);
+#endif /* !LOG_SYNC && !NOLOG */
+
+/**
+ * @brief Gets monotonic time
+ *
+ * It is vDSO call, there is no syscall.
+ *
+ * @return Nanoseconds.
+ */
+static inline uint64_t now_ns()
+{
+        timespec ts = {};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Formats record prefix
+ *
+ * @param lg    Log
+ * @param cache Time cache of the calling thread
+ * @param buf   Buffer of LOG_RECORD_SIZE bytes
+ * @param stamp Record monotonic time
+ * @param file  Source file
+ * @param func  Source function
+ * @param line  Source line
+ *
+ * Monotonic time is converted to local time with nanoseconds.
+ *
+ * @return Prefix length.
+ */
+static size_t format_prefix(const log_t *const lg, time_cache_t *const cache, char *const buf,
+                            const uint64_t stamp, const char *const file,
+                            const char *const func, const int line)
+{
+        assert(lg);
+        assert(cache);
+        assert(buf);
+
+        uint64_t real = lg->real_base + (stamp - lg->mono_base);
+        uint64_t sec  = real / NS_PER_SEC;
+
+        if (sec != cache->sec) {
+                time_t t = (time_t)sec;
+                tm lt = {};
+
+                localtime_r(&t, &lt);
+                strftime(cache->str, sizeof(cache->str), TIME_FORMAT, &lt);
+                cache->sec = sec;
+        }
+
+        int len = snprintf(buf, LOG_RECORD_SIZE, PREFIX, cache->str, real % NS_PER_SEC,
+                           file, func, line);
+        if (len < 0)
+                return 0;
+
+        return (size_t)len < LOG_RECORD_SIZE ? (size_t)len : LOG_RECORD_SIZE - 1;
+}
+
+/**
+ * @brief Writes record to the log file
+ */
+static void write_record(log_t *const lg, time_cache_t *const cache, const uint64_t stamp,
+                         const char *const file, const char *const func, const int line,
+                         const char *const text, const size_t len)
+{
+        assert(lg);
+
+        if (file) {
+                char prefix[LOG_RECORD_SIZE];
+                size_t prefix_len = format_prefix(lg, cache, prefix, stamp, file, func, line);
+
+                fwrite(prefix, 1, prefix_len, lg->file);
+        }
+
+        fwrite(text, 1, len, lg->file);
+}
+
+static log_t *get_log()
+{
+        static log_t *lg = create_log();
+        return lg;
+}
+
+/**
+ * @brief Creates log
+ *
+ * With NOLOG there is no log file and no writer thread. Records written
+ * directly (e.g. by with_log generic stacks) go to stderr synchronously.
+ */
+static log_t *create_log()
+{
+        log_t *lg = new log_t;
+
+#ifdef NOLOG
+        lg->file = stderr;
+#else
+        lg->file = fopen(LOG_NAME, "w");
+        if (lg->file == nullptr) {
+                perror("Can't open log file");
+                lg->file = stderr;
+        }
+
+        fputs(HEADER, lg->file);
+        fflush(lg->file);
+#endif /* NOLOG */
+
+        timespec real = {};
+        clock_gettime(CLOCK_REALTIME, &real);
+
+        lg->mono_base = now_ns();
+        lg->real_base = (uint64_t)real.tv_sec * NS_PER_SEC + (uint64_t)real.tv_nsec;
+
+#if !defined(LOG_SYNC) && !defined(NOLOG)
+        lg->ring = new log_record_t[LOG_RING_SIZE];
+        for (size_t i = 0; i < LOG_RING_SIZE; i++)
+                lg->ring[i].seq.store(i, std::memory_order_relaxed);
+
+        lg->running.store(true);
+        lg->writer = new std::thread(write_log, lg);
+#endif /* !LOG_SYNC && !NOLOG */
+
+        int err = atexit(close_log);
+        if (err)
+                perror("Log file will not be closed");
+
+        return lg;
+}
+
+static void close_log()
+{
+        log_t *lg = get_log();
+        fprintf(stderr, "Close log\n");
+
+        if (lg->writer) {
+                lg->running.store(false);
+                lg->wake.notify_one();
+                lg->writer->join();
+
+                delete lg->writer;
+                lg->writer = nullptr;
+        }
+
+        if (lg->file != stderr) {
+                int err = fclose(lg->file);
+                if (err == EOF)
+                        perror("Can't close log file");
+        }
+
+        lg->file = nullptr;
+}
+
+#if !defined(LOG_SYNC) && !defined(NOLOG)
+/**
+ * @brief Writes all ready records to the log file
+ *
+ * @param lg Log
+ *
+ * It is called by the writer thread only.
+ *
+ * @return Number of records written.
+ */
+static size_t drain_log(log_t *const lg)
+{
+        assert(lg);
+        size_t n_written = 0;
+
+        for (;;) {
+                log_record_t *rec = &lg->ring[lg->tail & (LOG_RING_SIZE - 1)];
+                if (rec->seq.load(std::memory_order_acquire) != lg->tail + 1)
+                        break;
+
+                write_record(lg, &lg->time, rec->stamp, rec->file, rec->func, rec->line,
+                             rec->text, rec->len);
+
+                rec->seq.store(lg->tail + LOG_RING_SIZE, std::memory_order_release);
+                lg->tail++;
+                n_written++;
+        }
+
+        size_t dropped = lg->dropped.exchange(0);
+        if (dropped)
+                fprintf(lg->file, "<font color=\"gray\"> >> %zu trace records dropped</font>\n",
+                        dropped);
+
+        return n_written + dropped;
+}
+
+/**
+ * @brief Writer thread
+ *
+ * @param lg Log
+ *
+ * It wakes up periodically or on demand and drains the ring buffer.
+ * Log file is flushed only after a batch of records.
+ */
+static void write_log(log_t *const lg)
+{
+        assert(lg);
+
+        for (;;) {
+                bool running = lg->running.load();
+
+                if (drain_log(lg) || lg->flushing.load())
+                        fflush(lg->file);
+
+                {
+                        std::unique_lock<std::mutex> lk(lg->lock);
+                        lg->written.store(lg->tail, std::memory_order_release);
+                        lg->flushing.store(false);
+                        lg->flushed.notify_all();
+
+                        if (!running)
+                                break;
+
+                        lg->wake.wait_for(lk, WRITER_PERIOD);
+                }
+        }
+}
+#endif /* !LOG_SYNC && !NOLOG */
+
+/**
+ * @brief Puts record to the ring buffer
+ *
+ * @param level Record level
+ * @param stamp Record monotonic time
+ * @param file  Source file (nullptr for raw record)
+ * @param func  Source function
+ * @param line  Source line
+ * @param text  Record text
+ * @param len   Record length
+ */
+static void put_record(const int level, const uint64_t stamp, const char *const file,
+                       const char *const func, const int line, const char *const text,
+                       const size_t len)
+{
+        log_t *lg = get_log();
+        if (!lg->file)
+                return;
+
+        if (!lg->ring) {
+                static thread_local time_cache_t cache;
+
+                write_record(lg, &cache, stamp, file, func, line, text, len);
+                fflush(lg->file);
+                return;
+        }
+
+        size_t pos = lg->head.load(std::memory_order_relaxed);
+        log_record_t *rec = nullptr;
+
+        for (;;) {
+                rec = &lg->ring[pos & (LOG_RING_SIZE - 1)];
+                size_t seq = rec->seq.load(std::memory_order_acquire);
+
+                if (seq == pos) {
+                        if (lg->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                                break;
+                } else if (seq < pos) {
+                        if (level == LOG_TRACE) {
+                                lg->dropped.fetch_add(1, std::memory_order_relaxed);
+                                return;
+                        }
+
+                        lg->wake.notify_one();
+                        std::this_thread::yield();
+                        pos = lg->head.load(std::memory_order_relaxed);
+                } else {
+                        pos = lg->head.load(std::memory_order_relaxed);
+                }
+        }
+
+        rec->stamp = stamp;
+        rec->file  = file;
+        rec->func  = func;
+        rec->line  = line;
+
+        memcpy(rec->text, text, len);
+        rec->len = len;
+        rec->seq.store(pos + 1, std::memory_order_release);
+
+        if (pos % (LOG_RING_SIZE / 2) == 0)
+                lg->wake.notify_one();
+}
+
+void log_write(int level, const char *file, const char *func, int line,
+               const char *fmt, ...)
+{
+        if (level < THRESHOLD.load(std::memory_order_relaxed))
+                return;
+
+        uint64_t stamp = now_ns();
+        char text[LOG_RECORD_SIZE];
+
+        va_list args;
+        va_start(args, fmt);
+        int len = vsnprintf(text, LOG_RECORD_SIZE, fmt, args);
+        va_end(args);
+
+        if (len < 0)
+                return;
+
+        if ((size_t)len >= LOG_RECORD_SIZE)
+                len = LOG_RECORD_SIZE - 1;
+
+        put_record(level, stamp, file, func, line, text, (size_t)len);
+}
+
+void log_write_raw(int level, const char *fmt, ...)
+{
+        if (level < THRESHOLD.load(std::memory_order_relaxed))
+                return;
+
+        char text[LOG_RECORD_SIZE];
+
+        va_list args;
+        va_start(args, fmt);
+        int len = vsnprintf(text, LOG_RECORD_SIZE, fmt, args);
+        va_end(args);
+
+        if (len < 0)
+                return;
+
+        if ((size_t)len >= LOG_RECORD_SIZE)
+                len = LOG_RECORD_SIZE - 1;
+
+        put_record(level, 0, nullptr, nullptr, 0, text, (size_t)len);
+}
+
+void log_flush()
+{
+#ifndef NOLOG
+        log_t *lg = get_log();
+        if (!lg->writer)
+                return;
+
+        size_t target = lg->head.load();
+
+        std::unique_lock<std::mutex> lk(lg->lock);
+        while (lg->written.load(std::memory_order_acquire) < target) {
+                lg->flushing.store(true);
+                lg->wake.notify_one();
+                lg->flushed.wait(lk);
+        }
+#endif /* NOLOG */
+}
+
+void log_set_level(int level)
+{
+        THRESHOLD.store(level, std::memory_order_relaxed);
+}
+
@@ -0,0 +1,143 @@
+/**
+ * @file
+ * @brief  Fill scanning
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "include/scan.h"
+
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SCAN_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SCAN_NEON
+#endif
+
+/**
+ * @brief Word-at-a-time scan
+ */
+static size_t fill_span_sw(const unsigned char *const data, const size_t len, const int byte)
+{
+        uint64_t fill = 0;
+        memset(&fill, byte, sizeof(fill));
+
+        size_t i = 0;
+        for (; len - i >= sizeof(fill); i += sizeof(fill)) {
+                uint64_t word = 0;
+                memcpy(&word, data + i, sizeof(word));
+                if (word != fill)
+                        break;
+        }
+
+        while (i < len && data[i] == (unsigned char)byte)
+                i++;
+
+        return i;
+}
+
+#if defined(SCAN_X86)
+static size_t fill_span_sse2(const unsigned char *const data, const size_t len, const int byte)
+{
+        const __m128i fill = _mm_set1_epi8((char)byte);
+        const __m128i zero = _mm_setzero_si128();
+        const size_t  vec  = sizeof(__m128i);
+
+        size_t i = 0;
+        for (; len - i >= SCAN_BLOCK; i += SCAN_BLOCK) {
+                __m128i diff = zero;
+                for (size_t j = 0; j < SCAN_BLOCK; j += vec)
+                        diff = _mm_or_si128(diff, _mm_xor_si128(fill,
+                                            _mm_loadu_si128((const __m128i *)(data + i + j))));
+
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero)) != 0xFFFF)
+                        break;
+        }
+
+        for (; len - i >= vec; i += vec) {
+                __m128i eq = _mm_cmpeq_epi8(fill, _mm_loadu_si128((const __m128i *)(data + i)));
+                unsigned mask = ~(unsigned)_mm_movemask_epi8(eq) & 0xFFFF;
+                if (mask)
+                        return i + (size_t)__builtin_ctz(mask);
+        }
+
+        return i + fill_span_sw(data + i, len - i, byte);
+}
+
+__attribute__((target("avx2")))
+static size_t fill_span_avx2(const unsigned char *const data, const size_t len, const int byte)
+{
+        const __m256i fill = _mm256_set1_epi8((char)byte);
+        const size_t  vec  = sizeof(__m256i);
+
+        size_t i = 0;
+        for (; len - i >= SCAN_BLOCK; i += SCAN_BLOCK) {
+                __m256i diff = _mm256_setzero_si256();
+                for (size_t j = 0; j < SCAN_BLOCK; j += vec)
+                        diff = _mm256_or_si256(diff, _mm256_xor_si256(fill,
+                                               _mm256_loadu_si256((const __m256i *)(data + i + j))));
+
+                if (!_mm256_testz_si256(diff, diff))
+                        break;
+        }
+
+        for (; len - i >= vec; i += vec) {
+                __m256i eq = _mm256_cmpeq_epi8(fill, _mm256_loadu_si256((const __m256i *)(data + i)));
+                unsigned mask = ~(unsigned)_mm256_movemask_epi8(eq);
+                if (mask)
+                        return i + (size_t)__builtin_ctz(mask);
+        }
+
+        return i + fill_span_sw(data + i, len - i, byte);
+}
+
+/**
+ * @brief Checks AVX2 support
+ *
+ * It is checked once.
+ */
+static bool avx2_supported()
+{
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+}
+#elif defined(SCAN_NEON)
+static size_t fill_span_neon(const unsigned char *const data, const size_t len, const int byte)
+{
+        const uint8x16_t fill = vdupq_n_u8((uint8_t)byte);
+        const size_t     vec  = sizeof(uint8x16_t);
+
+        size_t i = 0;
+        for (; len - i >= SCAN_BLOCK; i += SCAN_BLOCK) {
+                uint8x16_t diff = vdupq_n_u8(0);
+                for (size_t j = 0; j < SCAN_BLOCK; j += vec)
+                        diff = vorrq_u8(diff, veorq_u8(fill, vld1q_u8(data + i + j)));
+
+                uint64x2_t words = vreinterpretq_u64_u8(diff);
+                if (vgetq_lane_u64(words, 0) | vgetq_lane_u64(words, 1))
+                        break;
+        }
+
+        /* Mismatch is found by words within the block */
+        return i + fill_span_sw(data + i, len - i, byte);
+}
+#endif
+
+size_t fill_span(const void *const data, const size_t len, const int byte)
+{
+        const unsigned char *bytes = (const unsigned char *)data;
+
+#if defined(SCAN_X86)
+        if (avx2_supported())
+                return fill_span_avx2(bytes, len, byte);
+
+        return fill_span_sse2(bytes, len, byte);
+#elif defined(SCAN_NEON)
+        return fill_span_neon(bytes, len, byte);
+#else
+        return fill_span_sw(bytes, len, byte);
+#endif
+}
@@ -0,0 +1,542 @@
+/**
+ * @file
+ * @brief  Sharded work pool
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * Shards are Chase-Lev deques (Le et al. C11 version).
+ * Owner end is called top, thieves end is called bottom.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <new>
+#include "include/spool.h"
+#include "include/log.h"
+#include "include/config.h"
+
+#ifdef UNPROTECT
+#undef HASH_PROTECT
+#undef CANARY_PROTECT
+#endif /* UNPROTECT */
+
+/**
+ * @brief Steal result
+ */
+enum steal_t {
+        STEAL_OK    = 0,
+        STEAL_EMPTY = 1,
+        STEAL_ABORT = 2, /**< Other thread took the item first */
+};
+
+static inline item_t get_poison(const int byte);
+static item_t POISON = get_poison(FILL_BYTE);
+
+static shard_buf_t *alloc_buf(const size_t capacity);
+static inline size_t buf_size(const size_t capacity);
+static int grow_shard(shard_t *const shard, shard_buf_t *const old, const int64_t top,
+                      const int64_t bottom);
+
+static bool take_shard(shard_t *const shard, item_t *const item);
+static steal_t steal_shard(shard_t *const shard, item_t *const item);
+static bool steal_spool(spool_t *const pool, const size_t thief, item_t *const item);
+
+static int verify_pool_struct(spool_t *const pool);
+static int verify_shard_struct(shard_t *const shard);
+static inline uint32_t random_shard(const size_t n_shards);
+static inline void set_error(int *const error, int value);
+
+#ifdef CANARY_PROTECT
+static inline canary_t *left_canary(shard_buf_t *const buf);
+static inline canary_t *right_canary(shard_buf_t *const buf);
+#endif /* CANARY_PROTECT */
+
+#define log_pdump(_pool)                 \
+        do {                             \
+                log_err("Pool dump\n");  \
+                dump_spool(_pool);       \
+        } while (0)
+
+spool_t *const construct_spool(spool_t *const pool, const size_t n_shards, int *const error)
+{
+        assert(pool);
+        int err = 0;
+        void *raw = nullptr;
+
+        pool->shards   = nullptr;
+        pool->n_shards = 0;
+
+#ifdef CANARY_PROTECT
+        pool->left_canary  = CANARY;
+        pool->right_canary = CANARY;
+#endif /* CANARY_PROTECT */
+
+        if (n_shards == 0) {
+                log_err("Pool must have at least one shard\n");
+                err = STK_INVALID;
+                goto finally;
+        }
+
+        if (n_shards > SIZE_MAX / sizeof(shard_t)) {
+                err = STK_OVERFLOW;
+                goto finally;
+        }
+
+        raw = aligned_alloc(alignof(shard_t), n_shards * sizeof(shard_t));
+        if (!raw) {
+                log_err("Can't allocate pool shards\n");
+                err = STK_BAD_ALLOC;
+                goto finally;
+        }
+
+        pool->shards = (shard_t *)raw;
+        for (size_t i = 0; i < n_shards; i++) {
+                shard_t *shard = new (pool->shards + i) shard_t;
+
+#ifdef CANARY_PROTECT
+                shard->left_canary  = CANARY;
+                shard->right_canary = CANARY;
+#endif /* CANARY_PROTECT */
+
+                pool->n_shards++;
+
+                shard_buf_t *buf = alloc_buf(SHARD_INIT_CAP);
+                if (!buf) {
+                        log_err("Can't allocate shard buffer\n");
+                        err = STK_BAD_ALLOC;
+                        goto finally;
+                }
+
+                shard->buf.store(buf);
+        }
+
+finally:
+        if (err) {
+                destruct_spool(pool);
+                set_error(error, err);
+        }
+
+        return pool;
+}
+
+spool_t *const destruct_spool(spool_t *const pool)
+{
+        assert(pool);
+
+        for (size_t i = 0; i < pool->n_shards; i++) {
+                shard_t *shard   = pool->shards + i;
+                shard_buf_t *buf = shard->buf.load();
+
+                while (buf) {
+                        shard_buf_t *prev = buf->prev;
+                        free(buf);
+                        buf = prev;
+                }
+
+                shard->~shard_t();
+        }
+
+        free(pool->shards);
+
+        pool->shards   = nullptr;
+        pool->n_shards = 0;
+
+#ifdef CANARY_PROTECT
+        pool->left_canary  = 0;
+        pool->right_canary = 0;
+#endif /* CANARY_PROTECT */
+
+        return pool;
+}
+
+void push_spool(spool_t *const pool, const size_t index, const item_t item, int *const error)
+{
+        assert(pool);
+        assert(index < pool->n_shards);
+
+        int err = 0;
+        shard_t *shard = pool->shards + index;
+
+#ifndef UNPROTECT
+        err = verify_pool_struct(pool) | verify_shard_struct(shard);
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't push to invalid shard %zu\n", index);
+                goto finally;
+        }
+
+        {
+                int64_t top      = shard->top.load(std::memory_order_relaxed);
+                int64_t bottom   = shard->bottom.load(std::memory_order_acquire);
+                shard_buf_t *buf = shard->buf.load(std::memory_order_relaxed);
+
+                if ((size_t)(top - bottom) >= buf->capacity) {
+                        err = grow_shard(shard, buf, top, bottom);
+                        if (err) {
+                                log_err("Can't grow shard %zu\n", index);
+                                goto finally;
+                        }
+
+                        buf = shard->buf.load(std::memory_order_relaxed);
+                }
+
+                buf->items[(size_t)top & (buf->capacity - 1)].store(item, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                shard->top.store(top + 1, std::memory_order_relaxed);
+        }
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_pdump(pool);
+        }
+}
+
+item_t pop_spool(spool_t *const pool, const size_t index, int *const error)
+{
+        assert(pool);
+        assert(index < pool->n_shards);
+
+        int err = 0;
+        item_t item = POISON;
+        shard_t *shard = pool->shards + index;
+
+#ifndef UNPROTECT
+        err = verify_pool_struct(pool) | verify_shard_struct(shard);
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't pop item from invalid shard %zu\n", index);
+                goto finally;
+        }
+
+        if (!take_shard(shard, &item) && !steal_spool(pool, index, &item)) {
+                item = POISON;
+                err  = STK_EMPTY_POP;
+        }
+
+finally:
+        if (err == STK_EMPTY_POP) {
+                set_error(error, err);
+        } else if (err) {
+                set_error(error, err);
+                log_pdump(pool);
+        }
+
+        return item;
+}
+
+int verify_shard(spool_t *const pool, const size_t index)
+{
+        assert(pool);
+        assert(index < pool->n_shards);
+
+        shard_t *shard = pool->shards + index;
+        int vrf = verify_shard_struct(shard);
+
+        int64_t bottom   = shard->bottom.load(std::memory_order_acquire);
+        int64_t top      = shard->top.load(std::memory_order_acquire);
+        shard_buf_t *buf = shard->buf.load(std::memory_order_acquire);
+
+        if (!buf || !buf->capacity || (buf->capacity & (buf->capacity - 1)))
+                return vrf | INVALID_CAPACITY;
+
+        /* Top is decremented for a moment by the owner's pop */
+        if (top - bottom < -1 || top - bottom > (int64_t)buf->capacity)
+                vrf |= INVALID_SIZE;
+
+#ifdef CANARY_PROTECT
+        canary_t cnry = CANARY ^ (canary_t)buf;
+
+        if (*left_canary(buf) != cnry)
+                vrf |= INVALID_DATA_LCNRY;
+
+        if (*right_canary(buf) != cnry)
+                vrf |= INVALID_DATA_RCNRY;
+#endif /* CANARY_PROTECT */
+
+        return vrf;
+}
+
+int verify_spool(spool_t *const pool)
+{
+        assert(pool);
+        int vrf = verify_pool_struct(pool);
+
+        if (!pool->shards || !pool->n_shards)
+                return vrf | INVALID_CAPACITY;
+
+        for (size_t i = 0; i < pool->n_shards; i++)
+                vrf |= verify_shard(pool, i);
+
+        return vrf;
+}
+
+/**
+ * @brief Pops top item of the own shard
+ *
+ * @return false if shard is empty.
+ */
+static bool take_shard(shard_t *const shard, item_t *const item)
+{
+        int64_t top      = shard->top.load(std::memory_order_relaxed) - 1;
+        shard_buf_t *buf = shard->buf.load(std::memory_order_relaxed);
+
+        shard->top.store(top, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t bottom = shard->bottom.load(std::memory_order_relaxed);
+
+        if (bottom > top) {
+                shard->top.store(top + 1, std::memory_order_relaxed);
+                return false;
+        }
+
+        *item = buf->items[(size_t)top & (buf->capacity - 1)].load(std::memory_order_relaxed);
+        if (bottom < top)
+                return true;
+
+        /* The last item, thieves compete for it */
+        bool taken = shard->bottom.compare_exchange_strong(bottom, bottom + 1,
+                                                           std::memory_order_seq_cst,
+                                                           std::memory_order_relaxed);
+        shard->top.store(top + 1, std::memory_order_relaxed);
+
+        return taken;
+}
+
+/**
+ * @brief Steals bottom item of the shard
+ */
+static steal_t steal_shard(shard_t *const shard, item_t *const item)
+{
+        int64_t bottom = shard->bottom.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = shard->top.load(std::memory_order_acquire);
+
+        if (bottom >= top)
+                return STEAL_EMPTY;
+
+        shard_buf_t *buf = shard->buf.load(std::memory_order_acquire);
+        item_t stolen = buf->items[(size_t)bottom & (buf->capacity - 1)].load(std::memory_order_relaxed);
+
+        if (!shard->bottom.compare_exchange_strong(bottom, bottom + 1, std::memory_order_seq_cst,
+                                                   std::memory_order_relaxed))
+                return STEAL_ABORT;
+
+        *item = stolen;
+        return STEAL_OK;
+}
+
+/**
+ * @brief Steals item from other shards
+ *
+ * Victims are scanned from a random one. Scan is repeated while
+ * some steals are aborted, so false means all shards were empty.
+ */
+static bool steal_spool(spool_t *const pool, const size_t thief, item_t *const item)
+{
+        const size_t n = pool->n_shards;
+        bool aborted = true;
+
+        while (aborted) {
+                aborted = false;
+                size_t first = random_shard(n);
+
+                for (size_t i = 0; i < n; i++) {
+                        size_t victim = (first + i) % n;
+                        if (victim == thief)
+                                continue;
+
+                        steal_t res = steal_shard(pool->shards + victim, item);
+                        if (res == STEAL_OK)
+                                return true;
+
+                        if (res == STEAL_ABORT)
+                                aborted = true;
+                }
+        }
+
+        return false;
+}
+
+/**
+ * @brief Replaces shard buffer by twice larger one
+ *
+ * Only the owner calls it, so items [bottom, top) can't be pushed
+ * or popped by the owner meanwhile. Thieves can steal from any buffer.
+ *
+ * @return 0, STK_OVERFLOW or STK_BAD_ALLOC.
+ */
+static int grow_shard(shard_t *const shard, shard_buf_t *const old, const int64_t top,
+                      const int64_t bottom)
+{
+        if (old->capacity > SIZE_MAX / (2 * sizeof(std::atomic<item_t>)))
+                return STK_OVERFLOW;
+
+        shard_buf_t *buf = alloc_buf(old->capacity * 2);
+        if (!buf)
+                return STK_BAD_ALLOC;
+
+        for (int64_t i = bottom; i < top; i++) {
+                item_t item = old->items[(size_t)i & (old->capacity - 1)].load(std::memory_order_relaxed);
+                buf->items[(size_t)i & (buf->capacity - 1)].store(item, std::memory_order_relaxed);
+        }
+
+        buf->prev = old;
+        shard->buf.store(buf, std::memory_order_release);
+
+        return 0;
+}
+
+/**
+ * @brief Allocates shard buffer
+ *
+ * Buffer layout is [header][canary][items][canary].
+ */
+static shard_buf_t *alloc_buf(const size_t capacity)
+{
+        char *raw = (char *)calloc(1, buf_size(capacity));
+        if (!raw)
+                return nullptr;
+
+        shard_buf_t *buf = new (raw) shard_buf_t;
+        char *items = raw + sizeof(shard_buf_t);
+
+#ifdef CANARY_PROTECT
+        items += sizeof(canary_t);
+#endif /* CANARY_PROTECT */
+
+        buf->capacity = capacity;
+        buf->items    = (std::atomic<item_t> *)items;
+
+        for (size_t i = 0; i < capacity; i++)
+                new (buf->items + i) std::atomic<item_t> {POISON};
+
+#ifdef CANARY_PROTECT
+        *left_canary (buf) = CANARY ^ (canary_t)buf;
+        *right_canary(buf) = CANARY ^ (canary_t)buf;
+#endif /* CANARY_PROTECT */
+
+        return buf;
+}
+
+static inline size_t buf_size(const size_t capacity)
+{
+        size_t size = sizeof(shard_buf_t) + capacity * sizeof(std::atomic<item_t>);
+
+#ifdef CANARY_PROTECT
+        size += 2 * sizeof(canary_t);
+#endif /* CANARY_PROTECT */
+
+        return size;
+}
+
+static int verify_pool_struct(spool_t *const pool)
+{
+        assert(pool);
+        int vrf = 0x00000000;
+
+#ifdef CANARY_PROTECT
+        if (pool->left_canary  != CANARY)
+                vrf |= INVALID_STK_LCNRY;
+
+        if (pool->right_canary != CANARY)
+                vrf |= INVALID_STK_RCNRY;
+#endif /* CANARY_PROTECT */
+
+        return vrf;
+}
+
+static int verify_shard_struct(shard_t *const shard)
+{
+        assert(shard);
+        int vrf = 0x00000000;
+
+#ifdef CANARY_PROTECT
+        if (shard->left_canary  != CANARY)
+                vrf |= INVALID_STK_LCNRY;
+
+        if (shard->right_canary != CANARY)
+                vrf |= INVALID_STK_RCNRY;
+#endif /* CANARY_PROTECT */
+
+        return vrf;
+}
+
+#ifdef CANARY_PROTECT
+static inline canary_t *left_canary(shard_buf_t *const buf)
+{
+        assert(buf);
+        return (canary_t *)((char *)buf->items - sizeof(canary_t));
+}
+
+static inline canary_t *right_canary(shard_buf_t *const buf)
+{
+        assert(buf);
+        return (canary_t *)(buf->items + buf->capacity);
+}
+#endif /* CANARY_PROTECT */
+
+/**
+ * @brief Gets random shard
+ *
+ * It is xorshift generator with a thread-local state.
+ */
+static inline uint32_t random_shard(const size_t n_shards)
+{
+        static thread_local uint32_t state = 0;
+        if (!state)
+                state = (uint32_t)(size_t)&state | 1;
+
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+
+        return (uint32_t)(state % n_shards);
+}
+
+static inline item_t get_poison(const int byte)
+{
+        item_t poison = 0;
+        memset(&poison, byte, sizeof(item_t));
+
+        return poison;
+}
+
+static inline void set_error(int *const error, int value)
+{
+        if (error)
+                *error = value;
+}
+
+void dump_spool(spool_t *const pool)
+{
+        assert(pool);
+
+        log_buf("----------------------------------------------\n");
+        log_buf(" Sharded pool: %s\n", verify_spool(pool) ? "error" : "ok");
+        log_buf(" Shards:   %15zu\n", pool->n_shards);
+        log_buf("----------------------------------------------\n");
+
+#ifdef CANARY_PROTECT
+        log_buf(" Left  pool canary(hex) = %lx\n", pool->left_canary);
+        log_buf(" Right pool canary(hex) = %lx\n", pool->right_canary);
+        log_buf("----------------------------------------------\n");
+#endif /* CANARY_PROTECT */
+
+        for (size_t i = 0; i < pool->n_shards; i++) {
+                shard_t *shard   = pool->shards + i;
+                shard_buf_t *buf = shard->buf.load();
+
+                log_buf(" Shard %3zu: %x, items [%ld, %ld), capacity %zu\n", i,
+                        (unsigned)verify_shard(pool, i), shard->bottom.load(), shard->top.load(),
+                        buf ? buf->capacity : 0);
+        }
+        log_buf("----------------------------------------------\n");
+
+        log_buf("\n\n\n");
+        log_flush();
+}
+
@@ -0,0 +1,534 @@
+/**
+ * @file
+ * @brief  Segmented stack
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include "include/sstack.h"
+#include "include/log.h"
+#include "include/hash.h"
+#include "include/config.h"
+
+#ifdef UNPROTECT
+#undef HASH_PROTECT
+#undef CANARY_PROTECT
+#endif /* UNPROTECT */
+
+#ifdef CANARY_PROTECT
+static_assert(offsetof(segment_t, right_canary) == offsetof(segment_t, items) + sizeof(segment_t::items),
+              "Right segment canary must follow items");
+#endif /* CANARY_PROTECT */
+
+static inline item_t get_poison(const int byte);
+static item_t POISON = get_poison(FILL_BYTE);
+
+static inline const stack_alloc_t *sstack_alloc(const sstack_t *const stk);
+static segment_t *take_segment(sstack_t *const stk);
+static void cache_segment(sstack_t *const stk, segment_t *const seg);
+static void free_segment(sstack_t *const stk, segment_t *const seg);
+static inline void set_slot(segment_t *const seg, const size_t slot, const item_t item);
+
+static int verify_seg(const segment_t *const seg);
+static int verify_sstruct(sstack_t *const stk);
+static int verify_empty_sstack(const sstack_t *const stk);
+static inline void set_error(int *const error, int value);
+
+#ifdef HASH_PROTECT
+static hash_t hash_sheader(sstack_t *const stk);
+static inline hash_t hash_segment(const segment_t *const seg);
+#endif /* HASH_PROTECT */
+
+#define log_sdump(_stk)                  \
+        do {                             \
+                log_err("Stack dump\n"); \
+                dump_sstack(_stk);       \
+        } while (0)
+
+sstack_t *const construct_sstack(sstack_t *const stk, const stack_alloc_t *const alloc,
+                                 int *const error)
+{
+        assert(stk);
+        int err = 0;
+
+#ifndef UNPROTECT
+$       (err = verify_empty_sstack(stk);)
+#endif  /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't construct (stack is not empty)\n");
+                goto finally;
+        }
+
+        if (alloc && (!alloc->alloc || !alloc->free)) {
+                log_err("Invalid segments allocator\n");
+                err = STK_INVALID;
+                goto finally;
+        }
+
+        stk->alloc = alloc;
+
+#ifdef CANARY_PROTECT
+        stk->left_canary  = CANARY;
+        stk->right_canary = CANARY;
+#endif /* CANARY_PROTECT */
+
+#ifdef HASH_PROTECT
+$       (stk->hash = hash_sheader(stk);)
+#endif /* HASH_PROTECT */
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_sdump(stk);
+                return nullptr;
+        }
+
+        return stk;
+}
+
+sstack_t *const destruct_sstack(sstack_t *const stk)
+{
+        assert(stk);
+
+        /* Chain is followed while it is consistent only */
+        for (size_t i = 0; stk->top && i < stk->n_segments; i++) {
+                segment_t *prev = stk->top->prev;
+                free_segment(stk, stk->top);
+                stk->top = prev;
+        }
+
+        if (stk->spare)
+                free_segment(stk, stk->spare);
+
+        stk->top        = nullptr;
+        stk->spare      = nullptr;
+        stk->size       = 0;
+        stk->n_segments = 0;
+        stk->alloc      = nullptr;
+
+#ifdef HASH_PROTECT
+        stk->hash       = 0;
+#endif /* HASH_PROTECT */
+
+#ifdef CANARY_PROTECT
+        stk->left_canary  = 0;
+        stk->right_canary = 0;
+#endif /* CANARY_PROTECT */
+
+        return stk;
+}
+
+void push_sstack(sstack_t *const stk, const item_t item, int *const error)
+{
+        assert(stk);
+        int err = 0;
+
+#ifndef UNPROTECT
+$       (err = verify_sstruct(stk);)
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't push to invalid stack\n");
+                goto finally;
+        }
+
+        if (stk->size == stk->n_segments * SEGMENT_SLOTS) {
+$               (segment_t *seg = take_segment(stk);)
+                if (!seg) {
+                        log_err("Invalid segment allocation: %s\n", strerror(errno));
+                        err = STK_BAD_ALLOC;
+                        goto finally;
+                }
+
+                seg->prev  = stk->top;
+                seg->index = stk->n_segments++;
+                stk->top   = seg;
+        }
+
+        set_slot(stk->top, stk->size % SEGMENT_SLOTS, item);
+        stk->size++;
+
+#ifdef HASH_PROTECT
+$       (stk->hash = hash_sheader(stk);)
+#endif /* HASH_PROTECT */
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_sdump(stk);
+        }
+}
+
+item_t pop_sstack(sstack_t *const stk, int *const error)
+{
+        assert(stk);
+        int err = 0;
+
+        item_t item = POISON;
+        size_t slot = 0;
+
+#ifndef UNPROTECT
+$       (err = verify_sstruct(stk);)
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't pop item from invalid stack\n");
+                goto finally;
+        }
+
+        if (stk->size == 0) {
+                log_err("Can't pop from an empty stack\n");
+                err = STK_EMPTY_POP;
+                goto finally;
+        }
+
+        slot = (stk->size - 1) % SEGMENT_SLOTS;
+        item = stk->top->items[slot];
+
+#ifndef UNPROTECT
+        set_slot(stk->top, slot, POISON);
+#endif /* UNPROTECT */
+        stk->size--;
+
+        if (stk->size == stk->top->index * SEGMENT_SLOTS) {
+                segment_t *seg = stk->top;
+
+                stk->top = seg->prev;
+                stk->n_segments--;
+$               (cache_segment(stk, seg);)
+        }
+
+#ifdef HASH_PROTECT
+$       (stk->hash = hash_sheader(stk);)
+#endif /* HASH_PROTECT */
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_sdump(stk);
+        }
+
+        return item;
+}
+
+int verify_sstack(sstack_t *const stk)
+{
+        assert(stk);
+        return verify_sstruct(stk);
+}
+
+int verify_sstack_full(sstack_t *const stk)
+{
+        assert(stk);
+        int vrf = verify_sstruct(stk);
+
+        /* Chain can be broken, so it is not followed beyond n_segments */
+        const segment_t *seg = vrf ? nullptr : stk->top;
+        size_t expected = stk->n_segments;
+
+        for (; seg && expected; seg = seg->prev) {
+                expected--;
+
+                if (seg->index != expected) {
+                        vrf |= INVALID_ITEMS;
+                        break;
+                }
+
+                vrf |= verify_seg(seg);
+
+#ifdef HASH_PROTECT
+                if (seg->digest != hash_segment(seg))
+                        vrf |= INVALID_HASH;
+#endif /* HASH_PROTECT */
+        }
+
+        if (!vrf && (seg || expected))
+                vrf |= INVALID_ITEMS;
+
+        if (vrf) {
+                log_err("Stack verification failed\n");
+                log_sdump(stk);
+        }
+
+        return vrf;
+}
+
+/**
+ * @brief Verifies segmented stack structure
+ *
+ * Only the top and spare segments are checked, so it is O(1).
+ */
+static int verify_sstruct(sstack_t *const stk)
+{
+        assert(stk);
+        int vrf = 0x00000000;
+
+        if (stk->top) {
+                if (stk->n_segments != stk->top->index + 1 ||
+                    stk->size <= stk->top->index * SEGMENT_SLOTS ||
+                    stk->size >  stk->n_segments * SEGMENT_SLOTS)
+                        vrf |= INVALID_SIZE;
+
+                vrf |= verify_seg(stk->top);
+        } else if (stk->size || stk->n_segments) {
+                vrf |= INVALID_SIZE;
+        }
+
+        if (stk->spare)
+                vrf |= verify_seg(stk->spare);
+
+#ifdef CANARY_PROTECT
+        if (stk->left_canary  != CANARY)
+                vrf |= INVALID_STK_LCNRY;
+
+        if (stk->right_canary != CANARY)
+                vrf |= INVALID_STK_RCNRY;
+#endif /* CANARY_PROTECT */
+
+#ifdef HASH_PROTECT
+        if (stk->hash != hash_sheader(stk))
+                vrf |= INVALID_HASH;
+#endif /* HASH_PROTECT */
+
+        return vrf;
+}
+
+/**
+ * @brief Verifies segment canaries
+ */
+static int verify_seg(const segment_t *const seg)
+{
+        assert(seg);
+        int vrf = 0x00000000;
+
+#ifdef CANARY_PROTECT
+        canary_t cnry = CANARY ^ (canary_t)seg;
+
+        if (seg->left_canary  != cnry)
+                vrf |= INVALID_DATA_LCNRY;
+
+        if (seg->right_canary != cnry)
+                vrf |= INVALID_DATA_RCNRY;
+#endif /* CANARY_PROTECT */
+
+        return vrf;
+}
+
+static int verify_empty_sstack(const sstack_t *const stk)
+{
+        assert(stk);
+        int vrf = 0x00000000;
+
+        if (stk->top || stk->spare)
+                vrf |= INVALID_ITEMS;
+
+        if (stk->size || stk->n_segments)
+                vrf |= INVALID_SIZE;
+
+#ifdef HASH_PROTECT
+        if (stk->hash)
+                vrf |= INVALID_HASH;
+#endif /* HASH_PROTECT */
+
+#ifdef CANARY_PROTECT
+        if (stk->left_canary)
+                vrf |= INVALID_STK_LCNRY;
+        if (stk->right_canary)
+                vrf |= INVALID_STK_RCNRY;
+#endif /* CANARY_PROTECT */
+
+        return vrf;
+}
+
+/**
+ * @brief Takes empty segment
+ *
+ * Spare segment is used first. New segment is poisoned.
+ *
+ * @return Segment or nullptr in case of an error.
+ */
+static segment_t *take_segment(sstack_t *const stk)
+{
+        assert(stk);
+
+        segment_t *seg = stk->spare;
+        if (seg) {
+                stk->spare = nullptr;
+                return seg;
+        }
+
+        const stack_alloc_t *alloc = sstack_alloc(stk);
+
+$       (seg = (segment_t *)alloc->alloc(alloc->ctx, sizeof(segment_t));)
+        if (!seg)
+                return nullptr;
+
+#ifndef UNPROTECT
+        memset(seg->items, FILL_BYTE, sizeof(seg->items));
+#endif /* UNPROTECT */
+
+        seg->prev  = nullptr;
+        seg->index = 0;
+
+#ifdef HASH_PROTECT
+        seg->digest = hash_segment(seg);
+#endif /* HASH_PROTECT */
+
+#ifdef CANARY_PROTECT
+        seg->left_canary  = CANARY ^ (canary_t)seg;
+        seg->right_canary = CANARY ^ (canary_t)seg;
+#endif /* CANARY_PROTECT */
+
+        return seg;
+}
+
+/**
+ * @brief Caches emptied segment
+ *
+ * Only one segment is kept, older spare one is freed.
+ */
+static void cache_segment(sstack_t *const stk, segment_t *const seg)
+{
+        assert(stk);
+        assert(seg);
+
+        if (stk->spare)
+                free_segment(stk, stk->spare);
+
+        seg->prev  = nullptr;
+        seg->index = 0;
+        stk->spare = seg;
+}
+
+static void free_segment(sstack_t *const stk, segment_t *const seg)
+{
+        assert(stk);
+        assert(seg);
+
+        const stack_alloc_t *alloc = sstack_alloc(stk);
+        alloc->free(alloc->ctx, seg, sizeof(segment_t));
+}
+
+/**
+ * @brief Sets segment slot
+ *
+ * Segment digest is updated, slots are keyed by position in segment.
+ */
+static inline void set_slot(segment_t *const seg, const size_t slot, const item_t item)
+{
+        assert(seg);
+        assert(slot < SEGMENT_SLOTS);
+
+#ifdef HASH_PROTECT
+        seg->digest ^= slot_hash(seg->items + slot, sizeof(item_t), slot, SEED, HASH_KIND) ^
+                       slot_hash(&item,             sizeof(item_t), slot, SEED, HASH_KIND);
+#endif /* HASH_PROTECT */
+
+        seg->items[slot] = item;
+}
+
+#ifdef HASH_PROTECT
+/**
+ * @brief Calculates segmented stack structure hash
+ *
+ * Saved hash itself is not hashed.
+ */
+static hash_t hash_sheader(sstack_t *const stk)
+{
+        assert(stk);
+
+        hash_t hash = stk->hash;
+        stk->hash = 0;
+
+        hash_t stk_hash = block_hash(stk, sizeof(sstack_t), SEED, HASH_KIND);
+
+        stk->hash = hash;
+        return stk_hash;
+}
+
+/**
+ * @brief Calculates segment digest from scratch
+ */
+static inline hash_t hash_segment(const segment_t *const seg)
+{
+        assert(seg);
+        return slots_hash(seg->items, sizeof(item_t), 0, SEGMENT_SLOTS, SEED, HASH_KIND);
+}
+#endif /* HASH_PROTECT */
+
+static inline const stack_alloc_t *sstack_alloc(const sstack_t *const stk)
+{
+        assert(stk);
+        return stk->alloc ? stk->alloc : &LIBC_ALLOC;
+}
+
+static inline item_t get_poison(const int byte)
+{
+        item_t poison = 0;
+        memset((void *)&poison, byte, sizeof(item_t));
+        return poison;
+}
+
+static inline void set_error(int *const error, int value)
+{
+        if (error)
+                *error = value;
+}
+
+void dump_sstack(sstack_t *const stk)
+{
+        assert(stk);
+        int vrf = verify_sstruct(stk);
+        (void)vrf; /* Dump is empty with NOLOG */
+
+        log_buf("----------------------------------------------\n");
+        log_buf(" Segmented stack: %s\n", vrf ? "error" : "ok");
+        log_buf(" Verification:  %x\n", (unsigned)vrf);
+        log_buf(" Size:     %15zu\n", stk->size);
+        log_buf(" Segments: %15zu\n", stk->n_segments);
+        log_buf(" Top segment:   0x%lx\n", (size_t)stk->top);
+        log_buf(" Spare segment: 0x%lx\n", (size_t)stk->spare);
+        log_buf("----------------------------------------------\n");
+
+#ifdef HASH_PROTECT
+        log_buf(" Hash       (hex): %8x\n", hash_sheader(stk));
+        log_buf(" Saved hash (hex): %8x\n", stk->hash);
+        log_buf("----------------------------------------------\n");
+#endif /* HASH_PROTECT */
+
+#ifdef CANARY_PROTECT
+        log_buf(" Left  stack canary(hex) = %lx\n", stk->left_canary);
+        log_buf(" Right stack canary(hex) = %lx\n", stk->right_canary);
+        log_buf("----------------------------------------------\n");
+#endif /* CANARY_PROTECT */
+
+        /* Top segment is dumped only if it is safe to read */
+        if (stk->top && !(vrf & (INVALID_SIZE | INVALID_DATA_LCNRY | INVALID_DATA_RCNRY))) {
+                const segment_t *top = stk->top;
+                size_t used = stk->size - top->index * SEGMENT_SLOTS;
+                size_t from = used > DUMP_WINDOW ? used - DUMP_WINDOW : 0;
+
+#ifdef CANARY_PROTECT
+                log_buf(" Segment %zu canaries(hex) = %lx %lx\n", top->index,
+                        top->left_canary, top->right_canary);
+#endif /* CANARY_PROTECT */
+
+                if (from)
+                        log_buf("| %zu bottom slots are skipped\n", from);
+
+                for (size_t i = from; i < used; i++)
+                        log_buf("| [%zu] = %d\n", top->index * SEGMENT_SLOTS + i, top->items[i]);
+
+                log_buf("----------------------------------------------\n");
+        }
+
+        log_buf("\n\n\n");
+        log_flush();
+}
+
@@ -6,11 +6,17 @@
  */
 
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include "include/stack.h"
+#include "include/audit.h"
 #include "include/log.h"
 #include "include/hash.h"
+#include "include/scan.h"
 #include "include/config.h"
 
 #ifdef UNPROTECT
@@ -18,16 +24,94 @@
 #undef CANARY_PROTECT
 #endif /* UNPROTECT */
 
-static const int FILL_BYTE = 'u';
 static inline const item_t get_poison(const int byte);
 static item_t POISON = get_poison(FILL_BYTE);
 
-static const size_t INIT_CAP       = 8;
-static const size_t CAP_FACTOR     = 2;
+static const size_t MIN_CAP        = 1;
 static const size_t CAP_MAX        = ~(SIZE_MAX >> 1);
 
+static const char     MAP_MAGIC[8] = "STKMAP";
+static const uint32_t MAP_VERSION  = 1;
+
+/**
+ * @brief Mapped stack file header
+ *
+ * Data canaries are keyed by items address, so the address is saved
+ * to check them after the file is mapped to other address.
+ */
+struct map_header_t {
+        char     magic[8];
+        uint32_t version;
+        uint32_t protect;       /**< Protection of the writer (map_protect()) */
+        uint64_t item_size;
+
+        uint64_t size;
+        uint64_t capacity;
+        uint64_t reserved;
+        uint64_t items;         /**< Items address */
+
+        uint64_t init_cap;
+        uint64_t factor;
+        uint64_t max_step;
+        uint64_t shrink_delay;
+        int32_t  shrink;
+        int32_t  poison;
+        int32_t  hash_kind;
+        int32_t  verify;
+        uint64_t verify_period;
+
+        uint64_t left_canary;
+        uint64_t right_canary;
+        uint32_t data_hash;     /**< Items digest              */
+        uint32_t hash;          /**< Header hash (murmur)      */
+};
+
+static_assert(sizeof(map_header_t) <= MAP_HEADER_SIZE, "Map header doesn't fit MAP_HEADER_SIZE");
+
+static const char     SNAP_MAGIC[8] = "STKSNAP";
+static const uint32_t SNAP_VERSION  = 1;
+static const size_t   SNAP_PIECE    = 1 << 30; /**< murmur_hash() takes int length */
+
+static const size_t HEADER_BYTES = offsetof(stack_t, inline_raw); /**< Hashed stack_t bytes */
+
+static const size_t DUMP_HEADER = 1024; /**< JSON dump bytes without slots */
+static const size_t DUMP_SLOT   = 48;   /**< JSON dump bytes per slot      */
+
+/**
+ * @brief Dump buffer
+ */
+struct dump_buf_t {
+        char  *data   = nullptr;
+        size_t len    = 0;
+        size_t cap    = 0;
+        bool   failed = false; /**< Buffer can't be grown */
+};
+
+/**
+ * @brief Stack snapshot header
+ *
+ * It is followed by size raw items.
+ */
+struct snap_header_t {
+        char     magic[8];
+        uint32_t version;
+        uint32_t seed;
+        uint64_t item_size;
+        uint64_t capacity;
+        uint64_t size;
+        uint32_t items_hash;    /**< murmur_hash() of items (see snap_hash()) */
+        uint32_t hash;          /**< murmur_hash() of header */
+};
+
 static inline int expandable(const stack_t *const stk);
-static inline int shrinkable(const stack_t *const stk);
+static inline size_t min_capacity(const stack_t *const stk);
+static inline size_t grown_capacity(const stack_t *const stk, const size_t capacity);
+static inline size_t fit_capacity(const stack_t *const stk, const size_t size);
+static inline size_t shrunk_capacity(const stack_t *const stk, const size_t size);
+static inline size_t pop_capacity(const stack_t *const stk, const size_t size);
+static inline void count_low_pops(stack_t *const stk);
+static void update_fast(stack_t *const stk);
+static inline int verify_params(const stack_params_t *const params);
 
 #ifdef CANARY_PROTECT
 static inline canary_t *left_canary(const void *const items, const size_t capacity);
@@ -36,15 +120,121 @@ static inline canary_t *right_canary(const void *const items, const size_t capac
 
 #ifdef HASH_PROTECT
 static hash_t hash_stack(stack_t *const stk, int seed = SEED);
+static hash_t hash_header(stack_t *const stk, int seed = SEED);
+static inline hash_t hash_items(const stack_t *const stk, const item_t *const items, 
+                                const size_t from, const size_t to, int seed = SEED);
+
+static inline size_t n_chunks(const size_t capacity);
+static inline size_t tree_leaves(const size_t capacity);
+static inline size_t tree_size(const size_t capacity);
+static inline void update_chunk(stack_t *const stk, const size_t chunk, const hash_t delta);
+static void build_tree(stack_t *const stk, hash_t *const tree, 
+                       const item_t *const items, const size_t capacity);
+static int verify_chunks(stack_t *const stk, const size_t from, size_t to);
+static void clean_chunks(stack_t *const stk);
+static void rehash_chunks(stack_t *const stk, const size_t from, const size_t to);
+static inline bool has_prot(const stack_t *const stk);
 #endif /* HASH_PROTECT */
 
+#if defined(HASH_PROTECT) && defined(SIDE_META)
+static int open_prot(stack_t *const stk);
+static void close_prot(stack_t *const stk);
+#endif /* HASH_PROTECT && SIDE_META */
+
+static inline void set_item(stack_t *const stk, const size_t index, const item_t item);
+static inline void set_items(stack_t *const stk, const size_t index, 
+                             const item_t *const items, const size_t n);
+
 static inline const char *const indicate_err(int condition);
 static inline void set_error(int *const error, int value);
 
-static item_t *realloc_stack(const stack_t *const stk, const size_t capacity);
+static inline void *raw_items(const item_t *const items);
+static inline size_t raw_size(const size_t capacity);
+static inline const stack_alloc_t *stack_alloc(const stack_t *const stk);
+static inline const stack_alloc_t *meta_alloc(const stack_t *const stk);
+static item_t *realloc_stack(stack_t *const stk, const size_t capacity);
+static inline bool fits_inline(const stack_t *const stk, const size_t capacity);
+static inline bool is_inline(const stack_t *const stk);
+
+static inline uint32_t map_protect();
+static hash_t hash_map_header(map_header_t *const header);
+static void write_map_header(stack_t *const stk, map_header_t *const header);
+static void close_map_header(stack_t *const stk);
+static int read_map_header(stack_t *const stk, map_header_t *const header,
+                           const stack_alloc_t *const alloc);
+
+static hash_t snap_hash(const void *const data, const size_t size, hash_t seed);
+static int write_all(const int fd, struct iovec *iov, int n_iov);
+static int read_all(const int fd, void *const buf, const size_t size);
+
+static inline size_t dump_from(const stack_t *const stk, const size_t window);
+static inline size_t poison_run(const stack_t *const stk, const size_t from);
+static void buf_printf(dump_buf_t *const buf, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
 
 static int verify_stack(stack_t *const stk);
+static int verify_checkpoint(stack_t *const stk, const bool deep);
+static int verify_unused(const stack_t *const stk);
+static int verify_struct(stack_t *const stk);
+static int verify_dirty(stack_t *const stk);
 static int verify_empty_stack(const stack_t *const stk);
+static int check_stack(stack_t *const stk);
+static int check_policy(stack_t *const stk);
+
+/*
+ * Stats hooks. They cost a null check if stats are disabled 
+ * and nothing if stack is compiled without STACK_STATS.
+ */
+#ifdef STACK_STATS
+#define stats_add(_stk, _field, _n)                                        \
+        do {                                                               \
+                if ((_stk)->stats)                                         \
+                        (_stk)->stats->_field += (_n);                     \
+        } while (0)
+
+#define stats_peak(_stk, _field, _value)                                   \
+        do {                                                               \
+                if ((_stk)->stats && (_stk)->stats->_field < (_value))     \
+                        (_stk)->stats->_field = (_value);                  \
+        } while (0)
+
+#define stats_start(_stk, _start)                                          \
+        uint64_t _start = (_stk)->stats ? stats_clock() : 0
+
+#define stats_time(_stk, _field, _start)                                   \
+        stats_add(_stk, _field, stats_clock() - (_start))
+
+#define stats_latency(_stk, _hist, _start)                                 \
+        do {                                                               \
+                if ((_stk)->stats)                                         \
+                        hist_record(&(_stk)->stats->_hist,                 \
+                                    stats_clock() - (_start));             \
+        } while (0)
+
+#define stats_fails(_stk, _vrf)                                            \
+        do {                                                               \
+                if ((_stk)->stats)                                         \
+                        for (size_t _bit = 0; _bit < INVALID_BITS; _bit++) \
+                                if ((_vrf) & (1 << _bit))                  \
+                                        (_stk)->stats->verify_fails[_bit]++; \
+        } while (0)
+#else
+#define stats_add(_stk, _field, _n)        do {} while (0)
+#define stats_peak(_stk, _field, _value)   do {} while (0)
+#define stats_start(_stk, _start)          do {} while (0)
+#define stats_time(_stk, _field, _start)   do {} while (0)
+#define stats_latency(_stk, _hist, _start) do {} while (0)
+#define stats_fails(_stk, _vrf)            do {} while (0)
+#endif /* STACK_STATS */
+
+/*
+ * Hash protection fields. They are kept in stack_t or,
+ * with SIDE_META, in its side record.
+ */
+#if defined(HASH_PROTECT) && defined(SIDE_META)
+#define prot(_stk) ((_stk)->prot)
+#else
+#define prot(_stk) (_stk)
+#endif /* HASH_PROTECT && SIDE_META */
 
 /**
  * @brief Calculates stack hash
@@ -52,65 +242,496 @@ static int verify_empty_stack(const stack_t *const stk);
  * @param stk  Stack
  * @param seed Hash algorithm seed
  *
- * Calculates hash using murmur2 hash algorithm. 
- * Uses stack's location in memory and check every byte. 
+ * Calculates hash using stack hash kernel (murmur2 by default). 
+ * Uses stack's location in memory and check every header byte. 
+ * Items digest is recalculated from scratch, so it is O(capacity).
  */
 #ifdef HASH_PROTECT
 static hash_t hash_stack(stack_t *const stk, int seed)
 {
         assert(stk);
 
-        hash_t hash = stk->hash;
-        stk->hash = 0;
+        hash_t data_hash = prot(stk)->data_hash;
+        prot(stk)->data_hash = hash_items(stk, stk->items, 0, stk->capacity, seed);
+
+        hash_t stk_hash = hash_header(stk, seed);
+
+        prot(stk)->data_hash = data_hash;
+        return stk_hash;
+}
+#endif /* HASH_PROTECT */
+
+/**
+ * @brief Calculates stack structure hash
+ *
+ * @param stk  Stack
+ * @param seed Hash algorithm seed
+ *
+ * Items are covered by saved items digest, so it is O(1).
+ * Inline items block is left out for the same reason, canaries are checked as is.
+ * Saved hash itself is not hashed, side record is chained to the header hash.
+ */
+#ifdef HASH_PROTECT
+static hash_t hash_header(stack_t *const stk, int seed)
+{
+        assert(stk);
+
+        hash_t hash = prot(stk)->hash;
+        prot(stk)->hash = 0;
+
+        hash_t stk_hash = block_hash(stk, HEADER_BYTES, seed, stk->params.hash_kind);
+
+#ifdef SIDE_META
+        stk_hash = block_hash(stk->prot, sizeof(stack_prot_t), stk_hash, stk->params.hash_kind);
+#endif /* SIDE_META */
+
+        prot(stk)->hash = hash;
+        return stk_hash;
+}
+#endif /* HASH_PROTECT */
+
+#ifdef HASH_PROTECT
+static inline hash_t hash_items(const stack_t *const stk, const item_t *const items, 
+                                const size_t from, const size_t to, int seed)
+{
+        return slots_hash(items, sizeof(item_t), from, to, seed, stk->params.hash_kind);
+}
+#endif /* HASH_PROTECT */
+
+/**
+ * @brief Chunk tree
+ *
+ * Items are split into chunks of CHUNK_SLOTS slots. Chunk digest is a XOR 
+ * of its slot hashes. Digests are leaves of a binary tree, each node is 
+ * a XOR of its children, so the root is equal to items digest.
+ * Tree is an array: root is tree[1], children of tree[i] are tree[2i] 
+ * and tree[2i + 1], leaves start at tree[tree_leaves()].
+ *
+ * Chunks changed since the last successful verification are dirty.
+ * Only dirty chunks are rehashed by VERIFY_DIRTY verification.
+ */
+#ifdef HASH_PROTECT
+static inline size_t n_chunks(const size_t capacity)
+{
+        return (capacity + CHUNK_SLOTS - 1) / CHUNK_SLOTS;
+}
+
+static inline size_t tree_leaves(const size_t capacity)
+{
+        size_t leaves = 1;
+        while (leaves < n_chunks(capacity))
+                leaves *= 2;
+
+        return leaves;
+}
+
+static inline size_t tree_size(const size_t capacity)
+{
+        return 2 * tree_leaves(capacity) * sizeof(hash_t);
+}
+
+/**
+ * @brief Updates chunk digest
+ *
+ * @param stk   Stack
+ * @param chunk Chunk index
+ * @param delta XOR of old and new digests
+ *
+ * Chunk becomes dirty. It is O(log(capacity)).
+ */
+static inline void update_chunk(stack_t *const stk, const size_t chunk, const hash_t delta)
+{
+        assert(stk);
+
+        if (prot(stk)->dirty_from >= prot(stk)->dirty_to) {
+                prot(stk)->dirty_from = chunk;
+                prot(stk)->dirty_to   = chunk + 1;
+        } else if (chunk < prot(stk)->dirty_from) {
+                prot(stk)->dirty_from = chunk;
+        } else if (chunk >= prot(stk)->dirty_to) {
+                prot(stk)->dirty_to   = chunk + 1;
+        }
+
+        if (!prot(stk)->chunk_tree || !delta)
+                return;
+
+        for (size_t node = tree_leaves(stk->capacity) + chunk; node; node /= 2)
+                prot(stk)->chunk_tree[node] ^= delta;
+}
+
+/**
+ * @brief Builds chunk tree for the reallocated items
+ *
+ * @param stk      Stack with the old tree and capacity
+ * @param tree     New tree
+ * @param items    Reallocated items
+ * @param capacity New capacity
+ *
+ * Digests of chunks that are full in both old and new buffers are reused,
+ * other chunks are rehashed.
+ */
+static void build_tree(stack_t *const stk, hash_t *const tree, 
+                       const item_t *const items, const size_t capacity)
+{
+        assert(stk);
+        assert(tree);
+
+        const size_t leaves     = tree_leaves(capacity);
+        const size_t old_leaves = tree_leaves(stk->capacity);
+
+        size_t kept = (capacity < stk->capacity ? capacity : stk->capacity) / CHUNK_SLOTS;
+        if (!prot(stk)->chunk_tree)
+                kept = 0;
+
+        memset(tree, 0, tree_size(capacity));
+
+        for (size_t chunk = 0; chunk < n_chunks(capacity); chunk++) {
+                if (chunk < kept) {
+                        tree[leaves + chunk] = prot(stk)->chunk_tree[old_leaves + chunk];
+                        continue;
+                }
+
+                size_t to = (chunk + 1) * CHUNK_SLOTS;
+                if (to > capacity)
+                        to = capacity;
+
+                tree[leaves + chunk] = hash_items(stk, items, chunk * CHUNK_SLOTS, to);
+        }
+
+        for (size_t node = leaves - 1; node > 0; node--)
+                tree[node] = tree[2 * node] ^ tree[2 * node + 1];
+
+        if (prot(stk)->dirty_to > n_chunks(capacity))
+                prot(stk)->dirty_to = n_chunks(capacity);
+}
+
+/**
+ * @brief Verifies chunks
+ *
+ * @param stk  Stack
+ * @param from First chunk
+ * @param to   Chunk after the last one
+ *
+ * Chunks are rehashed and compared with tree leaves, then paths 
+ * from leaves to the root are checked. If all chunks are verified
+ * every node is checked once.
+ * 
+ * @return 0 or INVALID_HASH
+ */
+static int verify_chunks(stack_t *const stk, const size_t from, size_t to)
+{
+        assert(stk);
+
+        if (!stk->items)
+                return 0;
+
+        if (!prot(stk)->chunk_tree)
+                return INVALID_HASH;
+
+        const hash_t *tree  = prot(stk)->chunk_tree;
+        const size_t leaves = tree_leaves(stk->capacity);
+
+        if (to > n_chunks(stk->capacity))
+                to = n_chunks(stk->capacity);
+
+        if (tree[1] != prot(stk)->data_hash)
+                return INVALID_HASH;
+
+        for (size_t chunk = from; chunk < to; chunk++) {
+                size_t last = (chunk + 1) * CHUNK_SLOTS;
+                if (last > stk->capacity)
+                        last = stk->capacity;
+
+                if (tree[leaves + chunk] != hash_items(stk, stk->items, chunk * CHUNK_SLOTS, last))
+                        return INVALID_HASH;
+        }
+
+        if (from == 0 && to == n_chunks(stk->capacity)) {
+                for (size_t node = 1; node < leaves; node++)
+                        if (tree[node] != (tree[2 * node] ^ tree[2 * node + 1]))
+                                return INVALID_HASH;
+
+                for (size_t chunk = to; chunk < leaves; chunk++)
+                        if (tree[leaves + chunk])
+                                return INVALID_HASH;
+
+                return 0;
+        }
+
+        for (size_t chunk = from; chunk < to; chunk++) {
+                for (size_t node = (leaves + chunk) / 2; node; node /= 2)
+                        if (tree[node] != (tree[2 * node] ^ tree[2 * node + 1]))
+                                return INVALID_HASH;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Marks all chunks verified
+ *
+ * Stack must be verified before.
+ */
+static void clean_chunks(stack_t *const stk)
+{
+        assert(stk);
+
+        if (prot(stk)->dirty_from >= prot(stk)->dirty_to)
+                return;
+
+        prot(stk)->dirty_from = 0;
+        prot(stk)->dirty_to   = 0;
+
+        prot(stk)->hash = hash_header(stk);
+}
+
+/**
+ * @brief Rehashes slots written directly to the buffer
+ *
+ * @param stk  Stack
+ * @param from First slot
+ * @param to   Slot after the last one
+ *
+ * Chunks covering the slots are rehashed and compared with tree leaves,
+ * items digest and chunk tree are corrected by the difference.
+ */
+static void rehash_chunks(stack_t *const stk, const size_t from, const size_t to)
+{
+        assert(stk);
+        assert(prot(stk)->chunk_tree);
+
+        const size_t leaves = tree_leaves(stk->capacity);
+
+        for (size_t chunk = from / CHUNK_SLOTS; chunk * CHUNK_SLOTS < to; chunk++) {
+                size_t last = (chunk + 1) * CHUNK_SLOTS;
+                if (last > stk->capacity)
+                        last = stk->capacity;
+
+                hash_t delta = prot(stk)->chunk_tree[leaves + chunk] ^
+                               hash_items(stk, stk->items, chunk * CHUNK_SLOTS, last);
+
+                prot(stk)->data_hash ^= delta;
+                update_chunk(stk, chunk, delta);
+        }
+}
+#endif /* HASH_PROTECT */
+
+/**
+ * @brief Writes item to stack slot
+ *
+ * @param stk   Stack
+ * @param index Slot index
+ * @param item  Item to write
+ *
+ * Items digest is updated in O(1) and chunk tree in O(log(capacity)) 
+ * if hash protection defined.
+ */
+static inline void set_item(stack_t *const stk, const size_t index, const item_t item)
+{
+        assert(stk);
+        assert(index < stk->capacity);
+
+#ifdef HASH_PROTECT
+        const int kind = stk->params.hash_kind;
+        hash_t delta = slot_hash(stk->items + index, sizeof(item_t), index, SEED, kind) ^
+                       slot_hash(&item,              sizeof(item_t), index, SEED, kind);
 
-        hash_t stk_hash  = murmur_hash(stk, sizeof(stack_t), seed);
-        hash_t data_hash = murmur_hash(stk->items, stk->capacity * sizeof(item_t), seed);
+        prot(stk)->data_hash ^= delta;
+        update_chunk(stk, index / CHUNK_SLOTS, delta);
+#endif /* HASH_PROTECT */
 
-        stk->hash = hash;
-        return stk_hash ^ data_hash;
+        stk->items[index] = item;
 }
+
+/**
+ * @brief Writes items to stack slots
+ *
+ * @param stk   Stack
+ * @param index First slot index
+ * @param items Items to write (nullptr to poison slots)
+ * @param n     Number of items
+ *
+ * Items digest and chunk tree are updated once per chunk.
+ */
+static inline void set_items(stack_t *const stk, const size_t index, 
+                             const item_t *const items, const size_t n)
+{
+        assert(stk);
+        assert(index + n <= stk->capacity);
+
+        size_t from = index;
+        while (from < index + n) {
+                size_t to = (from / CHUNK_SLOTS + 1) * CHUNK_SLOTS;
+                if (to > index + n)
+                        to = index + n;
+
+#ifdef HASH_PROTECT
+                hash_t delta = hash_items(stk, stk->items, from, to);
+#endif /* HASH_PROTECT */
+
+                if (items)
+                        memcpy(stk->items + from, items + (from - index), (to - from) * sizeof(item_t));
+                else
+                        memset(stk->items + from, FILL_BYTE, (to - from) * sizeof(item_t));
+
+#ifdef HASH_PROTECT
+                delta ^= hash_items(stk, stk->items, from, to);
+
+                prot(stk)->data_hash ^= delta;
+                update_chunk(stk, from / CHUNK_SLOTS, delta);
 #endif /* HASH_PROTECT */
 
+                from = to;
+        }
+}
+
 /**
  * @brief Reallocates stack memory 
  *
- * @param stk Stack to reallocate
- * @param stk Stack's new capacity
+ * @param stk      Stack to reallocate
+ * @param capacity Stack's new capacity
  *
- * It is ANSI realloc() function wrapper. 
+ * It is stack allocator realloc() wrapper (libc by default). 
  * It allocates additional memory and repositions canaries 
- * if canary protection defined.
+ * if canary protection defined. Items digest is corrected
+ * for the slots added or removed and chunk tree is rebuilt.
+ * Only added slots are poisoned and only in eager poison mode.
+ *
+ * Up to INLINE_CAP items are kept in the inline block (if it is 
+ * enabled by params), items are copied when they move between 
+ * inline block and allocated one.
+ * In case of an error, nothing happens to the stack.
  */
-static item_t *realloc_stack(const stack_t *const stk, const size_t capacity)
+static item_t *realloc_stack(stack_t *const stk, const size_t capacity)
 {
         assert(stk);
-        size_t cap = capacity * sizeof(item_t);
+        const stack_alloc_t *alloc = stack_alloc(stk);
+
+        const bool to_inline   = fits_inline(stk, capacity);
+        const bool from_inline = is_inline(stk);
+
+#ifdef HASH_PROTECT
+        const stack_alloc_t *meta = meta_alloc(stk);
+
+        hash_t removed = 0;
+        if (capacity < stk->capacity)
+                removed = hash_items(stk, stk->items, capacity, stk->capacity);
+
+        /* Old tree can be the inline one, so new inline tree is built aside */
+        hash_t inline_tree[2] = {};
+        hash_t *tree = inline_tree;
+
+        if (!to_inline) {
+$               (tree = (hash_t *)meta->alloc(meta->ctx, tree_size(capacity));)
+                if (!tree) {
+                        log_err("Invalid chunk tree allocation: %s\n", strerror(errno));
+                        return nullptr;
+                }
+        }
+#endif /* HASH_PROTECT */
+
+        char *raw = (char *)raw_items(stk->items);
+        if (to_inline) {
+                raw = stk->inline_raw;
+        } else if (raw && !from_inline) {
+$               (raw = (char *)alloc->realloc(alloc->ctx, raw, raw_size(stk->capacity), 
+                                              raw_size(capacity));)
+
+                if (raw && raw != raw_items(stk->items)) {
+                        stats_add(stk, bytes_copied, 
+                                  raw_size(capacity < stk->capacity ? capacity : stk->capacity));
+                }
+        } else {
+$               (raw = (char *)alloc->alloc(alloc->ctx, raw_size(capacity));)
+        }
+
+        if (!raw) {
+                log_err("Invalid stack reallocation: %s\n", strerror(errno));
+#ifdef HASH_PROTECT
+                meta->free(meta->ctx, tree, tree_size(capacity));
+#endif /* HASH_PROTECT */
+                return nullptr;
+        }
 
+        /* Guard page faults are mapped back to the stack */
+        if (!to_inline)
+                set_guard_owner(alloc, raw, stk);
+
+        item_t *items = (item_t *)raw;
 #ifdef CANARY_PROTECT
-        cap += sizeof(void *) - cap % sizeof(void *) + 2 * sizeof(canary_t);
+        items = (item_t *)(raw + sizeof(canary_t));
 #endif
 
-        item_t *items = stk->items;
-$       (items  = (item_t *)realloc(items, cap);)
+        if (stk->items && to_inline != from_inline) {
+                size_t moved = capacity < stk->capacity ? capacity : stk->capacity;
 
-        if (!items) {
-                log("Invalid stack reallocation: %s\n", strerror(errno));
-                return nullptr;
+$               (memcpy(items, stk->items, moved * sizeof(item_t));)
+                stats_add(stk, bytes_copied, moved * sizeof(item_t));
+
+                if (!from_inline)
+                        alloc->free(alloc->ctx, raw_items(stk->items), raw_size(stk->capacity));
         }
 
-$       (memset(items + stk->size, FILL_BYTE, cap - stk->size * sizeof(item_t));)
+        if (capacity > stk->capacity && stk->params.poison == POISON_EAGER) {
+$               (memset(items + stk->capacity, FILL_BYTE, 
+                        (capacity - stk->capacity) * sizeof(item_t));)
+        }
 
 #ifdef CANARY_PROTECT
         *right_canary(items, capacity) = CANARY ^ (size_t)items;
         *left_canary (items, capacity) = CANARY ^ (size_t)items;
 #endif
 
+#ifdef HASH_PROTECT
+        if (capacity > stk->capacity)
+                prot(stk)->data_hash ^= hash_items(stk, items, stk->capacity, capacity);
+        else
+                prot(stk)->data_hash ^= removed;
+
+        build_tree(stk, tree, items, capacity);
+
+        if (prot(stk)->chunk_tree && prot(stk)->chunk_tree != stk->inline_tree)
+                meta->free(meta->ctx, prot(stk)->chunk_tree, tree_size(stk->capacity));
+
+        if (to_inline) {
+                memcpy(stk->inline_tree, inline_tree, sizeof(inline_tree));
+                tree = stk->inline_tree;
+        }
+        prot(stk)->chunk_tree = tree;
+#endif /* HASH_PROTECT */
+
+        if (stk->items) {
+                stats_add(stk, grows,   capacity > stk->capacity);
+                stats_add(stk, shrinks, capacity < stk->capacity);
+        }
+        stats_peak(stk, peak_capacity, capacity);
+
+        stk->items    = items;
+        stk->capacity = capacity;
+        update_fast(stk);
+
+        /* Mapped file is resized, so its header follows the new layout */
+        map_header_t *header = (map_header_t *)map_header(alloc);
+        if (header)
+                write_map_header(stk, header);
+
         return items;
 }
 
 stack_t *const construct_stack(stack_t *const stk, int *const error)
 {
         assert(stk);
+
+        stack_params_t params = {};
+        return construct_stack(stk, &params, error);
+}
+
+stack_t *const construct_stack(stack_t *const stk, const stack_params_t *const params, 
+                               int *const error)
+{
+        assert(stk);
+        assert(params);
+
         item_t *items = nullptr;
         int err = 0;
 
@@ -119,19 +740,40 @@ $       (err = verify_empty_stack(stk);)
 #endif  /* UNPROTECT */
 
         if (err) {
-                log("Can't construct (stack is not empty)\n");
+                log_err("Can't construct (stack is not empty)\n");
+                goto finally;
+        }
+
+        if (verify_params(params)) {
+                log_err("Invalid stack parameters: init_cap = %zu, factor = %zu, "
+                        "shrink = %d, poison = %d, hash = %d\n", params->init_cap, params->factor, 
+                        params->shrink, params->poison, params->hash_kind);
+                err = STK_INVALID;
+                goto finally;
+        }
+
+        stk->params   = *params;
+        stk->reserved = 0;
+
+#if defined(HASH_PROTECT) && defined(SIDE_META)
+        err = open_prot(stk);
+        if (err) {
+                log_err("Invalid protection record allocation\n");
                 goto finally;
         }
+#endif /* HASH_PROTECT && SIDE_META */
 
-        items = realloc_stack(stk, INIT_CAP);
+        items = realloc_stack(stk, params->init_cap);
         if (!items) {
-                log("Invalid stack memory allocation\n");
+                log_err("Invalid stack memory allocation\n");
                 err = STK_BAD_ALLOC;
+
+#if defined(HASH_PROTECT) && defined(SIDE_META)
+                close_prot(stk);
+#endif /* HASH_PROTECT && SIDE_META */
                 goto finally;
         }
 
-        stk->capacity = INIT_CAP;
-        stk->items    = (item_t *)items;
         stk->size     = 0;
 
 #ifdef CANARY_PROTECT
@@ -140,11 +782,11 @@ $       (err = verify_empty_stack(stk);)
 #endif /* CANARY_PROTECT */
 
 #ifdef HASH_PROTECT
-$       (stk->hash = hash_stack(stk);)
+$       (prot(stk)->hash = hash_header(stk);)
 #endif /* HASH_PROTECT */
 
 #ifndef UNPROTECT
-$       (err = verify_stack(stk);)
+$       (err = check_stack(stk);)
 #endif /* UNPROTECT */
 
 finally:
@@ -160,43 +802,47 @@ finally:
 void push_stack(stack_t *const stk, const item_t item, int *const error) 
 {
         assert(stk);
+        audit_scope(stk);
         int err = 0;
+        stats_start(stk, start);
 
 #ifndef UNPROTECT
-$       (err = verify_stack(stk);)
+$       (err = check_stack(stk);)
 #endif /* UNPROTECT */
 
         if (err) {
-                log("Can't push to invalid stack\n");
+                log_err("Can't push to invalid stack\n");
                 goto finally;
         }
 
         if (expandable(stk)) {
-                size_t capacity = stk->capacity;
-                capacity *= CAP_FACTOR;
+                size_t capacity = grown_capacity(stk, stk->capacity);
 
 $               (void *items = realloc_stack(stk, capacity);)
                 if (!items) {
-                        log("Invalid stack expanding: %s\n", strerror(errno));
+                        log_err("Invalid stack expanding: %s\n", strerror(errno));
                         err = STK_BAD_ALLOC;
                         goto finally;
                 }
-
-                stk->capacity = capacity;
-                stk->items    = (item_t *)items;
         }
 
-        stk->items[stk->size++] = item;
+        set_item(stk, stk->size++, item);
+        stk->ops++;
+
+        stats_add (stk, pushes, 1);
+        stats_peak(stk, peak_size, stk->size);
 
 #ifdef HASH_PROTECT
-$       (stk->hash = hash_stack(stk);)
+$       (prot(stk)->hash = hash_header(stk);)
 #endif /* HASH_PROTECT */
 
 #ifndef UNPROTECT
-$       (err = verify_stack(stk);)
+$       (err = check_stack(stk);)
 #endif /* UNPROTECT */
 
 finally:
+        stats_latency(stk, push_time, start);
+
         if (err) {
                 set_error(error, err);
                 log_dump(stk);
@@ -206,52 +852,58 @@ finally:
 item_t pop_stack(stack_t *const stk, int *const error)
 {
         assert(stk);
+        audit_scope(stk);
         int err = 0;
+        stats_start(stk, start);
 
         size_t item = POISON;
 
 #ifndef UNPROTECT
-$       (err = verify_stack(stk);)
+$       (err = check_stack(stk);)
 #endif /* UNPROTECT */
 
         if (err) {
-                log("Can't pop item from invalid stack\n");
+                log_err("Can't pop item from invalid stack\n");
                 goto finally;
         }
 
         if (stk->size == 0) {
-                log("Can't pop from an empty stack\n");
+                log_err("Can't pop from an empty stack\n");
+                stats_add(stk, empty_pops, 1);
                 err = STK_EMPTY_POP;
                 goto finally;
         }
 
-        if (shrinkable(stk)) {
-                size_t capacity = stk->capacity;
-                capacity /= CAP_FACTOR;
+        if (pop_capacity(stk, stk->size - 1) < stk->capacity) {
+                size_t capacity = pop_capacity(stk, stk->size - 1);
 
 $               (void *items = realloc_stack(stk, capacity);)
                 if (!items) {
-                        log("Invalid stack shrinking: %s\n", strerror(errno));
+                        log_err("Invalid stack shrinking: %s\n", strerror(errno));
                         err = STK_BAD_ALLOC;
                         goto finally;
                 }
-
-                stk->items = (item_t *)items;
-                stk->capacity = capacity;
         }
 
         item = stk->items[--stk->size];
-        stk->items[stk->size] = POISON;
+        if (stk->params.poison != POISON_NONE)
+                set_item(stk, stk->size, POISON);
+        count_low_pops(stk);
+        stk->ops++;
+
+        stats_add(stk, pops, 1);
 
 #ifdef HASH_PROTECT
-$       (stk->hash = hash_stack(stk);)
+$       (prot(stk)->hash = hash_header(stk);)
 #endif /* HASH_PROTECT */
 
 #ifndef UNPROTECT
-$       (err = verify_stack(stk);)
+$       (err = check_stack(stk);)
 #endif /* UNPROTECT */
 
 finally:
+        stats_latency(stk, pop_time, start);
+
         if (err) {
                 set_error(error, err);
                 log_dump(stk);
@@ -260,33 +912,1060 @@ finally:
         return item;
 }
 
-stack_t *const destruct_stack(stack_t *const stk) 
+void push_stack_n(stack_t *const stk, const item_t *const items, const size_t n, 
+                  int *const error)
 {
         assert(stk);
+        assert(items || n == 0);
+        audit_scope(stk);
+        int err = 0;
 
-        if (stk->items)
-                free(stk->items);
-        stk->items        = nullptr;
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
 
-        stk->capacity     = 0;
-        stk->size         = 0;
+        if (err) {
+                log_err("Can't push to invalid stack\n");
+                goto finally;
+        }
 
-#ifdef HASH_PROTECT
-        stk->hash         = 0;
-#endif /* HASH_PROTECT */
+        if (n > CAP_MAX - stk->size) {
+                log_err("Can't push %zu items (stack overflow)\n", n);
+                err = STK_OVERFLOW;
+                goto finally;
+        }
 
-#ifdef CANARY_PROTECT
-        stk->left_canary  = 0;
-        stk->right_canary = 0;
-#endif /* CANARY_PROTECT */
+        if (stk->size + n > stk->capacity) {
+                size_t capacity = fit_capacity(stk, stk->size + n);
 
-        return stk;
-}
+$               (void *new_items = realloc_stack(stk, capacity);)
+                if (!new_items) {
+                        log_err("Invalid stack expanding: %s\n", strerror(errno));
+                        err = STK_BAD_ALLOC;
+                        goto finally;
+                }
+        }
 
-static int verify_empty_stack(const stack_t *const stk)
-{
-        assert(stk);
-        int vrf = 0x00000000;
+        set_items(stk, stk->size, items, n);
+        stk->size += n;
+        stk->ops++;
+
+        stats_add (stk, pushes, n);
+        stats_peak(stk, peak_size, stk->size);
+
+#ifdef HASH_PROTECT
+$       (prot(stk)->hash = hash_header(stk);)
+#endif /* HASH_PROTECT */
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_dump(stk);
+        }
+}
+
+void pop_stack_n(stack_t *const stk, item_t *const items, const size_t n, 
+                 int *const error)
+{
+        assert(stk);
+        assert(items || n == 0);
+        audit_scope(stk);
+        int err = 0;
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't pop items from invalid stack\n");
+                goto finally;
+        }
+
+        if (n > stk->size) {
+                log_err("Can't pop %zu items from stack of size %zu\n", n, stk->size);
+                stats_add(stk, empty_pops, 1);
+                err = STK_EMPTY_POP;
+                goto finally;
+        }
+
+        memcpy(items, stk->items + stk->size - n, n * sizeof(item_t));
+
+        stk->size -= n;
+        if (stk->params.poison != POISON_NONE)
+                set_items(stk, stk->size, nullptr, n);
+        stk->ops++;
+
+        stats_add(stk, pops, n);
+
+        if (pop_capacity(stk, stk->size) < stk->capacity) {
+                size_t capacity = pop_capacity(stk, stk->size);
+
+$               (void *new_items = realloc_stack(stk, capacity);)
+                if (!new_items) {
+                        /* Items are popped already, so stack stays oversized */
+                        log_err("Invalid stack shrinking: %s\n", strerror(errno));
+                }
+        }
+
+        count_low_pops(stk);
+
+#ifdef HASH_PROTECT
+$       (prot(stk)->hash = hash_header(stk);)
+#endif /* HASH_PROTECT */
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_dump(stk);
+        }
+}
+
+void update_stack(stack_t *const stk, item_t *const popped, const size_t n_pop,
+                  const item_t *const items, const size_t n_push, int *const error)
+{
+        assert(stk);
+        assert(popped || n_pop == 0);
+        assert(items  || n_push == 0);
+        audit_scope(stk);
+        int err = 0;
+        size_t size = 0;
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't update invalid stack\n");
+                goto finally;
+        }
+
+        if (n_pop > stk->size) {
+                log_err("Can't pop %zu items from stack of size %zu\n", n_pop, stk->size);
+                stats_add(stk, empty_pops, 1);
+                err = STK_EMPTY_POP;
+                goto finally;
+        }
+
+        size = stk->size - n_pop;
+        if (n_push > CAP_MAX - size) {
+                log_err("Can't push %zu items (stack overflow)\n", n_push);
+                err = STK_OVERFLOW;
+                goto finally;
+        }
+
+        if (size + n_push > stk->capacity) {
+                size_t capacity = fit_capacity(stk, size + n_push);
+
+$               (void *new_items = realloc_stack(stk, capacity);)
+                if (!new_items) {
+                        log_err("Invalid stack expanding: %s\n", strerror(errno));
+                        err = STK_BAD_ALLOC;
+                        goto finally;
+                }
+        }
+
+        memcpy(popped, stk->items + size, n_pop * sizeof(item_t));
+
+        /* Popped slots are overwritten by pushed items, the rest of them is poisoned */
+        set_items(stk, size, items, n_push);
+        if (n_pop > n_push && stk->params.poison != POISON_NONE)
+                set_items(stk, size + n_push, nullptr, n_pop - n_push);
+
+        stk->size = size + n_push;
+        stk->ops++;
+
+        stats_add (stk, pops,   n_pop);
+        stats_add (stk, pushes, n_push);
+        stats_peak(stk, peak_size, stk->size);
+
+        if (pop_capacity(stk, stk->size) < stk->capacity) {
+                size_t capacity = pop_capacity(stk, stk->size);
+
+$               (void *new_items = realloc_stack(stk, capacity);)
+                if (!new_items) {
+                        /* Stack is updated already, so it stays oversized */
+                        log_err("Invalid stack shrinking: %s\n", strerror(errno));
+                }
+        }
+
+        if (n_pop > n_push)
+                count_low_pops(stk);
+
+#ifdef HASH_PROTECT
+$       (prot(stk)->hash = hash_header(stk);)
+#endif /* HASH_PROTECT */
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_dump(stk);
+        }
+}
+
+const item_t *peek_range(stack_t *const stk, const size_t n, int *const error)
+{
+        assert(stk);
+        audit_scope(stk);
+        int err = 0;
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't peek items of invalid stack\n");
+                goto finally;
+        }
+
+        if (n > stk->size) {
+                log_err("Can't peek %zu items of stack of size %zu\n", n, stk->size);
+                err = STK_EMPTY_POP;
+                goto finally;
+        }
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_dump(stk);
+                return nullptr;
+        }
+
+        return stk->items + stk->size - n;
+}
+
+item_t top_stack(stack_t *const stk, int *const error)
+{
+        assert(stk);
+
+        const item_t *top = peek_range(stk, 1, error);
+        return top ? *top : POISON;
+}
+
+void reserve_stack(stack_t *const stk, const size_t capacity, int *const error)
+{
+        assert(stk);
+        audit_scope(stk);
+        int err = 0;
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't reserve memory for invalid stack\n");
+                goto finally;
+        }
+
+        if (capacity > CAP_MAX) {
+                log_err("Can't reserve %zu items (stack overflow)\n", capacity);
+                err = STK_OVERFLOW;
+                goto finally;
+        }
+
+        if (capacity > stk->capacity) {
+$               (void *items = realloc_stack(stk, capacity);)
+                if (!items) {
+                        log_err("Invalid stack reservation: %s\n", strerror(errno));
+                        err = STK_BAD_ALLOC;
+                        goto finally;
+                }
+        }
+
+        stk->reserved = capacity;
+        update_fast(stk);
+
+#ifdef HASH_PROTECT
+$       (prot(stk)->hash = hash_header(stk);)
+#endif /* HASH_PROTECT */
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_dump(stk);
+        }
+}
+
+void shrink_to_fit_stack(stack_t *const stk, int *const error)
+{
+        assert(stk);
+        audit_scope(stk);
+        int err = 0;
+        size_t capacity = 0;
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't shrink invalid stack\n");
+                goto finally;
+        }
+
+        capacity = stk->size > MIN_CAP ? stk->size : MIN_CAP;
+
+        if (capacity < stk->capacity) {
+$               (void *items = realloc_stack(stk, capacity);)
+                if (!items) {
+                        log_err("Invalid stack shrinking: %s\n", strerror(errno));
+                        err = STK_BAD_ALLOC;
+                        goto finally;
+                }
+        }
+
+        stk->reserved = 0;
+        update_fast(stk);
+
+#ifdef HASH_PROTECT
+$       (prot(stk)->hash = hash_header(stk);)
+#endif /* HASH_PROTECT */
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_dump(stk);
+        }
+}
+
+void trim_stack(stack_t *const stk, int *const error)
+{
+        assert(stk);
+        audit_scope(stk);
+        int err = 0;
+        size_t capacity = 0;
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't trim invalid stack\n");
+                goto finally;
+        }
+
+        capacity = shrunk_capacity(stk, stk->size);
+
+        if (capacity < stk->capacity) {
+$               (void *items = realloc_stack(stk, capacity);)
+                if (!items) {
+                        log_err("Invalid stack trimming: %s\n", strerror(errno));
+                        err = STK_BAD_ALLOC;
+                        goto finally;
+                }
+        }
+
+        stk->low_pops = 0;
+
+#ifdef HASH_PROTECT
+$       (prot(stk)->hash = hash_header(stk);)
+#endif /* HASH_PROTECT */
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_dump(stk);
+        }
+}
+
+stack_t *const destruct_stack(stack_t *const stk) 
+{
+        assert(stk);
+
+#ifdef STACK_AUDIT
+        if (stk->audit)
+                unaudit_stack(stk);
+#endif /* STACK_AUDIT */
+
+        close_map_header(stk);
+
+#ifdef STACK_STATS
+        free(stk->stats);
+        stk->stats = nullptr;
+#endif /* STACK_STATS */
+
+#ifdef HASH_PROTECT
+        if (has_prot(stk)) {
+                if (prot(stk)->chunk_tree && prot(stk)->chunk_tree != stk->inline_tree) {
+                        const stack_alloc_t *meta = meta_alloc(stk);
+                        meta->free(meta->ctx, prot(stk)->chunk_tree, tree_size(stk->capacity));
+                }
+                prot(stk)->chunk_tree = nullptr;
+                prot(stk)->dirty_from = 0;
+                prot(stk)->dirty_to   = 0;
+                prot(stk)->data_hash  = 0;
+                prot(stk)->hash       = 0;
+        }
+
+#ifdef SIDE_META
+        close_prot(stk);
+#endif /* SIDE_META */
+#endif /* HASH_PROTECT */
+
+        /* Allocator can be released with the items, so they are freed last */
+        if (stk->items && !is_inline(stk)) {
+                const stack_alloc_t *alloc = stack_alloc(stk);
+                alloc->free(alloc->ctx, raw_items(stk->items), raw_size(stk->capacity));
+        }
+        stk->items        = nullptr;
+
+        stk->capacity     = 0;
+        stk->size         = 0;
+        stk->reserved     = 0;
+        stk->low_pops     = 0;
+        stk->ops          = 0;
+        stk->params       = {};
+        stk->fast_lo      = 0;
+        stk->fast_n       = 0;
+
+#ifdef CANARY_PROTECT
+        stk->left_canary  = 0;
+        stk->right_canary = 0;
+#endif /* CANARY_PROTECT */
+
+        return stk;
+}
+
+stack_t *const construct_mapped_stack(stack_t *const stk, const char *const path,
+                                      const stack_params_t *const params, int *const error)
+{
+        assert(stk);
+        assert(path);
+        assert(params);
+
+        int err = 0;
+        stack_params_t mapped = *params;
+
+        stack_alloc_t *alloc = open_map_alloc(path, true);
+        if (!alloc) {
+                log_err("Can't create stack file %s: %s\n", path, strerror(errno));
+                set_error(error, STK_BAD_FILE);
+                return nullptr;
+        }
+
+        mapped.alloc        = alloc;
+        mapped.inline_items = false;
+        if (!construct_stack(stk, &mapped, &err)) {
+                if (stk->items && stk->params.alloc == alloc)
+                        destruct_stack(stk);
+                else
+                        close_map_alloc(alloc);
+
+                set_error(error, err);
+                return nullptr;
+        }
+
+        sync_stack(stk, &err);
+        if (err) {
+                destruct_stack(stk);
+                set_error(error, err);
+                return nullptr;
+        }
+
+        return stk;
+}
+
+stack_t *const open_mapped_stack(stack_t *const stk, const char *const path, int *const error)
+{
+        assert(stk);
+        assert(path);
+
+        int err = 0;
+        stack_alloc_t *alloc = nullptr;
+        map_header_t *header = nullptr;
+        char *raw = nullptr;
+        bool bad_canaries = false;
+
+#ifndef UNPROTECT
+$       (err = verify_empty_stack(stk);)
+#endif  /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't open (stack is not empty)\n");
+                set_error(error, err);
+                return nullptr;
+        }
+
+        alloc = open_map_alloc(path, false);
+        if (!alloc) {
+                log_err("Can't open stack file %s: %s\n", path, strerror(errno));
+                err = STK_BAD_FILE;
+                goto finally;
+        }
+
+        header = (map_header_t *)map_header(alloc);
+        err = read_map_header(stk, header, alloc);
+        if (err) {
+                log_err("Invalid stack file header: %s\n", path);
+                close_map_alloc(alloc);
+                goto finally;
+        }
+
+$       (raw = (char *)alloc->alloc(alloc->ctx, raw_size(stk->capacity));)
+        if (!raw) {
+                log_err("Can't map stack file %s: %s\n", path, strerror(errno));
+                close_map_alloc(alloc);
+                err = STK_BAD_ALLOC;
+                goto finally;
+        }
+
+        stk->items = (item_t *)raw;
+
+#ifdef CANARY_PROTECT
+        {
+                stk->items = (item_t *)(raw + sizeof(canary_t));
+
+                canary_t saved = CANARY ^ (canary_t)header->items;
+                canary_t cnry  = CANARY ^ (canary_t)stk->items;
+
+                if (*left_canary (stk->items, stk->capacity) != saved ||
+                    *right_canary(stk->items, stk->capacity) != saved) {
+                        log_err("Invalid data canaries in stack file: %s\n", path);
+                        bad_canaries = true;
+                        err = STK_BAD_FILE;
+                        goto finally;
+                }
+
+                *left_canary (stk->items, stk->capacity) = cnry;
+                *right_canary(stk->items, stk->capacity) = cnry;
+        }
+#endif /* CANARY_PROTECT */
+
+#if defined(HASH_PROTECT) && defined(SIDE_META)
+        err = open_prot(stk);
+        if (err) {
+                log_err("Invalid protection record allocation\n");
+                goto finally;
+        }
+#endif /* HASH_PROTECT && SIDE_META */
+
+#ifdef HASH_PROTECT
+        {
+                const stack_alloc_t *meta = meta_alloc(stk);
+
+$               (hash_t *tree = (hash_t *)meta->alloc(meta->ctx, tree_size(stk->capacity));)
+                if (!tree) {
+                        log_err("Invalid chunk tree allocation: %s\n", strerror(errno));
+                        err = STK_BAD_ALLOC;
+                        goto finally;
+                }
+
+                build_tree(stk, tree, stk->items, stk->capacity);
+                prot(stk)->chunk_tree = tree;
+                prot(stk)->data_hash  = header->data_hash;
+                prot(stk)->hash       = hash_header(stk);
+        }
+#endif /* HASH_PROTECT */
+
+#ifndef UNPROTECT
+$       (err = verify_stack(stk);)
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Invalid stack in stack file: %s\n", path);
+                err = STK_BAD_FILE;
+        }
+
+#ifdef HASH_PROTECT
+        if (!err)
+                clean_chunks(stk);
+#endif /* HASH_PROTECT */
+
+        /* Canaries are keyed by the new address, so file is kept valid by new header */
+        if (!err)
+                write_map_header(stk, header);
+
+finally:
+        if (err) {
+                set_error(error, err);
+
+#ifdef CANARY_PROTECT
+                if (stk->items && !bad_canaries) {
+                        *left_canary (stk->items, stk->capacity) = CANARY ^ (canary_t)header->items;
+                        *right_canary(stk->items, stk->capacity) = CANARY ^ (canary_t)header->items;
+                }
+#endif /* CANARY_PROTECT */
+
+                if (stk->items) {
+                        log_dump(stk);
+                        destruct_stack(stk);
+                } else {
+                        *stk = {};
+                }
+
+                return nullptr;
+        }
+
+        update_fast(stk);
+        return stk;
+}
+
+void sync_stack(stack_t *const stk, int *const error)
+{
+        assert(stk);
+        audit_scope(stk);
+        int err = 0;
+
+        map_header_t *header = (map_header_t *)map_header(stk->params.alloc);
+        if (!header || !stk->items) {
+                log_err("Stack is not mapped\n");
+                err = STK_INVALID;
+                goto finally;
+        }
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't sync invalid stack\n");
+                goto finally;
+        }
+
+        write_map_header(stk, header);
+
+        if (sync_map(stk->params.alloc)) {
+                log_err("Can't sync stack file: %s\n", strerror(errno));
+                err = STK_BAD_FILE;
+        }
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_dump(stk);
+        }
+}
+
+/**
+ * @brief Gets protection mask of the build
+ *
+ * Files are compatible only if they are written with the same protection,
+ * since canaries change items layout.
+ */
+static inline uint32_t map_protect()
+{
+        uint32_t protect = 0;
+
+#ifdef CANARY_PROTECT
+        protect |= 1 << 0;
+#endif /* CANARY_PROTECT */
+
+#ifdef HASH_PROTECT
+        protect |= 1 << 1;
+#endif /* HASH_PROTECT */
+
+        return protect;
+}
+
+static hash_t hash_map_header(map_header_t *const header)
+{
+        assert(header);
+
+        hash_t hash = header->hash;
+        header->hash = 0;
+
+        hash_t header_hash = block_hash(header, sizeof(map_header_t), SEED);
+
+        header->hash = hash;
+        return header_hash;
+}
+
+static void write_map_header(stack_t *const stk, map_header_t *const header)
+{
+        assert(stk);
+        assert(header);
+
+        map_header_t saved = {};
+
+        memcpy(saved.magic, MAP_MAGIC, sizeof(MAP_MAGIC));
+        saved.version       = MAP_VERSION;
+        saved.protect       = map_protect();
+        saved.item_size     = sizeof(item_t);
+
+        saved.size          = stk->size;
+        saved.capacity      = stk->capacity;
+        saved.reserved      = stk->reserved;
+        saved.items         = (uint64_t)stk->items;
+
+        saved.init_cap      = stk->params.init_cap;
+        saved.factor        = stk->params.factor;
+        saved.max_step      = stk->params.max_step;
+        saved.shrink_delay  = stk->params.shrink_delay;
+        saved.shrink        = stk->params.shrink;
+        saved.poison        = stk->params.poison;
+        saved.hash_kind     = stk->params.hash_kind;
+        saved.verify        = stk->verify;
+        saved.verify_period = stk->verify_period;
+
+#ifdef CANARY_PROTECT
+        saved.left_canary   = stk->left_canary;
+        saved.right_canary  = stk->right_canary;
+#endif /* CANARY_PROTECT */
+
+#ifdef HASH_PROTECT
+        saved.data_hash     = prot(stk)->data_hash;
+#endif /* HASH_PROTECT */
+
+        saved.hash = hash_map_header(&saved);
+        *header = saved;
+}
+
+/**
+ * @brief Writes mapped stack header before the mapping is closed
+ *
+ * @param stk Stack being destructed
+ *
+ * Invalid stack (e.g. failed to open) doesn't overwrite the header,
+ * so the file keeps its last valid state.
+ */
+static void close_map_header(stack_t *const stk)
+{
+        assert(stk);
+
+        map_header_t *header = (map_header_t *)map_header(stk->params.alloc);
+        if (!header || !stk->items)
+                return;
+
+#ifndef UNPROTECT
+        if (verify_stack(stk))
+                return;
+#endif /* UNPROTECT */
+
+        write_map_header(stk, header);
+}
+
+/**
+ * @brief Restores stack structure from mapped file header
+ *
+ * @param[out] stk Empty stack
+ * @param header   File header
+ * @param alloc    File mapping allocator
+ *
+ * Items are not mapped yet, but header is checked against the file size.
+ *
+ * @return 0 or STK_BAD_FILE
+ */
+static int read_map_header(stack_t *const stk, map_header_t *const header,
+                           const stack_alloc_t *const alloc)
+{
+        assert(stk);
+        assert(header);
+        assert(alloc);
+
+        if (memcmp(header->magic, MAP_MAGIC, sizeof(MAP_MAGIC)) || header->version != MAP_VERSION ||
+            header->hash != hash_map_header(header))
+                return STK_BAD_FILE;
+
+        if (header->protect != map_protect() || header->item_size != sizeof(item_t)) {
+                log_err("Stack file protection or item size doesn't match\n");
+                return STK_BAD_FILE;
+        }
+
+#ifdef CANARY_PROTECT
+        if (header->left_canary != CANARY || header->right_canary != CANARY)
+                return STK_BAD_FILE;
+#endif /* CANARY_PROTECT */
+
+        stack_params_t params = {};
+        params.init_cap     = header->init_cap;
+        params.factor       = header->factor;
+        params.max_step     = header->max_step;
+        params.shrink       = header->shrink;
+        params.shrink_delay = header->shrink_delay;
+        params.poison       = header->poison;
+        params.hash_kind    = header->hash_kind;
+        params.alloc        = alloc;
+        params.inline_items = false;
+
+        if (verify_params(&params) || header->size > header->capacity ||
+            header->capacity < MIN_CAP || header->capacity > CAP_MAX ||
+            header->verify < VERIFY_NONE || header->verify > VERIFY_FULL || !header->verify_period)
+                return STK_BAD_FILE;
+
+        if (map_block_size(alloc) != raw_size(header->capacity))
+                return STK_BAD_FILE;
+
+        stk->params        = params;
+        stk->size          = header->size;
+        stk->capacity      = header->capacity;
+        stk->reserved      = header->reserved;
+        stk->low_pops      = 0;
+        stk->ops           = 0;
+        stk->verify        = header->verify;
+        stk->verify_period = header->verify_period;
+
+#ifdef CANARY_PROTECT
+        stk->left_canary   = CANARY;
+        stk->right_canary  = CANARY;
+#endif /* CANARY_PROTECT */
+
+        return 0;
+}
+
+void save_stack(stack_t *const stk, const int fd, int *const error)
+{
+        assert(stk);
+        audit_scope(stk);
+
+        int err = 0;
+        snap_header_t header = {};
+        struct iovec iov[2] = {};
+
+        if (!stk->items) {
+                log_err("Can't save stack which is not constructed\n");
+                err = STK_INVALID;
+                goto finally;
+        }
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't save invalid stack\n");
+                goto finally;
+        }
+
+        memcpy(header.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+        header.version    = SNAP_VERSION;
+        header.seed       = (uint32_t)SEED;
+        header.item_size  = sizeof(item_t);
+        header.capacity   = stk->capacity;
+        header.size       = stk->size;
+        header.items_hash = snap_hash(stk->items, stk->size * sizeof(item_t), header.seed);
+        header.hash       = snap_hash(&header, sizeof(snap_header_t), header.seed);
+
+        iov[0].iov_base = &header;
+        iov[0].iov_len  = sizeof(snap_header_t);
+        iov[1].iov_base = stk->items;
+        iov[1].iov_len  = stk->size * sizeof(item_t);
+
+        if (write_all(fd, iov, 2)) {
+                log_err("Can't write stack snapshot: %s\n", strerror(errno));
+                err = STK_BAD_FILE;
+        }
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_dump(stk);
+        }
+}
+
+stack_t *const load_stack(stack_t *const stk, const int fd, int *const error)
+{
+        assert(stk);
+
+        stack_params_t params = {};
+        return load_stack(stk, &params, fd, error);
+}
+
+stack_t *const load_stack(stack_t *const stk, const stack_params_t *const params, const int fd,
+                          int *const error)
+{
+        assert(stk);
+        assert(params);
+
+        int err = 0;
+        bool constructed = false;
+        snap_header_t header = {};
+        stack_params_t snap = *params;
+        hash_t hash = 0;
+
+        if (verify_params(params)) {
+                log_err("Invalid stack parameters\n");
+                err = STK_INVALID;
+                goto finally;
+        }
+
+        if (read_all(fd, &header, sizeof(snap_header_t))) {
+                log_err("Can't read stack snapshot header: %s\n", strerror(errno));
+                err = STK_BAD_FILE;
+                goto finally;
+        }
+
+        hash = header.hash;
+        header.hash = 0;
+
+        if (memcmp(header.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) || header.version != SNAP_VERSION ||
+            hash != snap_hash(&header, sizeof(snap_header_t), header.seed) ||
+            header.item_size != sizeof(item_t) || header.size > header.capacity ||
+            header.capacity < MIN_CAP || header.capacity > CAP_MAX) {
+                log_err("Invalid stack snapshot header\n");
+                err = STK_BAD_FILE;
+                goto finally;
+        }
+
+        /* Saved capacity is allocated at once, then it is not a minimal one */
+        snap.init_cap = header.capacity;
+        if (!construct_stack(stk, &snap, &err))
+                goto finally;
+
+        constructed = true;
+        stk->params.init_cap = params->init_cap;
+        update_fast(stk);
+
+        if (read_all(fd, stk->items, header.size * sizeof(item_t))) {
+                log_err("Can't read stack snapshot items: %s\n", strerror(errno));
+                err = STK_BAD_FILE;
+                goto finally;
+        }
+
+        if (snap_hash(stk->items, header.size * sizeof(item_t), header.seed) != header.items_hash) {
+                log_err("Stack snapshot items are corrupted\n");
+                err = STK_BAD_FILE;
+                goto finally;
+        }
+
+#ifdef HASH_PROTECT
+        rehash_chunks(stk, 0, header.size);
+#endif /* HASH_PROTECT */
+
+        stk->size = header.size;
+
+#ifdef HASH_PROTECT
+        prot(stk)->hash = hash_header(stk);
+#endif /* HASH_PROTECT */
+
+#ifndef UNPROTECT
+$       (err = check_stack(stk);)
+#endif /* UNPROTECT */
+
+finally:
+        if (err) {
+                set_error(error, err);
+
+                if (constructed) {
+                        log_dump(stk);
+                        destruct_stack(stk);
+                }
+
+                return nullptr;
+        }
+
+        return stk;
+}
+
+/**
+ * @brief Calculates snapshot hash
+ *
+ * Data is hashed by murmur_hash() in SNAP_PIECE pieces,
+ * hash of a piece is the seed of the next one.
+ */
+static hash_t snap_hash(const void *const data, const size_t size, hash_t seed)
+{
+        const char *bytes = (const char *)data;
+        size_t left = size;
+
+        do {
+                size_t len = left < SNAP_PIECE ? left : SNAP_PIECE;
+                seed = murmur_hash(bytes, (int)len, seed);
+
+                bytes += len;
+                left  -= len;
+        } while (left);
+
+        return seed;
+}
+
+/**
+ * @brief Writes all buffers
+ *
+ * Partial writes are continued, iov is changed.
+ *
+ * @return 0 or -1 (errno is set).
+ */
+static int write_all(const int fd, struct iovec *iov, int n_iov)
+{
+        while (n_iov > 0) {
+                while (n_iov > 0 && iov->iov_len == 0) {
+                        iov++;
+                        n_iov--;
+                }
+
+                if (n_iov == 0)
+                        break;
+
+                ssize_t written = writev(fd, iov, n_iov);
+                if (written < 0 && errno == EINTR)
+                        continue;
+
+                if (written <= 0) {
+                        if (written == 0)
+                                errno = EIO;
+                        return -1;
+                }
+
+                size_t n = (size_t)written;
+                while (n_iov > 0 && n >= iov->iov_len) {
+                        n -= iov->iov_len;
+                        iov++;
+                        n_iov--;
+                }
+
+                if (n_iov > 0) {
+                        iov->iov_base = (char *)iov->iov_base + n;
+                        iov->iov_len -= n;
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Reads exactly size bytes
+ *
+ * @return 0 or -1 (errno is set, ENODATA at the end of file).
+ */
+static int read_all(const int fd, void *const buf, const size_t size)
+{
+        char  *dst  = (char *)buf;
+        size_t left = size;
+
+        while (left) {
+                ssize_t n = read(fd, dst, left);
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                if (n <= 0) {
+                        if (n == 0)
+                                errno = ENODATA;
+                        return -1;
+                }
+
+                dst  += n;
+                left -= (size_t)n;
+        }
+
+        return 0;
+}
+
+static int verify_empty_stack(const stack_t *const stk)
+{
+        assert(stk);
+        int vrf = 0x00000000;
 
         if (stk->items) 
                 vrf |= INVALID_ITEMS;
@@ -294,82 +1973,632 @@ static int verify_empty_stack(const stack_t *const stk)
         if (stk->capacity)
                 vrf |= INVALID_CAPACITY;
 
-        if (stk->size) 
-                vrf |= INVALID_SIZE;
+        if (stk->size) 
+                vrf |= INVALID_SIZE;
+
+#if defined(HASH_PROTECT) && defined(SIDE_META)
+        if (stk->prot)
+                vrf |= INVALID_HASH;
+#elif defined(HASH_PROTECT)
+        if (stk->hash || stk->data_hash || stk->chunk_tree)
+                vrf |= INVALID_HASH;
+#endif /* HASH_PROTECT */
+
+#ifdef CANARY_PROTECT
+        if (stk->left_canary)
+                vrf |= INVALID_STK_LCNRY;
+        if (stk->right_canary)
+                vrf |= INVALID_STK_RCNRY;
+#endif /* CANARY_PROTECT */
+
+        return vrf;
+}
+
+static int verify_struct(stack_t *const stk)
+{
+        assert(stk);
+        int vrf = 0x00000000;
+
+        if (stk->capacity > CAP_MAX || stk->capacity < MIN_CAP)
+                vrf |= INVALID_CAPACITY;
+
+        if (stk->size > stk->capacity) 
+                vrf |= INVALID_SIZE;
+
+#ifdef CANARY_PROTECT
+        canary_t cnry = CANARY ^ (canary_t)stk->items;
+
+        if (stk->items != nullptr) {
+
+                if (*left_canary (stk->items, stk->capacity) != cnry)
+                        vrf |= INVALID_DATA_LCNRY;
+
+                if (*right_canary(stk->items, stk->capacity) != cnry)
+                        vrf |= INVALID_DATA_RCNRY;
+        }
+
+        if (stk->left_canary  != CANARY)
+                vrf |= INVALID_STK_LCNRY;
+
+        if (stk->right_canary != CANARY)
+                vrf |= INVALID_STK_RCNRY;
+#endif /* CANARY_PROTECT */
+
+#ifdef HASH_PROTECT
+        if (stk->items != nullptr && !has_prot(stk)) {
+                vrf |= INVALID_HASH;
+        } else if (stk->items != nullptr) {
+                if (prot(stk)->hash != hash_header(stk))
+                        vrf |= INVALID_HASH;
+                else if (!prot(stk)->chunk_tree || prot(stk)->chunk_tree[1] != prot(stk)->data_hash)
+                        vrf |= INVALID_HASH;
+        }
+#endif /* HASH_PROTECT */
+
+        return vrf;
+}
+
+static int verify_stack(stack_t *const stk)
+{
+        assert(stk);
+        stats_start(stk, start);
+
+        int vrf = verify_struct(stk);
+
+#ifdef HASH_PROTECT
+        if (!vrf && stk->items != nullptr) {
+                stats_start(stk, hash_start);
+                vrf |= verify_chunks(stk, 0, n_chunks(stk->capacity));
+                stats_time(stk, hash_time, hash_start);
+        }
+#endif /* HASH_PROTECT */
+
+        stats_time(stk, verify_time, start);
+        return vrf;
+}
+
+/**
+ * @brief Verifies stack structure and dirty chunks
+ *
+ * @param stk Stack to verify
+ *
+ * @return bit mask composed of invariant_err_t elemets
+ */
+static int verify_dirty(stack_t *const stk)
+{
+        assert(stk);
+        stats_start(stk, start);
+
+        int vrf = verify_struct(stk);
+
+#ifdef HASH_PROTECT
+        if (!vrf) {
+                stats_start(stk, hash_start);
+                vrf |= verify_chunks(stk, prot(stk)->dirty_from, prot(stk)->dirty_to);
+                stats_time(stk, hash_time, hash_start);
+        }
+#endif /* HASH_PROTECT */
+
+        stats_time(stk, verify_time, start);
+        return vrf;
+}
+
+/**
+ * @brief Verifies stack according to its policy and counts failures
+ *
+ * @param stk Stack to verify
+ *
+ * @return bit mask composed of invariant_err_t elemets
+ */
+static int check_stack(stack_t *const stk)
+{
+        assert(stk);
+
+        int vrf = check_policy(stk);
+        if (vrf)
+                stats_fails(stk, vrf);
+
+        return vrf;
+}
+
+/**
+ * @brief Verifies stack according to its policy
+ *
+ * @param stk Stack to verify
+ *
+ * Unknown policy is treated as VERIFY_FULL.
+ * Chunks become clean after successful verification.
+ *
+ * @return bit mask composed of invariant_err_t elemets
+ */
+static int check_policy(stack_t *const stk)
+{
+        assert(stk);
+        int vrf = 0;
+
+        switch (stk->verify) {
+        case VERIFY_NONE:
+                return 0;
+        case VERIFY_STRUCT:
+                return verify_struct(stk);
+        case VERIFY_SAMPLED:
+                if (stk->verify_period && stk->ops % stk->verify_period)
+                        return verify_struct(stk);
+                vrf = verify_stack(stk);
+                break;
+        case VERIFY_DIRTY:
+                vrf = verify_dirty(stk);
+                break;
+        case VERIFY_FULL:
+        default:
+                vrf = verify_stack(stk);
+                break;
+        }
+
+#ifdef HASH_PROTECT
+        if (!vrf && stk->items)
+                clean_chunks(stk);
+#endif /* HASH_PROTECT */
+
+        return vrf;
+}
+
+/**
+ * @brief Checks that unused slots are poisoned
+ *
+ * Only eager poison mode keeps every unused slot poisoned.
+ * Structure must be valid.
+ *
+ * @return INVALID_POISON or 0
+ */
+static int verify_unused(const stack_t *const stk)
+{
+        assert(stk);
+
+        if (!stk->items || stk->params.poison != POISON_EAGER)
+                return 0;
+
+        size_t unused = (stk->capacity - stk->size) * sizeof(item_t);
+        size_t filled = fill_span(stk->items + stk->size, unused, FILL_BYTE);
+        if (filled == unused)
+                return 0;
+
+        log_err("Unused slot %zu is overwritten\n", stk->size + filled / sizeof(item_t));
+        return INVALID_POISON;
+}
+
+/**
+ * @brief Verifies stack at a checkpoint
+ *
+ * @param stk  Stack to verify
+ * @param deep Check unused slots as well
+ */
+static int verify_checkpoint(stack_t *const stk, const bool deep)
+{
+        assert(stk);
+        audit_scope(stk);
+        int err = 0;
+
+        if (stk->items)
+                err = verify_stack(stk);
+        else
+                err = verify_empty_stack(stk);
+
+        if (deep && !(err & (INVALID_SIZE | INVALID_CAPACITY | INVALID_ITEMS)))
+                err |= verify_unused(stk);
+
+        if (err)
+                stats_fails(stk, err);
+
+#ifdef HASH_PROTECT
+        if (!err && stk->items)
+                clean_chunks(stk);
+#endif /* HASH_PROTECT */
+
+        if (err) {
+                log_err("Stack verification failed\n");
+                log_dump(stk);
+        }
+
+        return err;
+}
+
+int verify_stack_full(stack_t *const stk)
+{
+        assert(stk);
+        return verify_checkpoint(stk, false);
+}
+
+int verify_stack_deep(stack_t *const stk)
+{
+        assert(stk);
+        return verify_checkpoint(stk, true);
+}
+
+int verify_stack_slice(stack_t *const stk, size_t *const chunk, const size_t n)
+{
+        assert(stk);
+        assert(chunk);
+        audit_scope(stk);
+
+        if (!stk->items) {
+                *chunk = 0;
+                return verify_empty_stack(stk);
+        }
+
+        int vrf = verify_struct(stk);
+
+#ifdef HASH_PROTECT
+        size_t to = *chunk + n;
+        if (to >= n_chunks(stk->capacity))
+                to = 0;
+
+        if (!vrf && has_prot(stk))
+                vrf |= verify_chunks(stk, *chunk, to ? to : n_chunks(stk->capacity));
+
+        *chunk = to;
+#else
+        (void)n;
+        *chunk = 0;
+#endif /* HASH_PROTECT */
+
+        if (vrf)
+                stats_fails(stk, vrf);
+
+        return vrf;
+}
+
+void set_verify_policy(stack_t *const stk, const int level, 
+                       const size_t period, int *const error)
+{
+        assert(stk);
+        audit_scope(stk);
+        int err = 0;
+
+        if (level < VERIFY_NONE || level > VERIFY_FULL || period == 0) {
+                log_err("Invalid verification policy: %d (period %zu)\n", level, period);
+                err = STK_INVALID;
+                goto finally;
+        }
+
+#ifndef UNPROTECT
+        if (stk->items) {
+$               (err = verify_stack(stk);)
+        }
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't set policy of invalid stack\n");
+                goto finally;
+        }
+
+        stk->verify        = level;
+        stk->verify_period = period;
+        update_fast(stk);
+
+#ifdef HASH_PROTECT
+        if (stk->items)
+                prot(stk)->hash = hash_header(stk);
+#endif /* HASH_PROTECT */
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_dump(stk);
+        }
+}
+
+void enable_stack_stats(stack_t *const stk, int *const error)
+{
+        assert(stk);
+        audit_scope(stk);
+        int err = 0;
+
+#ifdef STACK_STATS
+        stack_stats_t *stats = stk->stats;
+
+#ifndef UNPROTECT
+        if (stk->items) {
+$               (err = verify_stack(stk);)
+        }
+#endif /* UNPROTECT */
+
+        if (err) {
+                log_err("Can't enable stats of invalid stack\n");
+                goto finally;
+        }
+
+        if (!stats) {
+$               (stats = (stack_stats_t *)calloc(1, sizeof(stack_stats_t));)
+                if (!stats) {
+                        log_err("Invalid stats allocation: %s\n", strerror(errno));
+                        err = STK_BAD_ALLOC;
+                        goto finally;
+                }
+        }
+
+        stk->stats = stats;
+        reset_stack_stats(stk);
+        update_fast(stk);
+
+#ifdef HASH_PROTECT
+        if (stk->items)
+                prot(stk)->hash = hash_header(stk);
+#endif /* HASH_PROTECT */
+#else
+        log_err("Stack is compiled without STACK_STATS\n");
+        err = STK_INVALID;
+        goto finally;
+#endif /* STACK_STATS */
+
+finally:
+        if (err) {
+                set_error(error, err);
+                log_dump(stk);
+        }
+}
+
+void stack_stats(const stack_t *const stk, stack_stats_t *const stats, int *const error)
+{
+        assert(stk);
+        assert(stats);
+        audit_scope(stk);
+
+#ifdef STACK_STATS
+        if (stk->stats) {
+                const stack_stats_t *src = stk->stats;
+                double ns_per_tick = stats_ns_per_tick();
+
+                /* Histograms are converted separately, so they are not copied twice */
+                stats->pushes        = src->pushes;
+                stats->pops          = src->pops;
+                stats->empty_pops    = src->empty_pops;
+                stats->grows         = src->grows;
+                stats->shrinks       = src->shrinks;
+                stats->bytes_copied  = src->bytes_copied;
+                stats->hash_time     = (uint64_t)((double)src->hash_time   * ns_per_tick);
+                stats->verify_time   = (uint64_t)((double)src->verify_time * ns_per_tick);
+                stats->peak_size     = src->peak_size;
+                stats->peak_capacity = src->peak_capacity;
+
+                memcpy(stats->verify_fails, src->verify_fails, sizeof(src->verify_fails));
+
+                hist_to_ns(&stats->push_time, &src->push_time, ns_per_tick);
+                hist_to_ns(&stats->pop_time,  &src->pop_time,  ns_per_tick);
+                return;
+        }
+#endif /* STACK_STATS */
+
+        log_err("Stack stats are not enabled\n");
+        set_error(error, STK_INVALID);
+}
+
+void reset_stack_stats(stack_t *const stk)
+{
+        assert(stk);
+        audit_scope(stk);
+
+#ifdef STACK_STATS
+        if (!stk->stats)
+                return;
+
+        memset((void *)stk->stats, 0, sizeof(stack_stats_t));
+        stk->stats->peak_size     = stk->size;
+        stk->stats->peak_capacity = stk->capacity;
+#endif /* STACK_STATS */
+}
+
+static inline const item_t get_poison(const int byte) 
+{
+        item_t poison = 0;
+        memset((void *)&poison, byte, sizeof(item_t));
+        return poison;
+}
+
+static inline int expandable(const stack_t *const stk)
+{
+        assert(stk);
+        return stk->capacity == stk->size;
+}
+
+/**
+ * @brief Gets capacity stack is never shrunk below
+ *
+ * @param stk Stack
+ */
+static inline size_t min_capacity(const stack_t *const stk)
+{
+        assert(stk);
+        return stk->reserved > stk->params.init_cap ? stk->reserved : stk->params.init_cap;
+}
+
+/**
+ * @brief Calculates expanded capacity
+ *
+ * @param stk      Stack
+ * @param capacity Capacity to expand
+ *
+ * Capacity is multiplied by growth factor, 
+ * but it never grows more than max_step items at once.
+ */
+static inline size_t grown_capacity(const stack_t *const stk, const size_t capacity)
+{
+        assert(stk);
+        const stack_params_t *params = &stk->params;
 
-#ifdef HASH_PROTECT
-        if (stk->hash)
-                vrf |= INVALID_HASH;
-#endif /* HASH_PROTECT */
+        if (capacity > CAP_MAX / params->factor)
+                return CAP_MAX;
 
-#ifdef CANARY_PROTECT
-        if (stk->left_canary)
-                vrf |= INVALID_STK_LCNRY;
-        if (stk->right_canary)
-                vrf |= INVALID_STK_RCNRY;
-#endif /* CANARY_PROTECT */
+        size_t step = capacity * (params->factor - 1);
+        if (params->max_step && step > params->max_step)
+                step = params->max_step;
 
-        return vrf;
+        return capacity + step;
 }
 
-static int verify_stack(stack_t *const stk)
+/**
+ * @brief Calculates capacity enough for size items
+ *
+ * @param stk  Stack
+ * @param size Required size
+ *
+ * Capacity is expanded as if items were pushed one by one.
+ */
+static inline size_t fit_capacity(const stack_t *const stk, const size_t size)
 {
         assert(stk);
-        int vrf = 0x00000000;
+        const size_t max_step = stk->params.max_step;
 
-        if (stk->capacity > CAP_MAX || stk->capacity < INIT_CAP)
-                vrf |= INVALID_CAPACITY;
+        size_t cap = stk->capacity;
+        while (cap < size) {
+                size_t next = grown_capacity(stk, cap);
 
-        if (stk->size > stk->capacity) 
-                vrf |= INVALID_SIZE;
+                if (max_step && next - cap == max_step) {
+                        cap += (size - cap + max_step - 1) / max_step * max_step;
+                        break;
+                }
 
-#ifdef CANARY_PROTECT
-        canary_t cnry = CANARY ^ (canary_t)stk->items;
+                cap = next;
+        }
 
-        if (stk->items != nullptr) {
+        return cap;
+}
 
-                if (*left_canary (stk->items, stk->capacity) != cnry)
-                        vrf |= INVALID_DATA_LCNRY;
+/**
+ * @brief Calculates capacity of stack shrunk to size
+ *
+ * @param stk  Stack
+ * @param size Stack size after items are popped
+ *
+ * It mimics shrinking of stack when items are popped one by one.
+ */
+static inline size_t shrunk_capacity(const stack_t *const stk, const size_t size)
+{
+        assert(stk);
+        const size_t factor = stk->params.factor;
 
-                if (*right_canary(stk->items, stk->capacity) != cnry)
-                        vrf |= INVALID_DATA_RCNRY;
+        size_t cap = stk->capacity;
+        while (cap / (factor * factor) + 1 >= size + 1 && cap > min_capacity(stk)) {
+                cap /= factor;
+                if (cap < min_capacity(stk))
+                        cap = min_capacity(stk);
         }
 
-        if (stk->left_canary  != CANARY)
-                vrf |= INVALID_STK_LCNRY;
+        return cap;
+}
 
-        if (stk->right_canary != CANARY)
-                vrf |= INVALID_STK_RCNRY;
-#endif /* CANARY_PROTECT */
+/**
+ * @brief Calculates capacity to shrink stack to on pop
+ *
+ * @param stk  Stack
+ * @param size Stack size after pop
+ *
+ * Eager policy shrinks stack as it is popped. Lazy policy waits for
+ * shrink_delay pops below the shrink threshold and then shrinks stack 
+ * in one step. Stack is never shrunk on pop with SHRINK_NEVER policy. 
+ */
+static inline size_t pop_capacity(const stack_t *const stk, const size_t size)
+{
+        assert(stk);
 
-#ifdef HASH_PROTECT
-        if (stk->items != nullptr) {
-                if (stk->hash != hash_stack(stk))
-                        vrf |= INVALID_HASH;
+        switch (stk->params.shrink) {
+        case SHRINK_NEVER:
+                return stk->capacity;
+        case SHRINK_LAZY:
+                if (stk->low_pops + 1 < stk->params.shrink_delay)
+                        return stk->capacity;
+                return shrunk_capacity(stk, size);
+        case SHRINK_EAGER:
+        default:
+                return shrunk_capacity(stk, size);
         }
-#endif /* HASH_PROTECT */
-
-        return vrf;
 }
 
-static inline const item_t get_poison(const int byte) 
+/**
+ * @brief Counts pops made below the shrink threshold
+ *
+ * @param stk Stack
+ *
+ * It is called by pops only (pushes don't touch the counter).
+ * Counter is reset by a pop above the threshold or when stack is shrunk.
+ */
+static inline void count_low_pops(stack_t *const stk)
 {
-        item_t poison = 0;
-        memset((void *)&poison, byte, sizeof(item_t));
-        return poison;
+        assert(stk);
+
+        if (shrunk_capacity(stk, stk->size) < stk->capacity)
+                stk->low_pops++;
+        else
+                stk->low_pops = 0;
 }
 
-static inline int expandable(const stack_t *const stk)
+/**
+ * @brief Updates fast path bounds
+ *
+ * @param stk Stack
+ *
+ * Fast path works from the size above shrink threshold up to capacity,
+ * so it never reallocates and its pops only reset low_pops. Pops below
+ * the threshold are made by pop_stack(), it counts them.
+ * It is disabled if push and pop do something else (see push_fast()).
+ * It is called whenever capacity, policy or stats are changed.
+ */
+static void update_fast(stack_t *const stk)
 {
         assert(stk);
-        return stk->capacity == stk->size;
+
+        stk->fast_lo = 0;
+        stk->fast_n  = 0;
+
+#ifdef HASH_PROTECT
+        return;
+#else
+        if (!stk->items || stk->params.poison != POISON_NONE)
+                return;
+
+#ifdef CANARY_PROTECT
+        if (stk->verify != VERIFY_NONE)
+                return;
+#endif /* CANARY_PROTECT */
+
+#ifdef STACK_STATS
+        if (stk->stats)
+                return;
+#endif /* STACK_STATS */
+
+#ifdef STACK_AUDIT
+        if (stk->audit)
+                return;
+#endif /* STACK_AUDIT */
+
+        const size_t factor = stk->params.factor;
+
+        size_t mark = 0;
+        if (stk->capacity > min_capacity(stk))
+                mark = stk->capacity / (factor * factor);
+
+        stk->fast_lo = mark + 1;
+        stk->fast_n  = stk->capacity > stk->fast_lo ? stk->capacity - stk->fast_lo : 0;
+#endif /* HASH_PROTECT */
 }
 
-static inline int shrinkable(const stack_t *const stk) 
+/**
+ * @brief Verifies stack parameters
+ *
+ * @param params Parameters to verify
+ *
+ * @return 0 if parameters are valid
+ */
+static inline int verify_params(const stack_params_t *const params)
 {
-        assert(stk);
-        return stk->capacity / (CAP_FACTOR * CAP_FACTOR) + 1 >= stk->size && 
-               stk->capacity > INIT_CAP;
+        assert(params);
+        return params->init_cap < MIN_CAP || params->init_cap > CAP_MAX ||
+               params->factor < 2 || params->factor > MAX_FACTOR ||
+               params->shrink < SHRINK_EAGER || params->shrink > SHRINK_NEVER ||
+               params->poison < POISON_EAGER || params->poison > POISON_NONE ||
+               params->hash_kind < HASH_MURMUR || params->hash_kind > HASH_CRC32C ||
+               (params->alloc && (!params->alloc->alloc || !params->alloc->realloc || 
+                                  !params->alloc->free));
 }
 
 static inline void set_error(int *const error, int value) 
@@ -396,6 +2625,129 @@ static inline canary_t *right_canary(const void *const items, const size_t capac
 }
 #endif /* CANARY_PROTECT */
 
+/**
+ * @brief Gets memory block allocated for items
+ *
+ * @param items Stack items
+ *
+ * Left data canary is placed at the beginning of the block,
+ * so items start right after it.
+ */
+static inline void *raw_items(const item_t *const items)
+{
+        if (!items)
+                return nullptr;
+
+#ifdef CANARY_PROTECT
+        return (char *)items - sizeof(canary_t);
+#else
+        return (void *)items;
+#endif /* CANARY_PROTECT */
+}
+
+/**
+ * @brief Calculates size of the stack memory block
+ *
+ * @param capacity Stack capacity
+ *
+ * Block holds items and data canaries if canary protection defined.
+ */
+static inline size_t raw_size(const size_t capacity)
+{
+        size_t size = capacity * sizeof(item_t);
+
+#ifdef CANARY_PROTECT
+        size += sizeof(void *) - size % sizeof(void *) + 2 * sizeof(canary_t);
+#endif /* CANARY_PROTECT */
+
+        return size;
+}
+
+/**
+ * @brief Checks if capacity fits the inline block
+ */
+static inline bool fits_inline(const stack_t *const stk, const size_t capacity)
+{
+        assert(stk);
+        return stk->params.inline_items && capacity <= INLINE_CAP;
+}
+
+/**
+ * @brief Checks if items are kept in the inline block
+ */
+static inline bool is_inline(const stack_t *const stk)
+{
+        assert(stk);
+        return stk->items && raw_items(stk->items) == stk->inline_raw;
+}
+
+/**
+ * @brief Checks if stack has hash protection fields
+ *
+ * Side record exists from construction to destruction only.
+ */
+#ifdef HASH_PROTECT
+static inline bool has_prot(const stack_t *const stk)
+{
+        assert(stk);
+
+#ifdef SIDE_META
+        return stk->prot != nullptr;
+#else
+        return true;
+#endif /* SIDE_META */
+}
+#endif /* HASH_PROTECT */
+
+/**
+ * @brief Allocates side record of hash protection fields
+ *
+ * @return 0 or STK_BAD_ALLOC
+ */
+#if defined(HASH_PROTECT) && defined(SIDE_META)
+static int open_prot(stack_t *const stk)
+{
+        assert(stk);
+        assert(!stk->prot);
+
+        const stack_alloc_t *meta = meta_alloc(stk);
+
+        stk->prot = (stack_prot_t *)meta->alloc(meta->ctx, sizeof(stack_prot_t));
+        if (!stk->prot)
+                return STK_BAD_ALLOC;
+
+        *stk->prot = {};
+        return 0;
+}
+
+static void close_prot(stack_t *const stk)
+{
+        assert(stk);
+
+        if (!stk->prot)
+                return;
+
+        const stack_alloc_t *meta = meta_alloc(stk);
+        meta->free(meta->ctx, stk->prot, sizeof(stack_prot_t));
+
+        stk->prot = nullptr;
+}
+#endif /* HASH_PROTECT && SIDE_META */
+
+static inline const stack_alloc_t *stack_alloc(const stack_t *const stk)
+{
+        assert(stk);
+        return stk->params.alloc ? stk->params.alloc : &LIBC_ALLOC;
+}
+
+static inline const stack_alloc_t *meta_alloc(const stack_t *const stk)
+{
+        assert(stk);
+        const stack_alloc_t *alloc = stack_alloc(stk);
+
+        return alloc->meta ? alloc->meta : alloc;
+}
+
 static inline const char *const indicate_err(int condition)
 {
         if (condition)
@@ -414,6 +2766,7 @@ static inline const char *const indicate_err(int condition)
 void dump_stack(stack_t *const stk)
 {
         assert(stk);
+        audit_scope(stk);
 
         if (stk->items == nullptr) {
 
@@ -440,10 +2793,17 @@ void dump_stack(stack_t *const stk)
                 log_buf("----------------------------------------------\n");
 
 #ifdef HASH_PROTECT 
-                log_buf(" Hash       (hex): %8x %s\n", hash_stack(stk), 
-                                                        indicate_err(vrf & INVALID_HASH));
-                log_buf(" Saved hash (hex): %8x\n", stk->hash);
-                log_buf("----------------------------------------------\n");
+                if (has_prot(stk)) {
+                        log_buf(" Hash       (hex): %8x %s\n", hash_stack(stk), 
+                                                                indicate_err(vrf & INVALID_HASH));
+                        log_buf(" Saved hash (hex): %8x\n", prot(stk)->hash);
+                        log_buf(" Digest       (hex): %8x\n", 
+                                                hash_items(stk, stk->items, 0, stk->capacity));
+                        log_buf(" Saved digest (hex): %8x\n", prot(stk)->data_hash);
+                        log_buf(" Chunks: %zu, dirty [%zu, %zu)\n", n_chunks(stk->capacity),
+                                                prot(stk)->dirty_from, prot(stk)->dirty_to);
+                        log_buf("----------------------------------------------\n");
+                }
 #endif  /* HASH_PROTECT */
 
 #ifdef CANARY_PROTECT
@@ -468,14 +2828,43 @@ void dump_stack(stack_t *const stk)
                 log_buf("----------------------------------------------\n");
 #endif  /* CANARY_PROTECT */
 
-                for (size_t i = 0; i < stk->capacity; i++) {
-                        if (stk->items[i] == POISON) {
+#ifdef STACK_STATS
+                if (stk->stats) {
+                        log_buf(" Pushes: %lu, pops: %lu, empty pops: %lu\n", 
+                                stk->stats->pushes, stk->stats->pops, stk->stats->empty_pops);
+                        log_buf(" Grows: %lu, shrinks: %lu, bytes copied: %lu\n", 
+                                stk->stats->grows, stk->stats->shrinks, stk->stats->bytes_copied);
+                        log_buf(" Peak size: %zu, peak capacity: %zu\n", 
+                                stk->stats->peak_size, stk->stats->peak_capacity);
+                        log_buf("----------------------------------------------\n");
+                }
+#endif /* STACK_STATS */
+
+                size_t from  = dump_from(stk, DUMP_WINDOW);
+                size_t slots = 0;
+
+                if (from)
+                        log_buf("| %zu bottom slots are skipped\n", from);
+
+                for (size_t i = from; i < stk->capacity; slots++) {
+                        if (slots == 2 * DUMP_WINDOW) {
+                                log_buf("| %zu top slots are skipped\n", stk->capacity - i);
+                                break;
+                        }
+
+                        size_t run = poison_run(stk, i);
+                        if (run > 1) {
+                                log_buf("| 0x%.4lX stack[%7ld..%7ld] = %9s |\n", 
+                                        sizeof(*stk->items) * i, i, i + run - 1, "poison");
+                        } else if (run) {
                                 log_buf("| 0x%.4lX stack[%7ld] = %18s |\n", 
                                         sizeof(*stk->items) * i, i, "poison");
                         } else {
                                 log_buf("| 0x%.4lX stack[%7ld] = %18d |\n", 
                                         sizeof(*stk->items) * i, i, stk->items[i]);
                         }
+
+                        i += run ? run : 1;
                 }
 
                 log_buf("----------------------------------------------\n");
@@ -486,4 +2875,175 @@ void dump_stack(stack_t *const stk)
         log_flush();
 }
 
+/**
+ * @brief Installs guard page fault reports
+ *
+ * @param fd         Fault report file descriptor
+ * @param[out] error Error proceeded
+ *
+ * Reports are written by the SIGSEGV handler in alloc.cpp,
+ * nothing is called here in the signal context.
+ */
+void install_guard_handler(const int fd, int *const error)
+{
+        if (set_guard_handler(fd)) {
+                log_err("Can't install guard page handler: %s\n", strerror(errno));
+                set_error(error, STK_INVALID);
+        }
+}
+
+void dump_stack_json(stack_t *const stk, const int fd, const size_t window, int *const error)
+{
+        assert(stk);
+        audit_scope(stk);
+
+        int err = 0;
+        int vrf = stk->items ? verify_stack(stk) : verify_empty_stack(stk);
+        dump_buf_t buf = {};
+        struct iovec iov = {};
+
+        buf.cap  = DUMP_HEADER + 2 * window * DUMP_SLOT;
+        buf.data = (char *)malloc(buf.cap);
+        if (!buf.data) {
+                log_err("Can't allocate dump buffer: %s\n", strerror(errno));
+                err = STK_BAD_ALLOC;
+                goto finally;
+        }
+
+        buf_printf(&buf, "{\"verify\":%d,\"size\":%zu,\"capacity\":%zu,\"reserved\":%zu,"
+                         "\"policy\":%d,\"items\":\"0x%zx\"", vrf, stk->size, stk->capacity,
+                         stk->reserved, stk->verify, (size_t)stk->items);
+
+#ifdef HASH_PROTECT
+        if (stk->items && has_prot(stk)) {
+                buf_printf(&buf, ",\"hash\":{\"actual\":\"%08x\",\"saved\":\"%08x\","
+                                 "\"digest\":\"%08x\",\"saved_digest\":\"%08x\","
+                                 "\"chunks\":%zu,\"dirty\":[%zu,%zu]}",
+                           hash_stack(stk), prot(stk)->hash, hash_items(stk, stk->items, 0, stk->capacity),
+                           prot(stk)->data_hash, n_chunks(stk->capacity), prot(stk)->dirty_from, prot(stk)->dirty_to);
+        }
+#endif /* HASH_PROTECT */
+
+#ifdef CANARY_PROTECT
+        buf_printf(&buf, ",\"stack_canaries\":[\"%lx\",\"%lx\"]", stk->left_canary, stk->right_canary);
+
+        if (stk->items) {
+                buf_printf(&buf, ",\"data_canaries\":[\"%lx\",\"%lx\"]",
+                           *left_canary(stk->items, stk->capacity),
+                           *right_canary(stk->items, stk->capacity));
+        }
+#endif /* CANARY_PROTECT */
+
+        if (stk->items) {
+                size_t from  = dump_from(stk, window);
+                size_t slots = 0;
+                size_t i     = from;
+
+                buf_printf(&buf, ",\"from\":%zu,\"slots\":[", from);
+
+                for (; i < stk->capacity && slots < 2 * window; slots++) {
+                        size_t run = poison_run(stk, i);
+
+                        if (run)
+                                buf_printf(&buf, "%s{\"poison\":[%zu,%zu]}", slots ? "," : "",
+                                           i, i + run - 1);
+                        else
+                                buf_printf(&buf, "%s[%zu,%d]", slots ? "," : "", i, stk->items[i]);
+
+                        i += run ? run : 1;
+                }
+
+                buf_printf(&buf, "],\"truncated\":%s", i < stk->capacity ? "true" : "false");
+        }
+
+        buf_printf(&buf, "}\n");
+
+        if (buf.failed) {
+                log_err("Can't grow dump buffer\n");
+                err = STK_BAD_ALLOC;
+                goto finally;
+        }
+
+        iov.iov_base = buf.data;
+        iov.iov_len  = buf.len;
+
+        if (write_all(fd, &iov, 1)) {
+                log_err("Can't write stack dump: %s\n", strerror(errno));
+                err = STK_BAD_FILE;
+        }
+
+finally:
+        free(buf.data);
+        set_error(error, err);
+}
+
+/**
+ * @brief Gets the first dumped slot
+ *
+ * Window covers top items, unused slots are dumped as well.
+ */
+static inline size_t dump_from(const stack_t *const stk, const size_t window)
+{
+        assert(stk);
+
+        size_t size = stk->size < stk->capacity ? stk->size : stk->capacity;
+        return size > window ? size - window : 0;
+}
+
+/**
+ * @brief Gets number of poisoned slots from the slot
+ */
+static inline size_t poison_run(const stack_t *const stk, const size_t from)
+{
+        assert(stk);
+
+        if (from >= stk->capacity)
+                return 0;
+
+        return fill_span(stk->items + from, (stk->capacity - from) * sizeof(item_t),
+                         FILL_BYTE) / sizeof(item_t);
+}
+
+/**
+ * @brief Appends formatted string to dump buffer
+ *
+ * Buffer is grown if needed.
+ */
+static void buf_printf(dump_buf_t *const buf, const char *fmt, ...)
+{
+        assert(buf);
+
+        if (buf->failed)
+                return;
+
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+        va_end(args);
+
+        if (n < 0) {
+                buf->failed = true;
+                return;
+        }
+
+        if ((size_t)n < buf->cap - buf->len) {
+                buf->len += (size_t)n;
+                return;
+        }
+
+        size_t cap = 2 * buf->cap + (size_t)n;
+        char *data = (char *)realloc(buf->data, cap);
+        if (!data) {
+                buf->failed = true;
+                return;
+        }
+
+        buf->data = data;
+        buf->cap  = cap;
 
+        va_start(args, fmt);
+        vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+        va_end(args);
+
+        buf->len += (size_t)n;
+}
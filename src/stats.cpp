@@ -0,0 +1,86 @@
+/**
+ * @file
+ * @brief  Stack instrumentation
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include "include/stats.h"
+
+static uint64_t mono_ns();
+
+/**
+ * @brief Clock calibration base
+ *
+ * It is taken at static initialization.
+ */
+static const uint64_t MONO_BASE  = mono_ns();
+static const uint64_t TICKS_BASE = stats_clock();
+
+static uint64_t mono_ns()
+{
+        struct timespec ts = {};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+double stats_ns_per_tick()
+{
+#if defined(__x86_64__) || defined(__i386__)
+        uint64_t ticks = stats_clock() - TICKS_BASE;
+        uint64_t ns    = mono_ns() - MONO_BASE;
+
+        if (ticks == 0 || ns == 0)
+                return 1.0;
+
+        return (double)ns / (double)ticks;
+#else
+        return 1.0;
+#endif
+}
+
+uint64_t hist_percentile(const stats_hist_t *const hist, const double q)
+{
+        assert(hist);
+
+        if (hist->count == 0)
+                return 0;
+
+        uint64_t rank = (uint64_t)(q * (double)hist->count);
+        if (rank >= hist->count)
+                rank = hist->count - 1;
+
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+                seen += hist->buckets[bucket];
+                if (seen > rank)
+                        return hist_value(bucket);
+        }
+
+        return hist->max;
+}
+
+void hist_to_ns(stats_hist_t *const dst, const stats_hist_t *const src, const double ns_per_tick)
+{
+        assert(dst);
+        assert(src);
+        assert(dst != src);
+
+        memset(dst->buckets, 0, sizeof(dst->buckets));
+
+        dst->count = src->count;
+        dst->total = (uint64_t)((double)src->total * ns_per_tick);
+        dst->max   = (uint64_t)((double)src->max   * ns_per_tick);
+
+        for (size_t bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+                if (!src->buckets[bucket])
+                        continue;
+
+                uint64_t ns = (uint64_t)((double)hist_value(bucket) * ns_per_tick);
+                dst->buckets[hist_bucket(ns)] += src->buckets[bucket];
+        }
+}
+
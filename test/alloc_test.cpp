@@ -0,0 +1,196 @@
+/**
+ * @file
+ * @brief  Allocators, mapped stacks and snapshots tests
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/include/stack.h"
+#include "test.h"
+
+static const size_t N = 1000; /**< Items pushed by a test */
+
+/**
+ * @brief Pushes and pops N items
+ */
+static void fill_stack(const stack_alloc_t *const alloc)
+{
+        stack_t stk = {};
+        int err = 0;
+
+        stack_params_t params;
+        params.alloc        = alloc;
+        params.inline_items = false;
+        construct_stack(&stk, &params, &err);
+
+        for (size_t i = 0; i < N; i++)
+                push_stack(&stk, (item_t)i, &err);
+
+        test_check(verify_stack_full(&stk) == 0);
+
+        for (size_t i = N; i > 0; i--)
+                test_check(pop_stack(&stk, &err) == (item_t)(i - 1));
+
+        test_check(err == 0);
+        destruct_stack(&stk);
+}
+
+/**
+ * @brief Creates temporary file
+ *
+ * @param[out] path Path buffer of at least 32 bytes
+ *
+ * @return File descriptor or -1
+ */
+static int temp_file(char *const path)
+{
+        strcpy(path, "/tmp/stack-test-XXXXXX");
+        return mkstemp(path);
+}
+
+static void test_allocs()
+{
+        fill_stack(&LIBC_ALLOC);
+        fill_stack(&POOL_ALLOC);
+
+        /* Freed blocks are reused */
+        fill_stack(&POOL_ALLOC);
+        test_check(pool_stats().hits > 0);
+        pool_release();
+        test_check(pool_stats().cached == 0);
+
+        stack_alloc_t *huge = open_huge_alloc();
+        test_check(huge);
+        if (huge) {
+                fill_stack(huge);
+                close_huge_alloc(huge);
+        }
+
+        fill_stack(&GUARD_ALLOC);
+}
+
+static void test_guard()
+{
+        const size_t size = 128;
+        char *block = (char *)GUARD_ALLOC.alloc(GUARD_ALLOC.ctx, size);
+        test_check(block);
+        if (!block)
+                return;
+
+        int owner_id = 0;
+        test_check(set_guard_owner(&GUARD_ALLOC, block, &owner_id) == 0);
+        test_check(set_guard_owner(&LIBC_ALLOC, block, &owner_id) == -1);
+
+        const void *owner = nullptr;
+        test_check(guard_fault(block + size, &owner));
+        test_check(owner == &owner_id);
+        test_check(!guard_fault(block, &owner));
+
+        GUARD_ALLOC.free(GUARD_ALLOC.ctx, block, size);
+}
+
+static void test_mapped()
+{
+        char path[32] = {};
+        int fd = temp_file(path);
+        test_check(fd >= 0);
+        close(fd);
+
+        stack_t stk = {};
+        int err = 0;
+
+        stack_params_t params;
+        construct_mapped_stack(&stk, path, &params, &err);
+        test_check(err == 0);
+
+        for (size_t i = 0; i < N; i++)
+                push_stack(&stk, (item_t)i, &err);
+
+        sync_stack(&stk, &err);
+        test_check(err == 0);
+        destruct_stack(&stk);
+
+        open_mapped_stack(&stk, path, &err);
+        test_check(err == 0);
+        test_check(stk.size == N);
+        test_check(pop_stack(&stk, &err) == (item_t)(N - 1));
+        test_check(verify_stack_full(&stk) == 0);
+        destruct_stack(&stk);
+
+        /* Growth after the checkpoint is kept by destruct_stack() */
+        open_mapped_stack(&stk, path, &err);
+        test_check(err == 0);
+        sync_stack(&stk, &err);
+
+        for (size_t i = 0; i < 5 * N; i++)
+                push_stack(&stk, (item_t)i, &err);
+
+        test_check(err == 0);
+        destruct_stack(&stk);
+
+        open_mapped_stack(&stk, path, &err);
+        test_check(err == 0);
+        test_check(stk.size == 6 * N - 1);
+        test_check(top_stack(&stk, &err) == (item_t)(5 * N - 1));
+        destruct_stack(&stk);
+
+        unlink(path);
+
+        open_mapped_stack(&stk, path, &err);
+        test_check(err == STK_BAD_FILE);
+}
+
+static void test_snapshots()
+{
+        char path[32] = {};
+        int fd = temp_file(path);
+        test_check(fd >= 0);
+        unlink(path);
+
+        stack_t stk = {};
+        int err = 0;
+        construct_stack(&stk);
+
+        for (size_t i = 0; i < N; i++)
+                push_stack(&stk, (item_t)i);
+
+        save_stack(&stk, fd, &err);
+        test_check(err == 0);
+        destruct_stack(&stk);
+
+        lseek(fd, 0, SEEK_SET);
+        load_stack(&stk, fd, &err);
+        test_check(err == 0);
+        test_check(stk.size == N);
+        test_check(top_stack(&stk) == (item_t)(N - 1));
+        destruct_stack(&stk);
+
+        /* Items don't match the saved hash */
+        item_t item = -1;
+        test_check(pwrite(fd, &item, sizeof(item), lseek(fd, 0, SEEK_END) - (off_t)sizeof(item)) ==
+                   (ssize_t)sizeof(item));
+
+        lseek(fd, 0, SEEK_SET);
+        load_stack(&stk, fd, &err);
+        test_check(err == STK_BAD_FILE);
+
+        err = 0;
+        construct_stack(&stk);
+        push_stack(&stk, 1);
+        save_stack(&stk, -1, &err);
+        test_check(err == STK_BAD_FILE);
+        destruct_stack(&stk);
+
+        close(fd);
+}
+
+void alloc_tests()
+{
+        test_allocs();
+        test_guard();
+        test_mapped();
+        test_snapshots();
+}
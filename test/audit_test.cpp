@@ -0,0 +1,59 @@
+/**
+ * @file
+ * @brief  Background auditor tests
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "../src/include/stack.h"
+#include "../src/include/audit.h"
+#include "test.h"
+
+static void audit_failed(stack_t *const /* stk */, const int vrf, const char *const /* report */,
+                         void *const ctx)
+{
+        ((std::atomic<int> *)ctx)->store(vrf);
+}
+
+static void test_auditor()
+{
+        std::atomic<int> failed {0};
+        int err = 0;
+
+        auditor_t *auditor = open_auditor(1, audit_failed, &failed, &err);
+
+#ifdef STACK_AUDIT
+        test_check(auditor && err == 0);
+        if (!auditor)
+                return;
+
+        stack_t stk = {};
+        construct_stack(&stk);
+        for (size_t i = 0; i < 100; i++)
+                push_stack(&stk, (item_t)i);
+
+        audit_stack(auditor, &stk, &err);
+        test_check(err == 0);
+
+        stk.size = stk.capacity + 1;
+        for (size_t i = 0; i < 1000 && !failed; i++)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        test_check(failed & INVALID_SIZE);
+        stk.size = 100;
+
+        unaudit_stack(&stk);
+        close_auditor(auditor);
+        destruct_stack(&stk);
+#else
+        test_check(!auditor && err == STK_INVALID);
+#endif /* STACK_AUDIT */
+}
+
+void audit_tests()
+{
+        test_auditor();
+}
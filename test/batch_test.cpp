@@ -0,0 +1,70 @@
+/**
+ * @file
+ * @brief  Batch operations tests
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include <stdlib.h>
+#include "../src/include/stack.h"
+#include "../src/include/batch.h"
+#include "test.h"
+
+static const size_t THREADS = 4; /**< Batch pool workers */
+
+static void test_batch()
+{
+        const size_t n_stacks = 300; /* Parallel batch is split by BATCH_CHUNK groups */
+        stack_t *stacks = (stack_t *)calloc(n_stacks, sizeof(stack_t));
+        batch_op_t *ops = (batch_op_t *)calloc(3 * n_stacks, sizeof(batch_op_t));
+        if (!stacks || !ops) {
+                test_check(!"Can't allocate batch");
+                free(stacks);
+                free(ops);
+                return;
+        }
+
+        for (size_t i = 0; i < n_stacks; i++) {
+                construct_stack(stacks + i);
+
+                ops[3 * i]     = {stacks + i, BATCH_PUSH, (item_t)i, 0};
+                ops[3 * i + 1] = {stacks + i, BATCH_POP,  0,         0};
+                ops[3 * i + 2] = {stacks + i, BATCH_POP,  0,         0};
+        }
+
+        int err = 0;
+        apply_batch(ops, 3 * n_stacks, &err);
+        test_check(err == STK_EMPTY_POP);
+        test_check(ops[1].item == 0 && ops[1].error == 0);
+        test_check(ops[2].error == STK_EMPTY_POP);
+
+        for (size_t i = 0; i < n_stacks; i++) {
+                ops[3 * i]     = {stacks + i, BATCH_PUSH, (item_t)i, 0};
+                ops[3 * i + 1] = {stacks + i, BATCH_PUSH, (item_t)i, 0};
+                ops[3 * i + 2] = {stacks + i, BATCH_POP,  0,         0};
+        }
+
+        err = 0;
+        batch_pool_t *pool = open_batch_pool(THREADS, &err);
+        test_check(pool && err == 0);
+
+        if (pool) {
+                apply_batch_parallel(pool, ops, 3 * n_stacks, &err);
+                test_check(err == 0);
+                close_batch_pool(pool);
+        }
+
+        for (size_t i = 0; i < n_stacks; i++) {
+                test_check(stacks[i].size == 1);
+                test_check(ops[3 * i + 2].item == (item_t)i);
+                destruct_stack(stacks + i);
+        }
+
+        free(stacks);
+        free(ops);
+}
+
+void batch_tests()
+{
+        test_batch();
+}
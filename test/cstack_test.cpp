@@ -0,0 +1,65 @@
+/**
+ * @file
+ * @brief  Concurrent stack tests
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include <atomic>
+#include <thread>
+#include "../src/include/cstack.h"
+#include "test.h"
+
+static const size_t N       = 10000; /**< Items pushed by a thread */
+static const size_t THREADS = 4;
+
+static void cstack_worker(cstack_t *const stk, std::atomic<size_t> *const popped)
+{
+        int err = 0;
+
+        for (size_t i = 0; i < N; i++) {
+                push_cstack(stk, (item_t)i, &err);
+
+                int pop_err = 0;
+                pop_cstack(stk, &pop_err);
+                if (!pop_err)
+                        popped->fetch_add(1);
+        }
+
+        test_check(err == 0);
+}
+
+static void test_cstack()
+{
+        cstack_t stk = {};
+        construct_cstack(&stk);
+
+        int err = 0;
+        pop_cstack(&stk, &err);
+        test_check(err == STK_EMPTY_POP);
+
+        std::atomic<size_t> popped {0};
+        std::thread threads[THREADS];
+
+        for (size_t i = 0; i < THREADS; i++)
+                threads[i] = std::thread(cstack_worker, &stk, &popped);
+        for (size_t i = 0; i < THREADS; i++)
+                threads[i].join();
+
+        test_check(verify_cstack(&stk) == 0);
+
+        err = 0;
+        while (!err) {
+                pop_cstack(&stk, &err);
+                if (!err)
+                        popped++;
+        }
+
+        test_check(popped == N * THREADS);
+        destruct_cstack(&stk);
+}
+
+void cstack_tests()
+{
+        test_cstack();
+}
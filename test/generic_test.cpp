@@ -0,0 +1,224 @@
+/**
+ * @file
+ * @brief  Generic stack tests
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "../src/include/generic_stack.h"
+#include "test.h"
+
+/**
+ * @brief Allocation counters of count_alloc()
+ */
+struct alloc_count_t {
+        size_t allocs = 0;
+        size_t frees  = 0;
+};
+
+static void *count_alloc(void *ctx, size_t size)
+{
+        ((alloc_count_t *)ctx)->allocs++;
+        return malloc(size);
+}
+
+static void *count_realloc(void *ctx, void *ptr, size_t /* old_size */, size_t size)
+{
+        if (!ptr)
+                ((alloc_count_t *)ctx)->allocs++;
+
+        return realloc(ptr, size);
+}
+
+static void count_free(void *ctx, void *ptr, size_t /* size */)
+{
+        ((alloc_count_t *)ctx)->frees++;
+        free(ptr);
+}
+
+template <typename Stack>
+static void push_pop(Stack &stk, const size_t n)
+{
+        int err = 0;
+
+        for (size_t i = 0; i < n; i++)
+                stk.push((int)i, &err);
+
+        test_check(stk.size() == n);
+
+        for (size_t i = n; i > 0; i--)
+                test_check(stk.pop(&err) == (int)(i - 1));
+
+        test_check(err == 0);
+        test_check(stk.empty());
+}
+
+static void test_protections()
+{
+        stack<int, PROTECT_NONE>          none;
+        stack<int, PROTECT_CANARY>        canary;
+        stack<int, PROTECT_HASH>          hash;
+        stack<int, PROTECT_FULL, no_log>  full;
+
+        push_pop(none,   1000);
+        push_pop(canary, 1000);
+        push_pop(hash,   1000);
+        push_pop(full,   1000);
+
+        test_check(full.verify() == 0);
+
+        /* Unprotected stack is never shrunk by pops */
+        test_check(none.capacity() > INLINE_CAP);
+        none.trim();
+        test_check(none.capacity() < 1000);
+}
+
+static void test_errors()
+{
+        stack<double, PROTECT_CANARY, no_log> stk;
+
+        int err = 0;
+        stk.pop(&err);
+        test_check(err == STK_EMPTY_POP);
+
+        err = 0;
+        test_check(stk.top(&err) == nullptr);
+        test_check(err == STK_EMPTY_POP);
+
+        err = 0;
+        stk.set_verify_policy(VERIFY_FULL + 1, VERIFY_PERIOD, &err);
+        test_check(err == STK_INVALID);
+
+        stack_params_t params;
+        params.factor = 1;
+
+        err = 0;
+        stack<double, PROTECT_CANARY, no_log> bad(params, &err);
+        test_check(err == STK_INVALID);
+
+        params.factor = SIZE_MAX / 2;
+
+        err = 0;
+        stack<double, PROTECT_CANARY, no_log> huge(params, &err);
+        test_check(err == STK_INVALID);
+        huge.push(1.0);
+        test_check(huge.pop() == 1.0);
+
+        stack_alloc_t alloc = {nullptr, nullptr, nullptr, nullptr};
+        params = stack_params_t();
+        params.alloc = &alloc;
+
+        err = 0;
+        stack<double, PROTECT_CANARY, no_log> no_alloc(params, &err);
+        test_check(err == STK_INVALID);
+}
+
+static void test_items()
+{
+        stack<std::string, PROTECT_CANARY, no_log> stk;
+
+        for (size_t i = 0; i < 100; i++)
+                stk.push(std::to_string(i));
+
+        stk.emplace(nullptr, (size_t)3, 'x');
+        test_check(*stk.top() == "xxx");
+        test_check(stk.pop() == "xxx");
+
+        for (size_t i = 100; i > 0; i--)
+                test_check(stk.pop() == std::to_string(i - 1));
+
+        test_check(stk.verify() == 0);
+}
+
+static void test_params()
+{
+        alloc_count_t count;
+        stack_alloc_t alloc = {count_alloc, count_realloc, count_free, &count};
+
+        stack_params_t params;
+        params.alloc        = &alloc;
+        params.inline_items = false;
+
+        {
+                stack<int, PROTECT_FULL, no_log> stk(params);
+                push_pop(stk, 100);
+        }
+
+        test_check(count.allocs > 0);
+        test_check(count.allocs == count.frees);
+
+        count = alloc_count_t();
+        params.inline_items = true;
+        {
+                stack<int, PROTECT_FULL, no_log> stk(params);
+                push_pop(stk, INLINE_CAP);
+                test_check(count.allocs == 0);
+
+                push_pop(stk, INLINE_CAP * 4);
+        }
+
+        test_check(count.allocs > 0);
+        test_check(count.allocs == count.frees);
+
+        /* Unprotected stack has no inline block */
+        count = alloc_count_t();
+        {
+                stack<int, PROTECT_NONE, no_log> plain(params);
+                push_pop(plain, 1);
+                test_check(count.allocs == 1);
+        }
+
+        test_check(count.frees == 1);
+
+        params = stack_params_t();
+        params.poison = POISON_LAZY;
+        params.alloc  = &POOL_ALLOC;
+
+        stack<int, PROTECT_FULL, no_log> pool(params);
+        push_pop(pool, 1000);
+        test_check(pool.verify() == 0);
+}
+
+static void test_corruption()
+{
+        stack<int, PROTECT_FULL, no_log> stk;
+        stk.push(1);
+
+        *stk.top() = 7;
+        test_check(stk.verify() & INVALID_HASH);
+
+        /* Verification policy is hashed too. Uninitialized inline block mustn't match the pattern */
+        typedef stack<int, PROTECT_FULL, no_log> full_stack;
+
+        alignas(full_stack) char bytes[sizeof(full_stack)] = {};
+        full_stack &policy = *new (bytes) full_stack;
+        policy.push(1);
+
+        const size_t pattern[] = {VERIFY_LEVEL, VERIFY_PERIOD};
+        size_t found = 0;
+
+        for (size_t i = 0; i + sizeof(pattern) <= sizeof(policy); i += sizeof(size_t)) {
+                if (!memcmp(bytes + i, pattern, sizeof(pattern))) {
+                        memset(bytes + i, 0, sizeof(size_t));
+                        found++;
+                        break;
+                }
+        }
+
+        test_check(found == 1);
+        test_check(policy.verify() & INVALID_HASH);
+
+        policy.~full_stack();
+}
+
+void generic_tests()
+{
+        test_protections();
+        test_errors();
+        test_items();
+        test_params();
+        test_corruption();
+}
@@ -0,0 +1,48 @@
+/**
+ * @file
+ * @brief  Sharded work pool tests
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include "../src/include/spool.h"
+#include "test.h"
+
+static const size_t N = 10000; /**< Items pushed by a test */
+
+static void test_spool()
+{
+        spool_t pool = {};
+        int err = 0;
+
+        construct_spool(&pool, 0, &err);
+        test_check(err);
+
+        err = 0;
+        construct_spool(&pool, 2, &err);
+        test_check(err == 0);
+
+        for (size_t i = 0; i < N; i++)
+                push_spool(&pool, 0, (item_t)i, &err);
+
+        test_check(pop_spool(&pool, 0, &err) == (item_t)(N - 1));
+
+        /* Empty shard steals the bottom item */
+        test_check(pop_spool(&pool, 1, &err) == 0);
+        test_check(err == 0);
+        test_check(verify_shard(&pool, 1) == 0);
+        test_check(verify_spool(&pool) == 0);
+
+        for (size_t i = 0; i < N - 2; i++)
+                pop_spool(&pool, 1, &err);
+
+        pop_spool(&pool, 0, &err);
+        test_check(err == STK_EMPTY_POP);
+
+        destruct_spool(&pool);
+}
+
+void spool_tests()
+{
+        test_spool();
+}
@@ -0,0 +1,38 @@
+/**
+ * @file
+ * @brief  Segmented stack tests
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include "../src/include/sstack.h"
+#include "test.h"
+
+static const size_t N = 10000; /**< Items pushed by a test */
+
+static void test_sstack()
+{
+        sstack_t stk = {};
+        int err = 0;
+        construct_sstack(&stk, nullptr, &err);
+
+        for (size_t i = 0; i < N; i++)
+                push_sstack(&stk, (item_t)i, &err);
+
+        test_check(err == 0);
+        test_check(verify_sstack(&stk) == 0);
+        test_check(verify_sstack_full(&stk) == 0);
+
+        for (size_t i = N; i > 0; i--)
+                test_check(pop_sstack(&stk, &err) == (item_t)(i - 1));
+
+        pop_sstack(&stk, &err);
+        test_check(err == STK_EMPTY_POP);
+
+        destruct_sstack(&stk);
+}
+
+void sstack_tests()
+{
+        test_sstack();
+}
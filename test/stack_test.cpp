@@ -0,0 +1,321 @@
+/**
+ * @file
+ * @brief  Stack tests
+ * @author d3phys
+ * @date   14.10.2021
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/include/stack.h"
+#include "test.h"
+
+static const size_t N = 1000; /**< Items pushed by a test */
+
+static void test_push_pop()
+{
+        stack_t stk = {};
+        int err = 0;
+
+        construct_stack(&stk, &err);
+        test_check(err == 0);
+
+        for (size_t i = 0; i < N; i++)
+                push_stack(&stk, (item_t)i, &err);
+
+        test_check(stk.size == N);
+        test_check(top_stack(&stk, &err) == (item_t)(N - 1));
+        test_check(verify_stack_full(&stk) == 0);
+
+        for (size_t i = N; i > 0; i--)
+                test_check(pop_stack(&stk, &err) == (item_t)(i - 1));
+
+        test_check(err == 0);
+        test_check(stk.size == 0);
+
+        pop_stack(&stk, &err);
+        test_check(err == STK_EMPTY_POP);
+
+        destruct_stack(&stk);
+}
+
+static void test_verify_policy()
+{
+        stack_t stk = {};
+        int err = 0;
+        construct_stack(&stk);
+
+        for (size_t i = 0; i < N; i++)
+                push_stack(&stk, (item_t)i);
+
+        set_verify_policy(&stk, VERIFY_FULL + 1, VERIFY_PERIOD, &err);
+        test_check(err == STK_INVALID);
+
+        err = 0;
+        set_verify_policy(&stk, VERIFY_SAMPLED, 16, &err);
+        test_check(err == 0);
+
+        for (size_t i = 0; i < N; i++)
+                pop_stack(&stk, &err);
+
+        test_check(err == 0);
+        test_check(verify_stack_full(&stk) == 0);
+
+        destruct_stack(&stk);
+}
+
+static void test_ranges()
+{
+        stack_t stk = {};
+        int err = 0;
+        construct_stack(&stk);
+
+        item_t items[N]  = {};
+        item_t popped[N] = {};
+        for (size_t i = 0; i < N; i++)
+                items[i] = (item_t)i;
+
+        push_stack_n(&stk, items, N, &err);
+        test_check(err == 0);
+
+        const item_t *top = peek_range(&stk, 3, &err);
+        test_check(top && top[2] == (item_t)(N - 1) && top[0] == (item_t)(N - 3));
+
+        pop_stack_n(&stk, popped, 10, &err);
+        test_check(popped[9] == (item_t)(N - 1) && popped[0] == (item_t)(N - 10));
+
+        update_stack(&stk, popped, 5, items, 2, &err);
+        test_check(err == 0);
+        test_check(stk.size == N - 13);
+        test_check(top_stack(&stk) == items[1]);
+
+        pop_stack_n(&stk, popped, N, &err);
+        test_check(err == STK_EMPTY_POP);
+        test_check(stk.size == N - 13);
+
+        test_check(peek_range(&stk, N, &err) == nullptr);
+
+        destruct_stack(&stk);
+}
+
+static void test_capacity()
+{
+        stack_t stk = {};
+        int err = 0;
+
+        stack_params_t params;
+        params.factor = 1;
+        construct_stack(&stk, &params, &err);
+        test_check(err == STK_INVALID);
+
+        /* Shrink threshold is factor^2, it mustn't overflow */
+        err = 0;
+        params.factor = SIZE_MAX / 2;
+        construct_stack(&stk, &params, &err);
+        test_check(err == STK_INVALID);
+
+        err = 0;
+        construct_stack(&stk);
+        reserve_stack(&stk, N, &err);
+        test_check(err == 0 && stk.capacity >= N);
+
+        push_stack(&stk, 1);
+        pop_stack(&stk);
+        test_check(stk.capacity >= N);
+
+        shrink_to_fit_stack(&stk, &err);
+        test_check(err == 0 && stk.capacity < N);
+
+        destruct_stack(&stk);
+}
+
+static void test_lazy_shrink()
+{
+        stack_t stk = {};
+        int err = 0;
+
+        /* Lazy policy shrinks after shrink_delay pops below the threshold only */
+        stack_params_t params;
+        params.shrink       = SHRINK_LAZY;
+        params.shrink_delay = 8;
+        construct_stack(&stk, &params);
+
+        for (size_t i = 0; i < N; i++)
+                push_stack(&stk, (item_t)i);
+
+        size_t capacity = stk.capacity;
+        for (size_t i = 0; i < N - 1; i++)
+                pop_stack(&stk);
+
+        test_check(stk.capacity < capacity);
+
+        trim_stack(&stk, &err);
+        test_check(err == 0);
+
+        destruct_stack(&stk);
+}
+
+static void test_dumps()
+{
+        stack_t stk = {};
+        int err = 0;
+
+        stack_params_t params;
+        params.poison = POISON_EAGER;
+        construct_stack(&stk, &params);
+
+        for (size_t i = 0; i < 3; i++)
+                push_stack(&stk, (item_t)i);
+
+        int fds[2] = {};
+        test_check(pipe(fds) == 0);
+
+        dump_stack_json(&stk, fds[1], DUMP_WINDOW, &err);
+        test_check(err == 0);
+        close(fds[1]);
+
+        char json[4096] = {};
+        ssize_t len = read(fds[0], json, sizeof(json) - 1);
+        close(fds[0]);
+
+        /* Poison ranges are inclusive */
+        char range[64] = {};
+        snprintf(range, sizeof(range), "{\"poison\":[3,%zu]}", stk.capacity - 1);
+        test_check(len > 0 && strstr(json, range));
+
+        err = 0;
+        dump_stack_json(&stk, -1, DUMP_WINDOW, &err);
+        test_check(err == STK_BAD_FILE);
+
+        dump_stack(&stk);
+        destruct_stack(&stk);
+
+        err = 0;
+        install_guard_handler(-1, &err);
+        test_check(err == STK_INVALID);
+}
+
+static void test_stats()
+{
+        stack_t stk = {};
+        int err = 0;
+        construct_stack(&stk);
+
+        enable_stack_stats(&stk, &err);
+
+#ifdef STACK_STATS
+        test_check(err == 0);
+
+        for (size_t i = 0; i < N; i++)
+                push_stack(&stk, (item_t)i);
+        pop_stack(&stk);
+
+        stack_stats_t stats = {};
+        stack_stats(&stk, &stats, &err);
+        test_check(err == 0);
+        test_check(stats.pushes == N && stats.pops == 1);
+        test_check(stats.peak_size == N);
+
+        reset_stack_stats(&stk);
+        stack_stats(&stk, &stats);
+        test_check(stats.pushes == 0);
+#else
+        test_check(err == STK_INVALID);
+#endif /* STACK_STATS */
+
+        destruct_stack(&stk);
+}
+
+static void test_fast()
+{
+        stack_t stk = {};
+        int err = 0;
+
+        stack_params_t params;
+        params.poison = POISON_NONE;
+        construct_stack(&stk, &params);
+        set_verify_policy(&stk, VERIFY_NONE);
+        reserve_stack(&stk, N);
+
+        for (size_t i = 0; i < N; i++)
+                push_fast(&stk, (item_t)i, &err);
+
+        test_check(top_fast(&stk) == (item_t)(N - 1));
+
+        for (size_t i = N; i > 0; i--)
+                test_check(pop_fast(&stk, &err) == (item_t)(i - 1));
+
+        test_check(err == 0);
+
+        pop_fast(&stk, &err);
+        test_check(err == STK_EMPTY_POP);
+
+        destruct_stack(&stk);
+
+        /* Lazy shrink goes the same way by fast and slow operations */
+        stack_t slow = {};
+
+        params.shrink       = SHRINK_LAZY;
+        params.shrink_delay = 4;
+        params.inline_items = false;
+        construct_stack(&stk,  &params);
+        construct_stack(&slow, &params);
+        set_verify_policy(&stk,  VERIFY_NONE);
+        set_verify_policy(&slow, VERIFY_NONE);
+
+        size_t same = 0;
+        unsigned seed = 1;
+        for (size_t i = 0; i < 100 * N; i++) {
+                seed = seed * 1103515245 + 12345;
+
+                if ((seed >> 16) % 2 || !slow.size) {
+                        push_fast (&stk,  (item_t)i);
+                        push_stack(&slow, (item_t)i);
+                } else {
+                        pop_fast (&stk);
+                        pop_stack(&slow);
+                }
+
+                same += stk.size == slow.size && stk.capacity == slow.capacity &&
+                        stk.low_pops == slow.low_pops;
+        }
+
+        test_check(same == 100 * N);
+
+        destruct_stack(&slow);
+        destruct_stack(&stk);
+}
+
+static void test_deep()
+{
+        stack_t stk = {};
+
+        stack_params_t params;
+        params.poison       = POISON_EAGER;
+        params.inline_items = false;
+        construct_stack(&stk, &params);
+
+        for (size_t i = 0; i < 10; i++)
+                push_stack(&stk, (item_t)i);
+
+        test_check(verify_stack_deep(&stk) == 0);
+
+        stk.items[stk.capacity - 1] = 0;
+        test_check(verify_stack_deep(&stk) & INVALID_POISON);
+
+        destruct_stack(&stk);
+}
+
+void stack_tests()
+{
+        test_push_pop();
+        test_verify_policy();
+        test_ranges();
+        test_capacity();
+        test_lazy_shrink();
+        test_dumps();
+        test_stats();
+        test_fast();
+        test_deep();
+}
@@ -0,0 +1,33 @@
+/**
+ * @file
+ * @brief  Stack tests runner
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * Exit status is 1 if any check failed.
+ */
+
+#include <stdio.h>
+#include "test.h"
+
+int test_failures = 0;
+
+int main()
+{
+        stack_tests();
+        generic_tests();
+        alloc_tests();
+        cstack_tests();
+        spool_tests();
+        sstack_tests();
+        batch_tests();
+        audit_tests();
+
+        if (test_failures) {
+                fprintf(stderr, "%d checks failed\n", test_failures);
+                return 1;
+        }
+
+        printf("All checks passed\n");
+        return 0;
+}
@@ -0,0 +1,35 @@
+/**
+ * @file
+ * @brief  Stack tests
+ * @author d3phys
+ * @date   14.10.2021
+ *
+ * Each test file has one entry point called by main() (see test.cpp).
+ * Failed checks are reported to stderr and counted, tests go on.
+ */
+
+#ifndef TEST_H_
+#define TEST_H_
+
+#include <stdio.h>
+
+extern int test_failures; /**< Failed checks */
+
+#define test_check(cond)                                                                        \
+        do {                                                                                    \
+                if (!(cond)) {                                                                  \
+                        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+                        test_failures++;                                                        \
+                }                                                                               \
+        } while (0)
+
+void stack_tests();
+void generic_tests();
+void alloc_tests();
+void cstack_tests();
+void spool_tests();
+void sstack_tests();
+void batch_tests();
+void audit_tests();
+
+#endif /* TEST_H_ */